@@ -3,14 +3,38 @@
 #endif
 
 #include <windows.h>
+#include <xmmintrin.h>
+#include <timeapi.h>
 #include <objidl.h>
 #include <gdiplus.h>
+#include <shlwapi.h>
 #include <uxtheme.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <filesystem>
 #include <fstream>
 
@@ -65,698 +89,7112 @@ Logger& file_logger()
 
 Logger& logger = file_logger();
 
-class DynamicsHandler;
-class CollisionHandler;
-class GraphicsHandler;
-class InputHandler;
-
-enum class KeyState { Up, Down };
-
-struct Size
-{
-  float width = 0.f, height = 0.f;
-};
+enum class FramePhase { Input = 0, Dynamics, Collision, Render, Cleanup, Count };
 
-struct Object
+const char* phase_name(FramePhase phase)
 {
-  Object(float x, float y, float vx, float vy, Size size) : 
-    x(x), y(y), vx(vx), vy(vy), size(size) {}
-
-  void handleDynamics();
-  void handleCollision(Object& other);
-  void handleGraphics(Gdiplus::Graphics& graphics);
-  void handleInput(KeyState state, int vkey);
-
-  float x = 0.f, y = 0.f;
-  float vx = 0.f, vy = 0.f;
-  Size size;
-  bool remove = false;
-
-  std::unique_ptr<DynamicsHandler> dynamics_handler_ = nullptr;
-  std::unique_ptr<CollisionHandler> collision_handler_ = nullptr;
-  std::unique_ptr<GraphicsHandler> graphics_handler_ = nullptr;
-  std::unique_ptr<InputHandler> input_handler_ = nullptr;
-};
+  switch (phase)
+  {
+  case FramePhase::Input: return "input";
+  case FramePhase::Dynamics: return "dynamics";
+  case FramePhase::Collision: return "collision";
+  case FramePhase::Render: return "render";
+  case FramePhase::Cleanup: return "cleanup";
+  default: return "unknown";
+  }
+}
 
-class DynamicsHandler
+// Counts heap allocations of the game loop thread, split by frame phase. The
+// counting itself is only compiled in with GAME2D_TRACK_ALLOCATIONS, which 
+// replaces the global operator new.
+class AllocationTracker
 {
 public:
-  virtual ~DynamicsHandler() {}
+  struct Counts
+  {
+    std::uint64_t allocations = 0;
+    std::uint64_t bytes = 0;
+  };
 
-  virtual void handleDynamics(Object& obj) = 0;
-};
+  using PhaseCounts = std::array<Counts, std::size_t(FramePhase::Count)>;
 
-class CollisionHandler
-{
-public:
-  virtual ~CollisionHandler() {}
+  static constexpr bool enabled()
+  {
+#ifdef GAME2D_TRACK_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+  }
 
-  virtual void acceptCollision(CollisionHandler& handler) = 0;
+  // Starts counting on the calling thread.
+  static void beginFrame();
+  static void setPhase(FramePhase phase);
 
-  virtual void handleCollision(class PlayerCollisionHandler& handler) = 0;
-  virtual void handleCollision(class TileCollisionHandler& handler) = 0;
-};
+  // Stops counting and returns the counts of the frame.
+  static PhaseCounts endFrame();
 
-class GraphicsHandler
-{
-public:
-  ~GraphicsHandler() {}
+  static void record(std::size_t bytes);
 
-  virtual void handleGraphics(Object& obj, Gdiplus::Graphics& graphics) = 0;
+private:
+  static thread_local bool active_;
+  static thread_local FramePhase phase_;
+  static thread_local PhaseCounts counts_;
 };
 
-class InputHandler
+thread_local bool AllocationTracker::active_ = false;
+thread_local FramePhase AllocationTracker::phase_ = FramePhase::Input;
+thread_local AllocationTracker::PhaseCounts AllocationTracker::counts_;
+
+void AllocationTracker::beginFrame()
 {
-public:
-  virtual ~InputHandler() {}
+  counts_ = PhaseCounts{};
+  phase_ = FramePhase::Input;
+  active_ = true;
+}
 
-  virtual void handleInput(Object& obj, KeyState state, int vkey) = 0;
-};
+void AllocationTracker::setPhase(FramePhase phase)
+{
+  phase_ = phase;
+}
 
-void Object::handleDynamics()
+AllocationTracker::PhaseCounts AllocationTracker::endFrame()
 {
-  if (dynamics_handler_)
-    dynamics_handler_->handleDynamics(*this);
+  active_ = false;
+  return counts_;
 }
 
-void Object::handleCollision(Object& other)
+void AllocationTracker::record(std::size_t bytes)
 {
-  if (collision_handler_ && other.collision_handler_)
-    other.collision_handler_->acceptCollision(*collision_handler_);
+  if (!active_) return;
+
+  auto& counts = counts_[std::size_t(phase_)];
+  ++counts.allocations;
+  counts.bytes += bytes;
 }
 
-void Object::handleGraphics(Gdiplus::Graphics& graphics)
+#ifdef GAME2D_TRACK_ALLOCATIONS
+void* operator new(std::size_t size)
 {
-  if (graphics_handler_)
-    graphics_handler_->handleGraphics(*this, graphics);
+  AllocationTracker::record(size);
+  if (auto ptr = std::malloc(size ? size : 1))
+    return ptr;
+
+  throw std::bad_alloc();
 }
 
-void Object::handleInput(KeyState state, int vkey)
+void operator delete(void* ptr) noexcept
 {
-  if(input_handler_)
-    input_handler_->handleInput(*this, state, vkey);
+  std::free(ptr);
 }
 
-struct Point
+void operator delete(void* ptr, std::size_t) noexcept
 {
-  int x = 0, y = 0;
-};
+  std::free(ptr);
+}
+#endif
 
-struct TileConfiguration
+// Linear allocator for data, which lives at most until the end of the 
+// current frame. Allocation is a pointer bump and everything is released at 
+// once by reset(). When a frame needs more than the capacity, the overflow is 
+// served from the heap and the buffer is enlarged at the next reset, so that
+// steady state frames do not touch the heap.
+class FrameArena
 {
-  int grid_width;
-  int grid_height;
+public:
+  explicit FrameArena(std::size_t capacity);
 
-  float tile_size;
-  const WCHAR* tile_bitmap;
-  std::vector<Point> tiles;
+  void* allocate(std::size_t bytes, std::size_t alignment);
+
+  void reset();
+
+  std::size_t capacity() const { return buffer_.size(); }
+  std::size_t highWaterMark() const { return high_water_mark_; }
+
+private:
+  std::vector<std::byte> buffer_;
+  std::size_t offset_ = 0;
+  std::size_t overflow_bytes_ = 0;
+  std::size_t high_water_mark_ = 0;
+  std::vector<std::unique_ptr<std::byte[]>> overflow_;
 };
 
-class LinearMotion : public DynamicsHandler
-{
-public:
-  LinearMotion() = default;
+FrameArena::FrameArena(std::size_t capacity) : buffer_(capacity) {}
 
-  void handleDynamics(Object& obj) override
+void* FrameArena::allocate(std::size_t bytes, std::size_t alignment)
+{
+  const auto base = reinterpret_cast<std::uintptr_t>(buffer_.data());
+  const auto aligned = (base + offset_ + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+  const auto end = aligned - base + bytes;
+  if (end <= buffer_.size())
   {
-    obj.x += obj.vx;
-    obj.y += obj.vy;
+    offset_ = end;
+    return reinterpret_cast<void*>(aligned);
   }
-};
 
-class GravitationalMotion : public DynamicsHandler
-{
-public:
-  explicit GravitationalMotion(float gravity) : gravity_(gravity) {}
+  overflow_bytes_ += bytes + alignment;
+  overflow_.emplace_back(std::make_unique<std::byte[]>(bytes + alignment));
+  const auto overflow_base = reinterpret_cast<std::uintptr_t>(overflow_.back().get());
+  return reinterpret_cast<void*>((overflow_base + alignment - 1) & ~(std::uintptr_t(alignment) - 1));
+}
 
-  void handleDynamics(Object& obj) override
+void FrameArena::reset()
+{
+  high_water_mark_ = std::max(high_water_mark_, offset_ + overflow_bytes_);
+  if (!overflow_.empty())
   {
-    obj.x += obj.vx;
-    obj.y += obj.vy;
-
-    obj.vy += gravity_;
+    overflow_.clear();
+    buffer_.resize(std::max(buffer_.size() * 2, high_water_mark_));
   }
 
-private:
-  float gravity_ = 0.f;
-};
+  offset_ = 0;
+  overflow_bytes_ = 0;
+}
+
+// One arena per thread, so that headless worlds can run on several threads.
+FrameArena& frame_arena()
+{
+  thread_local FrameArena arena(1 << 20);
+
+  return arena;
+}
 
-class TileCollisionHandler : public CollisionHandler
+// Standard allocator handing out frame arena memory. Deallocation is a no-op.
+template<typename T>
+class ArenaAllocator
 {
 public:
-  explicit TileCollisionHandler(Object& tile) : tile(tile) {}
+  using value_type = T;
 
-  void acceptCollision(CollisionHandler& handler) override
-  {
-    handler.handleCollision(*this);
-  }
+  ArenaAllocator() : arena_(&frame_arena()) {}
+  explicit ArenaAllocator(FrameArena& arena) : arena_(&arena) {}
 
-  void handleCollision(PlayerCollisionHandler& handler) override;
+  template<typename U>
+  ArenaAllocator(ArenaAllocator<U> const& other) : arena_(other.arena_) {}
 
-  void handleCollision(TileCollisionHandler& handler) override {}
+  T* allocate(std::size_t n) { return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T))); }
+  void deallocate(T*, std::size_t) {}
 
-  Object& tile;
+  template<typename U>
+  bool operator==(ArenaAllocator<U> const& other) const { return arena_ == other.arena_; }
+
+  template<typename U>
+  bool operator!=(ArenaAllocator<U> const& other) const { return arena_ != other.arena_; }
+
+private:
+  template<typename U>
+  friend class ArenaAllocator;
+
+  FrameArena* arena_;
 };
 
-class PlayerCollisionHandler : public CollisionHandler
+template<typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+// Class specific allocation from a free list of fixed size blocks. Freed 
+// blocks are reused, so objects created and destroyed repeatedly (e.g. 
+// bullets and their handlers) stop allocating once the pool has warmed up.
+template<typename T>
+class Pooled
 {
 public:
-  explicit PlayerCollisionHandler(Object& player) : player(player) {}
+  static void* operator new(std::size_t size);
+  static void operator delete(void* ptr, std::size_t size);
 
-  void acceptCollision(CollisionHandler& handler) override
-  {
-    handler.handleCollision(*this);
-  }
+  // Makes sure the pool can serve the given number of blocks.
+  static void reserve(std::size_t count);
 
-  void handleCollision(PlayerCollisionHandler& handler) override {}
+private:
+  struct Pool;
 
-  void handleCollision(TileCollisionHandler& handler) override
+  // The first block of a run holds the pool owning it, the others the object.
+  union Block
   {
-    const auto& tile = handler.tile;
-    const auto dx = player.x - tile.x;
-    const auto dy = player.y - tile.y;
+    Block* next;
+    Pool* owner;
+    alignas(std::max_align_t) std::byte storage[sizeof(std::max_align_t)];
+  };
 
-    const float min_x_dist = 0.5f * (player.size.width + tile.size.width);
-    const float min_y_dist = 0.5f * (player.size.height + tile.size.height);
-    const float overlap_x =  min_x_dist - abs(dx);
-    const float overlap_y = min_y_dist - abs(dy);
+  static constexpr std::size_t blocksPerObject() 
+  { 
+    return (sizeof(T) + sizeof(Block) - 1) / sizeof(Block); 
+  }
 
-    if (overlap_x > overlap_y)
-    {
-      // Move player in the y-direction away from the tile center.
-      player.y = tile.y + (dy > 0.f ? 1.f : -1.f) * min_y_dist;
-      player.vy = 0.f;
-    }
-    else
-    {
-      // Move player in the x-direction away from the tile center.
-      player.x = tile.x + (dx > 0.f ? 1.f : -1.f) * min_x_dist;
-      player.vx = 0.f;
-    }
+  struct Pool
+  {
+    Block* free_list = nullptr;
+    std::size_t free_count = 0;
+    std::vector<std::unique_ptr<Block[]>> chunks;
+  };
+
+  // Per thread, an object has to be deleted on the thread, which created it.
+  // Otherwise the block would end up on the free list of another thread and
+  // dangle, once the owning thread has exited, so this terminates.
+  static Pool& pool()
+  {
+    thread_local Pool pool;
+    return pool;
   }
 
-  Object& player;
+  static void addChunk(std::size_t count);
 };
 
-void TileCollisionHandler::handleCollision(PlayerCollisionHandler& handler)
+template<typename T>
+void* Pooled<T>::operator new(std::size_t size)
 {
-  handler.handleCollision(*this);
+  // Deleting through a base without a virtual destructor would hand the 
+  // block to the global operator delete.
+  static_assert(!std::is_polymorphic_v<T> || std::has_virtual_destructor_v<T>, 
+    "Pooled polymorphic classes need a virtual destructor.");
+
+  // Derived classes larger than T fall back to the heap.
+  if (size > blocksPerObject() * sizeof(Block))
+    return ::operator new(size);
+
+  auto& p = pool();
+  if (!p.free_list) addChunk(std::max<std::size_t>(p.chunks.size() * 64, 64));
+
+  auto block = p.free_list;
+  p.free_list = block->next;
+  --p.free_count;
+  return block;
 }
 
-class RectGraphics : public GraphicsHandler
+template<typename T>
+void Pooled<T>::operator delete(void* ptr, std::size_t size)
 {
-public:
-  RectGraphics(int width, int height);
+  if (!ptr) return;
 
-  void handleGraphics(Object& obj, Gdiplus::Graphics& graphics) override;
+  if (size > blocksPerObject() * sizeof(Block))
+  {
+    ::operator delete(ptr);
+    return;
+  }
 
-private:
-  int w_ = 0, h_ = 0;
-  Gdiplus::Pen pen_;
-};
+  auto& p = pool();
+  auto block = static_cast<Block*>(ptr);
+  if (block[-1].owner != &p)
+  {
+    logger << "Pooled object deleted on another thread than it was created on." << std::endl;
+    std::terminate();
+  }
 
-RectGraphics::RectGraphics(int width, int height) : 
-  w_(width), h_(height), pen_(Gdiplus::Color(255, 0, 0, 0)) {}
+  block->next = p.free_list;
+  p.free_list = block;
+  ++p.free_count;
+}
 
-void RectGraphics::handleGraphics(Object& obj, Gdiplus::Graphics& graphics)
+template<typename T>
+void Pooled<T>::reserve(std::size_t count)
 {
-  const auto x = int(obj.x) - w_ / 2;
-  const auto y = int(obj.y) - h_ / 2;
+  auto& p = pool();
+  if (p.free_count < count) addChunk(count - p.free_count);
+}
 
-  Gdiplus::Rect rect(x, y, w_, h_);
-  graphics.DrawRectangle(&pen_, rect);
+template<typename T>
+void Pooled<T>::addChunk(std::size_t count)
+{
+  // Every object occupies a run of consecutive blocks after its owner block,
+  // linked as one entry.
+  const auto stride = blocksPerObject() + 1;
+  auto& p = pool();
+  p.chunks.emplace_back(std::make_unique<Block[]>(count * stride));
+
+  auto blocks = p.chunks.back().get();
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    auto block = blocks + i * stride;
+    block->owner = &p;
+    ++block;
+    block->next = p.free_list;
+    p.free_list = block;
+  }
+  p.free_count += count;
 }
 
-class BitmapGraphics : public GraphicsHandler
+struct Object;
+class CollisionHandler;
+class GraphicsHandler;
+class InputHandler;
+struct RenderState;
+
+class DynamicsHandler
 {
 public:
-  BitmapGraphics(const WCHAR* file);
-
-  void handleGraphics(Object& obj, Gdiplus::Graphics& graphics) override;
+  virtual ~DynamicsHandler() {}
 
-private:
-  Gdiplus::Bitmap bitmap_;
+  virtual void handleDynamics(Object& obj) = 0;
 };
 
-BitmapGraphics::BitmapGraphics(const WCHAR* file) : bitmap_(file) {}
-
-void BitmapGraphics::handleGraphics(Object& obj, Gdiplus::Graphics& graphics)
-{
-  const int w = bitmap_.GetWidth();
-  const int h = bitmap_.GetHeight();
-  const int left = obj.x - w / 2;
-  const int top = obj.y - h / 2;
-  graphics.DrawImage(&bitmap_, left, top);
-}
-
-struct AnimationConfiguration
+// Final, so that calls through the concrete type are resolved at compile 
+// time and can be inlined.
+class LinearMotion final : public DynamicsHandler
 {
-  struct SingleAnimationConfiguration
-  {
-    std::string name;
-    float fps = 1.f;
-    std::vector<const WCHAR*> frame_files;
-  };
+public:
+  LinearMotion() = default;
 
-  std::vector<SingleAnimationConfiguration> single_animation_configs;
+  void handleDynamics(Object& obj) override;
 };
 
-class AnimationGraphics : public GraphicsHandler
+class GravitationalMotion final : public DynamicsHandler
 {
 public:
-  AnimationGraphics(AnimationConfiguration const& config);
+  explicit GravitationalMotion(float gravity) : gravity_(gravity) {}
 
-  void handleGraphics(Object& obj, Gdiplus::Graphics& graphics) override;
+  void handleDynamics(Object& obj) override;
 
-  void play();
-  void stop();
+private:
+  float gravity_ = 0.f;
+};
 
-  void setAnimation(std::string const& animation);
+class TileGrid;
+class ParticleSystem;
 
-  void flipHorizontally(bool flip);
-  void flipVertically(bool flip);
+// Linear motion, which casts the step of every tick against the tile grid 
+// instead of taking part in the collision detection. The object is removed
+// at the first solid cell and an impact effect is emitted there.
+class BulletMotion final : public DynamicsHandler
+{
+public:
+  BulletMotion(TileGrid const* grid, ParticleSystem* particles) : grid_(grid), particles_(particles) {}
 
-private:
-  struct SingleAnimationData
-  {
-    std::vector<std::unique_ptr<Gdiplus::Bitmap>> frames;
-    float frame_time_ms;
-    int current_frame_idx_ = 0;
-  };
+  void handleDynamics(Object& obj) override;
 
-  class FrameTimeout
-  {
-  public:
-    explicit FrameTimeout(float ms) : timeout_ms_(ms) 
-    {
-      start_ = std::chrono::high_resolution_clock::now();
-    }
+private:
+  TileGrid const* grid_ = nullptr;
+  ParticleSystem* particles_ = nullptr;
+};
 
-    bool is_out() const
-    {
-      const auto current = std::chrono::high_resolution_clock::now();
-      const auto diff = std::chrono::duration<float>(current - start_);
+// Closed set of motions stored in the object itself. Unlike the dynamics 
+// handler it needs no heap allocation and no virtual call.
+using Motion = std::variant<std::monostate, LinearMotion, GravitationalMotion, BulletMotion>;
 
-      return std::chrono::duration_cast<std::chrono::milliseconds>(diff).count() > timeout_ms_;
-    }
+// Closed set of colliders, dispatched with std::visit instead of the double
+// dispatch of the collision handlers. They point to the object's own handler.
+using Collider = std::variant<std::monostate, class PlayerCollisionHandler*, class TileCollisionHandler*>;
 
-    void reset()
-    {
-      start_ = std::chrono::high_resolution_clock::now();
-    }
+enum class KeyState { Up, Down };
 
-  private:
-    float timeout_ms_;
-    std::chrono::high_resolution_clock::time_point start_;
-  };
+enum class EntityKind : std::uint32_t { Generic = 0, Player, Tile, Bullet };
 
-  std::unordered_map<std::string, SingleAnimationData> animation_data_;
-  SingleAnimationData* current_animation_data_ = nullptr;
+// Static bodies never move. Kinematic bodies are moved only by their motion,
+// dynamic ones are also pushed around by collisions.
+enum class BodyType : std::uint8_t { Static, Kinematic, Dynamic };
 
-  std::unique_ptr<FrameTimeout> frame_timeout_;
+struct Size
+{
+  float width = 0.f, height = 0.f;
 };
 
-AnimationGraphics::AnimationGraphics(AnimationConfiguration const& config)
+// One bit per pixel of a sprite, set for the opaque ones. Rows are padded 
+// with a zero word, so that 64 pixels starting at any column can be read 
+// with two shifts. The bounds enclose the set bits.
+class CollisionMask
 {
-  for (const auto& single_animation_config : config.single_animation_configs)
+public:
+  // Pixels are 32 bit ARGB, the ones with at least half alpha are opaque.
+  CollisionMask(int width, int height, std::uint8_t const* pixels, std::ptrdiff_t stride);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Opaque bounds in pixels of the mask, excluding right and bottom. Empty,
+  // if no pixel is opaque.
+  int left() const { return left_; }
+  int top() const { return top_; }
+  int right() const { return right_; }
+  int bottom() const { return bottom_; }
+
+  // The 64 pixels of the row starting at the column. Pixels outside of the 
+  // mask are clear.
+  std::uint64_t bits(int x, int y) const
   {
-    SingleAnimationData single_data;
-    single_data.current_frame_idx_ = 0;
-    single_data.frame_time_ms = 1000.f / single_animation_config.fps;
+    if (y < 0 || y >= height_ || x <= -64 || x >= width_) return 0;
 
-    for (const auto& file : single_animation_config.frame_files)
-    {
-      single_data.frames.emplace_back(std::make_unique<Gdiplus::Bitmap>(file));
-    }
+    const auto row = rows_.data() + std::size_t(y) * words_;
+    if (x < 0) return row[0] << -x;
 
-    const auto animation_name = single_animation_config.name;
-    animation_data_.emplace(animation_name, std::move(single_data));
+    const auto word = x >> 6;
+    const auto shift = x & 63;
+    return shift == 0 ? row[word] : row[word] >> shift | row[word + 1] << (64 - shift);
   }
 
-  const auto& first_name = config.single_animation_configs.front().name;
-  current_animation_data_ = &(animation_data_.at(first_name));
-  frame_timeout_ = std::make_unique<FrameTimeout>(current_animation_data_->frame_time_ms);
-}
+private:
+  int width_ = 0, height_ = 0;
+  int words_ = 0;
+  int left_ = 0, top_ = 0, right_ = 0, bottom_ = 0;
+  std::vector<std::uint64_t> rows_;
+};
 
-void AnimationGraphics::handleGraphics(Object& obj, Gdiplus::Graphics& graphics)
+CollisionMask::CollisionMask(int width, int height, std::uint8_t const* pixels, std::ptrdiff_t stride) : 
+  width_(width), height_(height), words_((width + 63) / 64 + 1), left_(width), top_(height)
 {
-  if (!current_animation_data_) return;
-
-  if (frame_timeout_->is_out())
+  rows_.resize(std::size_t(words_) * height);
+  for (int y = 0; y < height; ++y)
   {
-    auto& data = current_animation_data_;
-    data->current_frame_idx_ = (data->current_frame_idx_ + 1) % data->frames.size();
+    const auto pixel = reinterpret_cast<std::uint32_t const*>(pixels + y * stride);
+    const auto row = rows_.data() + std::size_t(y) * words_;
+    for (int x = 0; x < width; ++x)
+    {
+      if ((pixel[x] >> 24) < 128) continue;
 
-    frame_timeout_->reset();
+      row[x >> 6] |= std::uint64_t(1) << (x & 63);
+      left_ = std::min(left_, x);
+      right_ = std::max(right_, x + 1);
+      top_ = std::min(top_, y);
+      bottom_ = y + 1;
+    }
   }
 
-  const auto& frame = current_animation_data_->frames.at(current_animation_data_->current_frame_idx_);
-
-  const int w = frame->GetWidth();
-  const int h = frame->GetHeight();
-  const int left = obj.x - w / 2;
-  const int top = obj.y - h / 2;
-  graphics.DrawImage(frame.get(), left, top);
+  if (right_ == 0) left_ = top_ = 0;
 }
 
-void AnimationGraphics::play()
+// Area of an object taking part in the collisions: center and half extents.
+struct CollisionBox
 {
-}
+  float x = 0.f, y = 0.f;
+  float half_width = 0.f, half_height = 0.f;
+};
 
-void AnimationGraphics::stop()
+struct Object : Pooled<Object>
 {
-}
+  Object(float x, float y, float vx, float vy, Size size) : 
+    x(x), y(y), vx(vx), vy(vy), size(size), id(next_id()) {}
 
-void AnimationGraphics::setAnimation(std::string const& animation)
-{
-  auto it = animation_data_.find(animation);
-  if (it == animation_data_.end()) return;
+  void handleDynamics();
+  // Adds the contacts with the other object to the buffer.
+  void handleCollision(Object& other, class ContactBuffer& contacts);
+  void handleGraphics(RenderState& state);
+  void updateGraphics(std::uint64_t tick, int animation_interval);
+  void handleInput(KeyState state, int vkey);
+  void faceLeft(bool left);
 
-  current_animation_data_ = &(it->second);
-  frame_timeout_ = std::make_unique<FrameTimeout>(current_animation_data_->frame_time_ms);
-}
+  void wake()
+  {
+    sleeping = false;
+    rest_ticks = 0;
+  }
 
-void AnimationGraphics::flipHorizontally(bool flip)
+  // The opaque bounds of the sprite centered at the position, if there is a
+  // collision mask, otherwise the size.
+  CollisionBox collisionBox() const
+  {
+    if (!collision_mask) return CollisionBox{ x, y, 0.5f * size.width, 0.5f * size.height };
+
+    const auto& mask = *collision_mask;
+    const auto left = x - 0.5f * mask.width() + mask.left();
+    const auto top = y - 0.5f * mask.height() + mask.top();
+    const auto half_width = 0.5f * (mask.right() - mask.left());
+    const auto half_height = 0.5f * (mask.bottom() - mask.top());
+    return CollisionBox{ left + half_width, top + half_height, half_width, half_height };
+  }
+
+  float x = 0.f, y = 0.f;
+  float vx = 0.f, vy = 0.f;
+  Size size;
+  bool remove = false;
+
+  // Opaque pixels of the sprite drawn last, owned by the graphics handler. 
+  // Objects without one collide as solid boxes.
+  CollisionMask const* collision_mask = nullptr;
+
+  // Identifies the object across snapshots.
+  std::uint32_t id = 0;
+  EntityKind kind = EntityKind::Generic;
+
+  BodyType body = BodyType::Dynamic;
+
+  // A dynamic body resting on something is put to sleep. Then it skips the
+  // dynamics and the collisions, until it is woken by a contact or input.
+  bool sleeping = false;
+  bool supported = false;
+  int rest_ticks = 0;
+
+  // Open behaviours. The dynamics handler takes precedence over the motion.
+  std::unique_ptr<DynamicsHandler> dynamics_handler_ = nullptr;
+  std::unique_ptr<CollisionHandler> collision_handler_ = nullptr;
+  std::unique_ptr<GraphicsHandler> graphics_handler_ = nullptr;
+  std::unique_ptr<InputHandler> input_handler_ = nullptr;
+
+  // Closed behaviours.
+  Motion motion;
+  Collider collider;
+
+  // Sets the collision handler, which is then also used as the collider.
+  template<typename Handler>
+  void setCollisionHandler(std::unique_ptr<Handler> handler)
+  {
+    collider = handler.get();
+    collision_handler_ = std::move(handler);
+  }
+
+private:
+  // Unique within a thread, which is all a world needs.
+  static std::uint32_t next_id()
+  {
+    thread_local std::uint32_t id = 0;
+    return ++id;
+  }
+};
+
+// Contact of a dynamic body with another body found by the narrow phase. The
+// normal points from the other body towards the dynamic one.
+struct Contact
+{
+  Object* body = nullptr;
+  Object const* other = nullptr;
+  float normal_x = 0.f, normal_y = 0.f;
+  float penetration = 0.f;
+
+  // Position of the body, when the contact was found.
+  float start_x = 0.f, start_y = 0.f;
+
+  // Accumulated normal impulse. Bodies have unit mass, so it is the change 
+  // of the velocity along the normal.
+  float impulse = 0.f;
+
+  // Identifies the pair across ticks.
+  std::uint64_t key() const { return std::uint64_t(body->id) << 32 | other->id; }
+};
+
+// Flat buffer, into which the narrow phase writes the contacts of a tick. 
+// Nothing is moved, until the solver resolves all of them together.
+class ContactBuffer
+{
+public:
+  void reserve(std::size_t count) { contacts_.reserve(count); }
+  void clear() { contacts_.clear(); }
+
+  void add(Object& body, Object const& other, float normal_x, float normal_y, float penetration)
+  {
+    contacts_.push_back(Contact{ &body, &other, normal_x, normal_y, penetration, body.x, body.y });
+  }
+
+  std::vector<Contact>& contacts() { return contacts_; }
+
+private:
+  std::vector<Contact> contacts_;
+};
+
+class CollisionHandler
+{
+public:
+  virtual ~CollisionHandler() {}
+
+  virtual void acceptCollision(CollisionHandler& handler, ContactBuffer& contacts) = 0;
+
+  virtual void handleCollision(class PlayerCollisionHandler& handler, ContactBuffer& contacts) = 0;
+  virtual void handleCollision(class TileCollisionHandler& handler, ContactBuffer& contacts) = 0;
+};
+
+class GraphicsHandler
+{
+public:
+  virtual ~GraphicsHandler() {}
+
+  // Adds the drawing of the object to the render state.
+  virtual void handleGraphics(Object& obj, RenderState& state) = 0;
+
+  // Called every simulation step, before the collisions. Animations advance
+  // only at ticks, which are a multiple of the interval (raised under load).
+  virtual void update(Object&, std::uint64_t /*tick*/, int /*animation_interval*/) {}
+
+  // Mirrors the drawing, e.g. to face the direction of the movement.
+  virtual void flipHorizontally(bool /*flip*/) {}
+};
+
+class InputHandler
+{
+public:
+  virtual ~InputHandler() {}
+
+  virtual void handleInput(Object& obj, KeyState state, int vkey) = 0;
+};
+
+void LinearMotion::handleDynamics(Object& obj)
 {
+  obj.x += obj.vx;
+  obj.y += obj.vy;
 }
 
-void AnimationGraphics::flipVertically(bool flip)
+void GravitationalMotion::handleDynamics(Object& obj)
 {
+  obj.x += obj.vx;
+  obj.y += obj.vy;
+
+  obj.vy += gravity_;
 }
 
-struct Configuration
+void Object::handleDynamics()
 {
-  struct
-  {
-    int window_width;
-    int window_height;
-    HINSTANCE instance;
-    int cmd_show;
-    float fps;
-  } game;
+  if (sleeping) return;
 
-  struct
+  if (dynamics_handler_)
   {
-    float v;
-    float g;
-    const WCHAR* bitmap;
-    Size size;
-    AnimationConfiguration anim_config;
-  } player;
+    dynamics_handler_->handleDynamics(*this);
+    return;
+  }
 
-  struct
-  {
-    float v;
-    const WCHAR* bitmap;
-    Size size;
-  } bullet;
+  std::visit([this](auto& alternative)
+    {
+      if constexpr (!std::is_same_v<std::decay_t<decltype(alternative)>, std::monostate>)
+        alternative.handleDynamics(*this);
+    }, motion);
+}
 
-  TileConfiguration tile_config;
-};
+void Object::handleGraphics(RenderState& state)
+{
+  if (graphics_handler_)
+    graphics_handler_->handleGraphics(*this, state);
+}
 
-Configuration read_config()
+void Object::updateGraphics(std::uint64_t tick, int animation_interval)
 {
-  Configuration config;
+  if (graphics_handler_)
+    graphics_handler_->update(*this, tick, animation_interval);
+}
 
-  config.game.window_width = 1000;
-  config.game.window_height = 800;
+void Object::handleInput(KeyState state, int vkey)
+{
+  if(input_handler_)
+    input_handler_->handleInput(*this, state, vkey);
+}
 
-  config.game.fps = 16;
+void Object::faceLeft(bool left)
+{
+  if (graphics_handler_)
+    graphics_handler_->flipHorizontally(left);
+}
 
-  config.player.v = .5f;
-  config.player.g = 0.1f;
-  config.player.bitmap = L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\shooter.jpg";
-  config.player.size = Size{ 50.f, 50.f };
-  auto& anim = config.player.anim_config;
-  AnimationConfiguration::SingleAnimationConfiguration walk_anim;
-  walk_anim.fps = 3.f;
-  walk_anim.name = "walk";
-  walk_anim.frame_files.push_back(L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\walking_1.png");
-  walk_anim.frame_files.push_back(L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\walking_2.png");
-  anim.single_animation_configs.push_back(walk_anim);
+struct Point
+{
+  int x = 0, y = 0;
+};
 
-  config.bullet.v = 3.f;
-  config.bullet.bitmap = L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\bullet.png";
-  config.bullet.size = Size{ 50.f, 50.f };
+// Same types as in the tiling tool.
+enum class TileType : std::uint8_t { Clear = 0, Ground, Wall, Water };
 
-  float tile_sz = 20.f;
-  config.tile_config.tile_size = tile_sz;
-  config.tile_config.grid_width = config.game.window_width / tile_sz;
-  config.tile_config.grid_height = config.game.window_height / tile_sz;
+// Water is simulated (see WaterSimulation) and does not block anything.
+inline bool is_solid(TileType type)
+{
+  return type == TileType::Ground || type == TileType::Wall;
+}
 
-  // Fill bottom row of the window with tiles.
-  const auto grid_y = config.tile_config.grid_height - 5;
-  auto& tiles = config.tile_config.tiles;
-  for (int i = 3; i < config.tile_config.grid_width - 4; ++i)
-    tiles.push_back(Point{ i, grid_y });
+struct Tile
+{
+  Point pos;
+  TileType type = TileType::Ground;
+};
 
-  return config;
-}
+struct TileConfiguration
+{
+  int grid_width;
+  int grid_height;
 
-class PlayerInput : public InputHandler
+  float tile_size;
+  const WCHAR* tile_bitmap;
+  std::vector<Tile> tiles;
+};
+
+// Rectangle of grid cells.
+struct GridRect
+{
+  int x = 0, y = 0;
+  int width = 0, height = 0;
+};
+
+// Dense grid of tile types. Cells outside of the grid are clear.
+class TileGrid
 {
 public:
-  explicit PlayerInput(Configuration const& config, std::vector<std::unique_ptr<Object>>& objects);
+  explicit TileGrid(TileConfiguration const& config);
 
-  void handleInput(Object& obj, KeyState state, int vkey) override;
+  int width() const { return width_; }
+  int height() const { return height_; }
+  float tileSize() const { return tile_size_; }
 
-public:
-  void createBullet(Object& obj);
+  bool contains(int x, int y) const { return x >= 0 && y >= 0 && x < width_ && y < height_; }
 
-  float v_ = 0.f;
-  float v_bullet_ = 0.f;
-  Size bullet_size_;
-  const WCHAR* bullet_bitmap_;
-  std::vector<std::unique_ptr<Object>>& objects_;
+  TileType at(int x, int y) const { return contains(x, y) ? cells_[y * width_ + x] : TileType::Clear; }
+  bool isSolid(int x, int y) const { return is_solid(at(x, y)); }
 
-  int last_dir_ = VK_RIGHT;
+  void set(int x, int y, TileType type);
+
+  // Cell containing the world coordinate (not clamped to the grid).
+  int cellX(float x) const { return int(std::floor(x / tile_size_)); }
+  int cellY(float y) const { return int(std::floor(y / tile_size_)); }
+
+  struct RayHit
+  {
+    bool hit = false;
+    int cell_x = 0, cell_y = 0;
+
+    // Point, where the ray enters the cell, and its distance from the origin.
+    float x = 0.f, y = 0.f;
+    float distance = 0.f;
+
+    // Outward normal of the face, which has been hit. Zero, if the ray 
+    // started inside a solid cell.
+    int normal_x = 0, normal_y = 0;
+  };
+
+  // First solid cell along the ray (the direction need not be normalized)
+  // within the distance. Visits the cells with a DDA walk, so the cost is 
+  // proportional to the number of crossed cells.
+  RayHit raycast(float x, float y, float dir_x, float dir_y, float max_distance) const;
+
+  // First solid cell on the segment between both points.
+  RayHit segmentCast(float x_0, float y_0, float x_1, float y_1) const;
+
+  bool lineOfSight(float x_0, float y_0, float x_1, float y_1) const { return !segmentCast(x_0, y_0, x_1, y_1).hit; }
+
+  // Cells of the grid overlapping the world rectangle (right and bottom 
+  // exclusive), clamped to the grid.
+  GridRect cellsOverlapping(float left, float top, float right, float bottom) const;
+
+  bool overlapsSolid(float left, float top, float right, float bottom) const;
+
+  // Calls visit(cell_x, cell_y) for every solid cell overlapping the rectangle.
+  template<typename Visit>
+  void querySolid(float left, float top, float right, float bottom, Visit&& visit) const;
+
+private:
+  int width_ = 0;
+  int height_ = 0;
+  float tile_size_ = 1.f;
+  std::vector<TileType> cells_;
 };
 
-PlayerInput::PlayerInput(Configuration const& config, std::vector<std::unique_ptr<Object>>& objects) :
-  v_(config.player.v), v_bullet_(config.bullet.v), bullet_bitmap_(config.bullet.bitmap),
-  bullet_size_(config.bullet.size), objects_(objects) {}
+TileGrid::TileGrid(TileConfiguration const& config) :
+  width_(config.grid_width), height_(config.grid_height), tile_size_(config.tile_size)
+{
+  cells_.resize(width_ * height_, TileType::Clear);
+  for (const auto& tile : config.tiles)
+    set(tile.pos.x, tile.pos.y, tile.type);
+}
 
-void PlayerInput::handleInput(Object& obj, KeyState state, int vkey)
+void TileGrid::set(int x, int y, TileType type)
 {
-  // Handle movement.
-  if (state == KeyState::Down)
+  if (contains(x, y))
+    cells_[y * width_ + x] = type;
+}
+
+TileGrid::RayHit TileGrid::raycast(float x, float y, float dir_x, float dir_y, float max_distance) const
+{
+  RayHit result;
+
+  const auto length = std::sqrt(dir_x * dir_x + dir_y * dir_y);
+  if (length == 0.f)
   {
-    if (vkey == VK_LEFT)
-    {
-      last_dir_ = vkey;
-      obj.vx = -v_;
-    }
-    else if (vkey == VK_RIGHT)
-    {
-      last_dir_ = vkey;
-      obj.vx = v_;
-    }
-    else if (vkey == VK_UP)
+    result.hit = isSolid(cellX(x), cellY(y));
+    result.cell_x = cellX(x);
+    result.cell_y = cellY(y);
+    result.x = x;
+    result.y = y;
+    return result;
+  }
+
+  dir_x /= length;
+  dir_y /= length;
+
+  // Clip the ray to the grid, cells outside of it are clear anyway. Remember 
+  // the axis, through which the ray enters.
+  float t_enter = 0.f;
+  float t_exit = max_distance;
+  int enter_axis = -1;
+  const float origin[2] = { x, y };
+  const float dir[2] = { dir_x, dir_y };
+  const float extent[2] = { width_ * tile_size_, height_ * tile_size_ };
+  for (int axis = 0; axis < 2; ++axis)
+  {
+    if (dir[axis] == 0.f)
     {
-      obj.vy = -v_;
+      if (origin[axis] < 0.f || origin[axis] >= extent[axis]) return result;
+      continue;
     }
-    else if (vkey == VK_DOWN)
+
+    auto t_0 = (0.f - origin[axis]) / dir[axis];
+    auto t_1 = (extent[axis] - origin[axis]) / dir[axis];
+    if (t_0 > t_1) std::swap(t_0, t_1);
+    if (t_0 > t_enter)
     {
-      obj.vy = v_;
+      t_enter = t_0;
+      enter_axis = axis;
     }
+    t_exit = std::min(t_exit, t_1);
   }
-  else // KeyState::Up
+  if (t_enter > t_exit) return result;
+
+  const int step_x = dir_x > 0.f ? 1 : -1;
+  const int step_y = dir_y > 0.f ? 1 : -1;
+  int cell_x = std::clamp(cellX(x + dir_x * t_enter), 0, width_ - 1);
+  int cell_y = std::clamp(cellY(y + dir_y * t_enter), 0, height_ - 1);
+  int normal_x = enter_axis == 0 ? -step_x : 0;
+  int normal_y = enter_axis == 1 ? -step_y : 0;
+
+  // Distances along the ray to the next vertical and horizontal cell border
+  // and between two consecutive ones.
+  constexpr auto infinity = std::numeric_limits<float>::infinity();
+  const auto t_delta_x = dir_x != 0.f ? tile_size_ / std::abs(dir_x) : infinity;
+  const auto t_delta_y = dir_y != 0.f ? tile_size_ / std::abs(dir_y) : infinity;
+  auto t_max_x = dir_x != 0.f ? ((cell_x + (step_x > 0 ? 1 : 0)) * tile_size_ - x) / dir_x : infinity;
+  auto t_max_y = dir_y != 0.f ? ((cell_y + (step_y > 0 ? 1 : 0)) * tile_size_ - y) / dir_y : infinity;
+
+  auto t = t_enter;
+  while (t <= t_exit && contains(cell_x, cell_y))
   {
-    if (vkey == VK_LEFT && obj.vx < 0.f)
+    if (isSolid(cell_x, cell_y))
     {
-      obj.vx = 0.f;
+      result.hit = true;
+      result.cell_x = cell_x;
+      result.cell_y = cell_y;
+      result.x = x + dir_x * t;
+      result.y = y + dir_y * t;
+      result.distance = t;
+      result.normal_x = normal_x;
+      result.normal_y = normal_y;
+      return result;
     }
-    else if (vkey == VK_RIGHT && obj.vx > 0.f)
-    {
-      obj.vx = 0.f;
-    }
-    else if (vkey == VK_UP && obj.vy < 0.f)
+
+    if (t_max_x < t_max_y)
     {
-      obj.vy = 0.f;
+      t = t_max_x;
+      t_max_x += t_delta_x;
+      cell_x += step_x;
+      normal_x = -step_x;
+      normal_y = 0;
     }
-    else if (vkey == VK_DOWN && obj.vy > 0.f)
+    else
     {
-      obj.vy = 0.f;
+      t = t_max_y;
+      t_max_y += t_delta_y;
+      cell_y += step_y;
+      normal_x = 0;
+      normal_y = -step_y;
     }
   }
 
-  if (vkey == VK_SPACE && state == KeyState::Down)
+  return result;
+}
+
+TileGrid::RayHit TileGrid::segmentCast(float x_0, float y_0, float x_1, float y_1) const
+{
+  const auto dx = x_1 - x_0;
+  const auto dy = y_1 - y_0;
+  return raycast(x_0, y_0, dx, dy, std::sqrt(dx * dx + dy * dy));
+}
+
+GridRect TileGrid::cellsOverlapping(float left, float top, float right, float bottom) const
+{
+  const auto first_x = std::max(cellX(left), 0);
+  const auto first_y = std::max(cellY(top), 0);
+  const auto last_x = std::min(int(std::ceil(right / tile_size_)) - 1, width_ - 1);
+  const auto last_y = std::min(int(std::ceil(bottom / tile_size_)) - 1, height_ - 1);
+  if (last_x < first_x || last_y < first_y) return GridRect{};
+
+  return GridRect{ first_x, first_y, last_x - first_x + 1, last_y - first_y + 1 };
+}
+
+bool TileGrid::overlapsSolid(float left, float top, float right, float bottom) const
+{
+  const auto cells = cellsOverlapping(left, top, right, bottom);
+  for (int y = cells.y; y < cells.y + cells.height; ++y)
   {
-    createBullet(obj);
+    const auto row = &cells_[y * width_];
+    for (int x = cells.x; x < cells.x + cells.width; ++x)
+      if (is_solid(row[x])) return true;
   }
+
+  return false;
 }
 
-void PlayerInput::createBullet(Object& obj)
+template<typename Visit>
+void TileGrid::querySolid(float left, float top, float right, float bottom, Visit&& visit) const
 {
-  // We only consider left and right direction.
-  const auto dir = last_dir_ == VK_LEFT ? -1.f : 1.f;
+  const auto cells = cellsOverlapping(left, top, right, bottom);
+  for (int y = cells.y; y < cells.y + cells.height; ++y)
+  {
+    const auto row = &cells_[y * width_];
+    for (int x = cells.x; x < cells.x + cells.width; ++x)
+      if (is_solid(row[x])) visit(x, y);
+  }
+}
+
+enum class ParticleColor : std::uint8_t { Spark = 0, Fire, Dust, Smoke, Count };
+
+Gdiplus::Color particle_color(ParticleColor color)
+{
+  switch (color)
+  {
+  case ParticleColor::Spark: return Gdiplus::Color(255, 255, 230, 120);
+  case ParticleColor::Fire: return Gdiplus::Color(255, 255, 140, 30);
+  case ParticleColor::Dust: return Gdiplus::Color(200, 150, 130, 100);
+  default: return Gdiplus::Color(150, 90, 90, 90);
+  }
+}
+
+// Everything needed to draw a frame. Filled by the simulation and only read 
+// by the render thread, once it has been published. Sprites keep their 
+// bitmaps alive, even if the objects are gone in the meantime.
+struct RenderState
+{
+  struct Item
+  {
+    // Image centered at the position, if set. Otherwise the outline of the 
+    // rectangle centered at the position.
+    std::shared_ptr<Gdiplus::Bitmap> bitmap;
+    Gdiplus::ARGB color = 0;
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+  };
+
+  // Cell rectangles are reserved for the water as well as the fog.
+  void reserve(std::size_t items, std::size_t particles, std::size_t cell_rects);
+  void clear();
+
+  void addSprite(std::shared_ptr<Gdiplus::Bitmap> const& bitmap, float x, float y);
+  void addOutline(Gdiplus::ARGB color, float x, float y, int width, int height);
+
+  std::uint64_t tick = 0;
+
+  // Time of the earliest input reflected in this state (zero if none).
+  std::chrono::steady_clock::time_point input_time{};
+
+  // In drawing order.
+  std::vector<Item> items;
+
+  // Particle rectangles sorted by color, the colors start at the offsets.
+  std::vector<Gdiplus::RectF> particle_rects;
+  std::array<std::size_t, int(ParticleColor::Count) + 1> particle_offsets{};
+
+  std::vector<Gdiplus::RectF> water_rects;
+
+  // Cells out of the line of sight of the player.
+  std::vector<Gdiplus::RectF> fog_rects;
+};
+
+void RenderState::reserve(std::size_t item_count, std::size_t particle_count, std::size_t cell_rect_count)
+{
+  items.reserve(item_count);
+  particle_rects.reserve(particle_count);
+  water_rects.reserve(cell_rect_count);
+  fog_rects.reserve(cell_rect_count);
+}
+
+void RenderState::clear()
+{
+  tick = 0;
+  input_time = {};
+  items.clear();
+  particle_rects.clear();
+  particle_offsets.fill(0);
+  water_rects.clear();
+  fog_rects.clear();
+}
+
+void RenderState::addSprite(std::shared_ptr<Gdiplus::Bitmap> const& bitmap, float x, float y)
+{
+  Item item;
+  item.bitmap = bitmap;
+  item.x = int(x);
+  item.y = int(y);
+  items.push_back(std::move(item));
+}
+
+void RenderState::addOutline(Gdiplus::ARGB color, float x, float y, int width, int height)
+{
+  Item item;
+  item.color = color;
+  item.x = int(x);
+  item.y = int(y);
+  item.width = width;
+  item.height = height;
+  items.push_back(std::move(item));
+}
+
+// Short-lived visual effects, which are not objects. The particles are stored
+// as a structure of arrays of fixed capacity, updated four at a time with SSE,
+// compacted once their lifetime is over and drawn in a single batch per color.
+class ParticleSystem
+{
+public:
+  ParticleSystem(std::size_t capacity, float gravity, float world_width, float world_height, std::uint32_t seed = 0x2545f491);
+
+  // Emits count particles at (x, y) flying in directions within the spread 
+  // (in radians) around the angle. Particles exceeding the capacity are 
+  // dropped. The lifetime is in ticks.
+  void emit(float x, float y, int count, float angle, float spread, float speed, int lifetime, ParticleColor color);
+
+  void update();
+
+  // While disabled, nothing is emitted. Disabling removes the live particles.
+  void setEnabled(bool enabled);
+
+  // Adds the particles sorted by color to the render state.
+  void publish(RenderState& state) const;
+
+  std::size_t size() const { return count_; }
+  std::size_t capacity() const { return capacity_; }
+  std::size_t peak() const { return peak_; }
+  std::size_t dropped() const { return dropped_; }
+
+private:
+  static constexpr int color_count = int(ParticleColor::Count);
+
+  // Uniformly distributed in [0, 1).
+  float nextRandom();
+
+  void compact();
+
+  std::size_t capacity_ = 0;
+  std::size_t count_ = 0;
+  std::size_t peak_ = 0;
+  std::size_t dropped_ = 0;
+  bool enabled_ = true;
+
+  float gravity_ = 0.f;
+  float world_width_ = 0.f;
+  float world_height_ = 0.f;
+
+  // Padded to a multiple of four, so that the update needs no scalar tail.
+  std::vector<float> x_, y_, vx_, vy_, life_;
+  std::vector<ParticleColor> color_;
+
+  std::uint32_t random_ = 0;
+};
+
+ParticleSystem::ParticleSystem(std::size_t capacity, float gravity, float world_width, float world_height, std::uint32_t seed) :
+  capacity_(capacity), gravity_(gravity), world_width_(world_width), world_height_(world_height), random_(seed)
+{
+  const auto padded = (capacity + 3) & ~std::size_t(3);
+  for (auto array : { &x_, &y_, &vx_, &vy_, &life_ })
+    array->resize(padded, 0.f);
+  color_.resize(padded, ParticleColor::Spark);
+}
+
+float ParticleSystem::nextRandom()
+{
+  // Xorshift, good enough for effects.
+  random_ ^= random_ << 13;
+  random_ ^= random_ >> 17;
+  random_ ^= random_ << 5;
+  return (random_ >> 8) * (1.f / 16777216.f);
+}
+
+void ParticleSystem::emit(float x, float y, int count, float angle, float spread, float speed, int lifetime, ParticleColor color)
+{
+  if (!enabled_) return;
+
+  const auto emitted = std::min(std::size_t(count), capacity_ - count_);
+  dropped_ += count - emitted;
+
+  for (std::size_t k = 0; k < emitted; ++k, ++count_)
+  {
+    const auto dir = angle + (nextRandom() - 0.5f) * spread;
+    const auto v = speed * (0.5f + 0.5f * nextRandom());
+    x_[count_] = x;
+    y_[count_] = y;
+    vx_[count_] = v * std::cos(dir);
+    vy_[count_] = v * std::sin(dir);
+    life_[count_] = lifetime * (0.5f + 0.5f * nextRandom());
+    color_[count_] = color;
+  }
+
+  peak_ = std::max(peak_, count_);
+}
+
+void ParticleSystem::setEnabled(bool enabled)
+{
+  enabled_ = enabled;
+  if (!enabled) count_ = 0;
+}
+
+void ParticleSystem::update()
+{
+  const auto gravity = _mm_set1_ps(gravity_);
+  const auto one = _mm_set1_ps(1.f);
+
+  // The padding behind the live particles is updated as well, it is never 
+  // read otherwise.
+  const auto padded = (count_ + 3) & ~std::size_t(3);
+  for (std::size_t i = 0; i < padded; i += 4)
+  {
+    const auto vy = _mm_add_ps(_mm_loadu_ps(&vy_[i]), gravity);
+    _mm_storeu_ps(&x_[i], _mm_add_ps(_mm_loadu_ps(&x_[i]), _mm_loadu_ps(&vx_[i])));
+    _mm_storeu_ps(&y_[i], _mm_add_ps(_mm_loadu_ps(&y_[i]), vy));
+    _mm_storeu_ps(&vy_[i], vy);
+    _mm_storeu_ps(&life_[i], _mm_sub_ps(_mm_loadu_ps(&life_[i]), one));
+  }
+
+  compact();
+}
+
+void ParticleSystem::compact()
+{
+  // Branchless: every particle is copied to the write position, which only 
+  // advances for the living ones.
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < count_; ++i)
+  {
+    const bool alive = life_[i] > 0.f && 
+      x_[i] >= 0.f && x_[i] < world_width_ && y_[i] >= 0.f && y_[i] < world_height_;
+
+    x_[kept] = x_[i];
+    y_[kept] = y_[i];
+    vx_[kept] = vx_[i];
+    vy_[kept] = vy_[i];
+    life_[kept] = life_[i];
+    color_[kept] = color_[i];
+    kept += alive;
+  }
+
+  count_ = kept;
+}
+
+// Sparks and dust flying off the face with the outward normal.
+void emit_impact(ParticleSystem& particles, float x, float y, int normal_x, int normal_y)
+{
+  const auto angle = std::atan2(float(normal_y), float(normal_x));
+  particles.emit(x, y, 48, angle, 2.f, 4.f, 20, ParticleColor::Spark);
+  particles.emit(x, y, 16, angle, 2.5f, 3.f, 12, ParticleColor::Fire);
+  particles.emit(x, y, 32, angle, 1.5f, 1.5f, 32, ParticleColor::Dust);
+}
+
+void BulletMotion::handleDynamics(Object& obj)
+{
+  const auto hit = grid_ ? grid_->segmentCast(obj.x, obj.y, obj.x + obj.vx, obj.y + obj.vy) : TileGrid::RayHit{};
+  if (!hit.hit)
+  {
+    obj.x += obj.vx;
+    obj.y += obj.vy;
+    return;
+  }
+
+  obj.x = hit.x;
+  obj.y = hit.y;
+  obj.remove = true;
+
+  if (!particles_) return;
+
+  // Fired from inside a tile, the effect goes back towards the shooter.
+  auto normal_x = hit.normal_x;
+  auto normal_y = hit.normal_y;
+  if (normal_x == 0 && normal_y == 0) normal_x = obj.vx > 0.f ? -1 : 1;
+
+  emit_impact(*particles_, hit.x, hit.y, normal_x, normal_y);
+}
+
+void ParticleSystem::publish(RenderState& state) const
+{
+  // Counting sort by color, so that each color is drawn with a single call.
+  auto& offsets = state.particle_offsets;
+  offsets.fill(0);
+  for (std::size_t i = 0; i < count_; ++i)
+    ++offsets[int(color_[i]) + 1];
+  for (int c = 0; c < color_count; ++c)
+    offsets[c + 1] += offsets[c];
+
+  state.particle_rects.resize(count_);
+  auto next = offsets;
+  for (std::size_t i = 0; i < count_; ++i)
+    state.particle_rects[next[int(color_[i])]++] = Gdiplus::RectF(x_[i] - 1.f, y_[i] - 1.f, 2.f, 2.f);
+}
+
+class TileCollisionHandler final : public CollisionHandler
+{
+public:
+  explicit TileCollisionHandler(Object& tile) : tile(tile) {}
+
+  // Tile covering the cells of the grid. Knowing the neighbouring cells 
+  // enables it to avoid pushing objects out through faces shared with other
+  // tiles.
+  TileCollisionHandler(Object& tile, TileGrid const& grid, GridRect cells) : 
+    tile(tile), grid_(&grid), cells_(cells) {}
+
+  void acceptCollision(CollisionHandler& handler, ContactBuffer& contacts) override
+  {
+    handler.handleCollision(*this, contacts);
+  }
+
+  void handleCollision(PlayerCollisionHandler& handler, ContactBuffer& contacts) override;
+
+  void handleCollision(TileCollisionHandler& handler, ContactBuffer& contacts) override {}
+
+  // Checks whether the face with the outward normal (dir_x, dir_y) is covered 
+  // by a solid neighbour next to the point (x, y). Such a face is a seam 
+  // between two tiles and no object can be legitimately pushed through it.
+  bool isFaceInternal(int dir_x, int dir_y, float x, float y) const;
+
+  Object& tile;
+
+private:
+  TileGrid const* grid_ = nullptr;
+  GridRect cells_;
+};
+
+bool TileCollisionHandler::isFaceInternal(int dir_x, int dir_y, float x, float y) const
+{
+  if (!grid_) return false;
+
+  // Cell of the rectangle closest to the point, then step across the face.
+  auto cell_x = std::clamp(grid_->cellX(x), cells_.x, cells_.x + cells_.width - 1);
+  auto cell_y = std::clamp(grid_->cellY(y), cells_.y, cells_.y + cells_.height - 1);
+  if (dir_x < 0) cell_x = cells_.x - 1;
+  if (dir_x > 0) cell_x = cells_.x + cells_.width;
+  if (dir_y < 0) cell_y = cells_.y - 1;
+  if (dir_y > 0) cell_y = cells_.y + cells_.height;
+
+  return grid_->isSolid(cell_x, cell_y);
+}
+
+class PlayerCollisionHandler final : public CollisionHandler
+{
+public:
+  explicit PlayerCollisionHandler(Object& player) : player(player) {}
+
+  void acceptCollision(CollisionHandler& handler, ContactBuffer& contacts) override
+  {
+    handler.handleCollision(*this, contacts);
+  }
+
+  void handleCollision(PlayerCollisionHandler& handler, ContactBuffer& contacts) override {}
+
+  // Only finds the contact. It is resolved by the contact solver together 
+  // with all other contacts of the tick.
+  void handleCollision(TileCollisionHandler& handler, ContactBuffer& contacts) override
+  {
+    const auto& tile = handler.tile;
+    const auto player_box = player.collisionBox();
+    const auto tile_box = tile.collisionBox();
+    const auto dx = player_box.x - tile_box.x;
+    const auto dy = player_box.y - tile_box.y;
+
+    const float min_x_dist = player_box.half_width + tile_box.half_width;
+    const float min_y_dist = player_box.half_height + tile_box.half_height;
+    const float overlap_x =  min_x_dist - abs(dx);
+    const float overlap_y = min_y_dist - abs(dy);
+
+    // Resolve along the axis of the smaller overlap, unless that would push 
+    // the player through a seam with a neighbouring tile (e.g. when walking 
+    // over the boundary of two ground tiles).
+    const int dir_x = dx > 0.f ? 1 : -1;
+    const int dir_y = dy > 0.f ? 1 : -1;
+    const bool x_internal = handler.isFaceInternal(dir_x, 0, player_box.x, player_box.y);
+    const bool y_internal = handler.isFaceInternal(0, dir_y, player_box.x, player_box.y);
+
+    bool resolve_y = overlap_x > overlap_y;
+    if (resolve_y && y_internal && !x_internal) resolve_y = false;
+    else if (!resolve_y && x_internal && !y_internal) resolve_y = true;
+
+    // Push the player away from the tile center.
+    if (resolve_y)
+      contacts.add(player, tile, 0.f, float(dir_y), overlap_y);
+    else
+      contacts.add(player, tile, float(dir_x), 0.f, overlap_x);
+  }
+
+  Object& player;
+};
+
+void TileCollisionHandler::handleCollision(PlayerCollisionHandler& handler, ContactBuffer& contacts)
+{
+  handler.handleCollision(*this, contacts);
+}
+
+// Pairs of colliders, which interact. All other pairs are ignored.
+void collide(PlayerCollisionHandler* player, TileCollisionHandler* tile, ContactBuffer& contacts) 
+{ 
+  player->handleCollision(*tile, contacts); 
+}
+
+void collide(TileCollisionHandler* tile, PlayerCollisionHandler* player, ContactBuffer& contacts) 
+{ 
+  player->handleCollision(*tile, contacts); 
+}
+
+template<typename A, typename B>
+void collide(A, B, ContactBuffer&) {}
+
+void Object::handleCollision(Object& other, ContactBuffer& contacts)
+{
+  if (collider.index() != 0 && other.collider.index() != 0)
+  {
+    std::visit([&contacts](auto self, auto other) { collide(self, other, contacts); }, collider, other.collider);
+    return;
+  }
+
+  if (collision_handler_ && other.collision_handler_)
+    other.collision_handler_->acceptCollision(*collision_handler_, contacts);
+}
+
+// Resolves the contacts of a tick in batch, so that the result does not 
+// depend on the order of the objects and a body touching several tiles is 
+// pushed out only once. The other body of a contact is not moved (it is a 
+// tile).
+//
+// Velocities are solved with sequential impulses. The accumulated impulse of
+// a pair is kept for the next ticks and applied up front (warm starting), so 
+// that a resting body starts the iterations close to the solution. Then the 
+// remaining penetration is removed from the positions.
+class ContactSolver
+{
+public:
+  ContactSolver(int velocity_iterations, int position_iterations);
+
+  void reserve(std::size_t count);
+  void solve(ContactBuffer& buffer);
+
+  // Forgets the impulses, e.g. after the bodies have been teleported.
+  void reset() { cache_.clear(); }
+
+  void writeReport(Logger& log) const;
+
+private:
+  // Iterations stop, once no impulse changes by more than this.
+  static constexpr float impulse_tolerance = 1e-4f;
+
+  // A body resting on the ground touches it only every other tick (it sinks 
+  // by the gravity of a tick and is pushed back in the next one), so a pair 
+  // is remembered also over a tick without contact.
+  static constexpr int max_missed_ticks = 1;
+
+  struct CachedContact
+  {
+    std::uint64_t key;
+    float normal_x, normal_y;
+    float impulse;
+    int missed_ticks;
+  };
+
+  int velocity_iterations_ = 0;
+  int position_iterations_ = 0;
+
+  // Contacts of the previous ticks sorted by key.
+  std::vector<CachedContact> cache_;
+  std::vector<CachedContact> next_cache_;
+
+  std::uint64_t ticks_ = 0;
+  std::uint64_t solved_ticks_ = 0;
+  std::uint64_t contacts_ = 0;
+  std::uint64_t warm_started_ = 0;
+  std::uint64_t iterations_ = 0;
+};
+
+ContactSolver::ContactSolver(int velocity_iterations, int position_iterations) : 
+  velocity_iterations_(velocity_iterations), position_iterations_(position_iterations) {}
+
+void ContactSolver::reserve(std::size_t count)
+{
+  cache_.reserve(count);
+  next_cache_.reserve(count);
+}
+
+void ContactSolver::solve(ContactBuffer& buffer)
+{
+  auto& contacts = buffer.contacts();
+  ++ticks_;
+  contacts_ += contacts.size();
+
+  // Sorted by pair, the solution is independent of the order of the objects
+  // and the previous tick can be matched with a single merge.
+  std::sort(contacts.begin(), contacts.end(), 
+    [](Contact const& a, Contact const& b) { return a.key() < b.key(); });
+
+  auto cached = cache_.cbegin();
+  for (auto& contact : contacts)
+  {
+    const auto key = contact.key();
+    while (cached != cache_.cend() && cached->key < key) ++cached;
+
+    // The impulse is reused only, if the pair still touches on the same side.
+    if (cached != cache_.cend() && cached->key == key && 
+        cached->normal_x == contact.normal_x && cached->normal_y == contact.normal_y)
+    {
+      contact.impulse = cached->impulse;
+      contact.body->vx += contact.impulse * contact.normal_x;
+      contact.body->vy += contact.impulse * contact.normal_y;
+      ++warm_started_;
+    }
+  }
+
+  if (!contacts.empty()) ++solved_ticks_;
+  for (int iteration = 0; iteration < velocity_iterations_ && !contacts.empty(); ++iteration)
+  {
+    ++iterations_;
+
+    float max_change = 0.f;
+    for (auto& contact : contacts)
+    {
+      // The bodies must not approach each other. Only pushing is allowed, so 
+      // the accumulated impulse is clamped and not the change in this step.
+      auto& body = *contact.body;
+      const auto separating = body.vx * contact.normal_x + body.vy * contact.normal_y;
+      const auto impulse = std::max(contact.impulse - separating, 0.f);
+      const auto change = impulse - contact.impulse;
+      contact.impulse = impulse;
+
+      body.vx += change * contact.normal_x;
+      body.vy += change * contact.normal_y;
+      max_change = std::max(max_change, std::abs(change));
+    }
+
+    if (max_change <= impulse_tolerance) break;
+  }
+
+  // Each contact removes what is left of its penetration after the other 
+  // contacts of the body have moved it, e.g. a body sunk into two adjacent
+  // tiles is lifted only once.
+  for (int iteration = 0; iteration < position_iterations_; ++iteration)
+  {
+    bool moved = false;
+    for (auto& contact : contacts)
+    {
+      auto& body = *contact.body;
+      const auto separated = (body.x - contact.start_x) * contact.normal_x + (body.y - contact.start_y) * contact.normal_y;
+      const auto penetration = contact.penetration - separated;
+      if (penetration <= 0.f) continue;
+
+      body.x += penetration * contact.normal_x;
+      body.y += penetration * contact.normal_y;
+      moved = true;
+    }
+
+    if (!moved) break;
+  }
+
+  // Merge the contacts into the cache, pairs not touching any more are kept 
+  // for a while.
+  next_cache_.clear();
+  auto keep = [this](CachedContact const& cached) 
+    {
+      if (cached.missed_ticks < max_missed_ticks)
+      {
+        next_cache_.push_back(cached);
+        ++next_cache_.back().missed_ticks;
+      }
+    };
+
+  auto old = cache_.cbegin();
+  for (const auto& contact : contacts)
+  {
+    // Standing on the other body.
+    if (contact.normal_y < 0.f) contact.body->supported = true;
+
+    const auto key = contact.key();
+    for (; old != cache_.cend() && old->key <= key; ++old)
+      if (old->key < key) keep(*old);
+
+    next_cache_.push_back(CachedContact{ key, contact.normal_x, contact.normal_y, contact.impulse, 0 });
+  }
+
+  for (; old != cache_.cend(); ++old)
+    keep(*old);
+  std::swap(cache_, next_cache_);
+}
+
+void ContactSolver::writeReport(Logger& log) const
+{
+  if (ticks_ == 0 || solved_ticks_ == 0) return;
+
+  log << "Contacts: " << double(contacts_) / ticks_ << " per tick, " 
+    << 100.0 * warm_started_ / contacts_ << " % warm started, " 
+    << double(iterations_) / solved_ticks_ << " velocity iterations per tick with contacts (max " 
+    << velocity_iterations_ << ")" << std::endl;
+}
+
+// Updates the motion of the objects grouped by the type of their motion, so 
+// that each group is a tight loop with the motion inlined. Objects with a 
+// dynamics handler are updated through the virtual call.
+class MotionSystem
+{
+public:
+  void reserve(std::size_t count);
+
+  // Regroups the objects, needed whenever objects have been added or removed.
+  void rebuild(std::vector<std::unique_ptr<Object>> const& objects);
+
+  void update();
+
+  std::size_t objectCount() const { return object_count_; }
+
+private:
+  template<std::size_t... I>
+  void updateArchetypes(std::index_sequence<I...>) { (updateArchetype<I>(), ...); }
+
+  template<std::size_t I>
+  void updateArchetype();
+
+  std::array<std::vector<Object*>, std::variant_size_v<Motion>> archetypes_;
+  std::vector<Object*> handled_;
+  std::size_t object_count_ = 0;
+};
+
+void MotionSystem::reserve(std::size_t count)
+{
+  for (auto& archetype : archetypes_)
+    archetype.reserve(count);
+  handled_.reserve(count);
+}
+
+void MotionSystem::rebuild(std::vector<std::unique_ptr<Object>> const& objects)
+{
+  for (auto& archetype : archetypes_)
+    archetype.clear();
+  handled_.clear();
+  object_count_ = objects.size();
+
+  for (const auto& obj : objects)
+  {
+    if (obj->dynamics_handler_)
+      handled_.push_back(obj.get());
+    else
+      archetypes_[obj->motion.index()].push_back(obj.get());
+  }
+}
+
+void MotionSystem::update()
+{
+  updateArchetypes(std::make_index_sequence<std::variant_size_v<Motion>>());
+
+  for (auto obj : handled_)
+  {
+    if (!obj->sleeping)
+      obj->dynamics_handler_->handleDynamics(*obj);
+  }
+}
+
+template<std::size_t I>
+void MotionSystem::updateArchetype()
+{
+  using M = std::variant_alternative_t<I, Motion>;
+  if constexpr (!std::is_same_v<M, std::monostate>)
+  {
+    for (auto obj : archetypes_[I])
+    {
+      if (!obj->sleeping)
+        std::get_if<I>(&obj->motion)->handleDynamics(*obj);
+    }
+  }
+}
+
+// Fixed number of worker threads executing submitted tasks in FIFO order.
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned thread_count = std::max(1u, std::thread::hardware_concurrency()));
+  ~ThreadPool();
+
+  template<typename F>
+  auto submit(F&& task) -> std::future<decltype(task())>;
+
+  std::size_t size() const { return threads_.size(); }
+
+  // Index of the calling thread among the threads of this pool, -1 for any 
+  // other thread.
+  int workerIndex() const { return current_pool_ == this ? current_index_ : -1; }
+
+private:
+  void work(int index);
+
+  static thread_local ThreadPool const* current_pool_;
+  static thread_local int current_index_;
+
+  std::vector<std::thread> threads_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+thread_local ThreadPool const* ThreadPool::current_pool_ = nullptr;
+thread_local int ThreadPool::current_index_ = -1;
+
+ThreadPool::ThreadPool(unsigned thread_count)
+{
+  for (unsigned i = 0; i < thread_count; ++i)
+    threads_.emplace_back([this, i]() { work(int(i)); });
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+template<typename F>
+auto ThreadPool::submit(F&& task) -> std::future<decltype(task())>
+{
+  // std::function requires a copyable callable, hence the shared pointer.
+  using Result = decltype(task());
+  auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+  auto future = packaged->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace([packaged]() { (*packaged)(); });
+  }
+  cv_.notify_one();
+
+  return future;
+}
+
+void ThreadPool::work(int index)
+{
+  current_pool_ = this;
+  current_index_ = index;
+
+  while (true)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (stop_ && tasks_.empty()) return;
+
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+
+    task();
+  }
+}
+
+// Cost of entering a cell for walking agents. Ground and walls are blocked,
+// water slows down.
+float path_cost(TileType type)
+{
+  switch (type)
+  {
+  case TileType::Clear: return 1.f;
+  case TileType::Water: return 3.f;
+  default: return std::numeric_limits<float>::infinity();
+  }
+}
+
+// Cells from the start to the goal, both included.
+using Path = std::vector<Point>;
+
+// Entry of the open list of a search. The heap is ordered by the priority,
+// ties are broken towards the deeper entry.
+struct SearchEntry
+{
+  float priority;
+  float cost;
+  int node;
+
+  bool operator>(SearchEntry const& other) const
+  {
+    return priority > other.priority || (priority == other.priority && cost < other.cost);
+  }
+};
+
+// A* and Dijkstra over the cells of a rectangle of the grid (4-connected). 
+// The arrays only cover the rectangle and are kept between searches. Their 
+// entries belong to the current search only if the stamp matches, so they 
+// never need to be cleared.
+class GridSearch
+{
+public:
+  explicit GridSearch(TileGrid const& grid) : grid_(grid) {}
+
+  // Cost of the cheapest path, infinity if there is none. The path is 
+  // appended, if requested.
+  float findPath(Point start, Point goal, GridRect const& bounds, Path* path);
+
+  // Costs of the cheapest paths from the origin to each target or, in 
+  // reverse, from each target to the origin.
+  void findCosts(Point origin, GridRect const& bounds, Point const* targets, std::size_t count, 
+    float* costs, bool reverse);
+
+  std::size_t bytes() const;
+
+private:
+  static constexpr float infinity = std::numeric_limits<float>::infinity();
+
+  // Expands the cells reachable from the origin in the order of cost plus 
+  // heuristic, until done(x, y) returns true for an expanded cell. In reverse
+  // the cost of a step is the cost of the cell left instead of entered.
+  template<typename Heuristic, typename Done>
+  void expand(Point origin, GridRect const& bounds, bool reverse, Heuristic&& heuristic, Done&& done);
+
+  bool contains(int x, int y) const
+  {
+    return x >= bounds_.x && y >= bounds_.y && x < bounds_.x + bounds_.width && y < bounds_.y + bounds_.height;
+  }
+
+  int index(int x, int y) const { return (y - bounds_.y) * bounds_.width + x - bounds_.x; }
+  float costAt(int node) const { return stamps_[node] == stamp_ ? costs_[node] : infinity; }
+
+  TileGrid const& grid_;
+  GridRect bounds_;
+
+  std::vector<float> costs_;
+  std::vector<int> parents_;
+  std::vector<std::uint32_t> stamps_;
+  std::uint32_t stamp_ = 0;
+  std::vector<SearchEntry> open_;
+};
+
+template<typename Heuristic, typename Done>
+void GridSearch::expand(Point origin, GridRect const& bounds, bool reverse, Heuristic&& heuristic, Done&& done)
+{
+  static constexpr Point steps[] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+
+  bounds_ = bounds;
+  const auto area = std::size_t(bounds.width) * bounds.height;
+  if (costs_.size() < area)
+  {
+    costs_.resize(area);
+    parents_.resize(area);
+    stamps_.resize(area, 0);
+  }
+  if (++stamp_ == 0)
+  {
+    std::fill(stamps_.begin(), stamps_.end(), 0);
+    stamp_ = 1;
+  }
+  open_.clear();
+
+  const auto visit = [this](int node, float cost, int parent)
+    {
+      stamps_[node] = stamp_;
+      costs_[node] = cost;
+      parents_[node] = parent;
+    };
+
+  const auto start = index(origin.x, origin.y);
+  visit(start, 0.f, -1);
+  open_.push_back(SearchEntry{ heuristic(origin.x, origin.y), 0.f, start });
+  while (!open_.empty())
+  {
+    std::pop_heap(open_.begin(), open_.end(), std::greater<>());
+    const auto entry = open_.back();
+    open_.pop_back();
+    if (entry.cost > costs_[entry.node]) continue;
+
+    const auto x = bounds.x + entry.node % bounds.width;
+    const auto y = bounds.y + entry.node / bounds.width;
+    if (done(x, y)) return;
+
+    const auto leave_cost = path_cost(grid_.at(x, y));
+    for (const auto& step : steps)
+    {
+      const auto next_x = x + step.x;
+      const auto next_y = y + step.y;
+      if (!contains(next_x, next_y)) continue;
+
+      const auto enter_cost = path_cost(grid_.at(next_x, next_y));
+      if (enter_cost == infinity) continue;
+
+      const auto cost = entry.cost + (reverse ? leave_cost : enter_cost);
+      const auto next = index(next_x, next_y);
+      if (cost >= costAt(next)) continue;
+
+      visit(next, cost, entry.node);
+      open_.push_back(SearchEntry{ cost + heuristic(next_x, next_y), cost, next });
+      std::push_heap(open_.begin(), open_.end(), std::greater<>());
+    }
+  }
+}
+
+float GridSearch::findPath(Point start, Point goal, GridRect const& bounds, Path* path)
+{
+  bounds_ = bounds;
+  if (!contains(start.x, start.y) || !contains(goal.x, goal.y)) return infinity;
+  if (path_cost(grid_.at(start.x, start.y)) == infinity || path_cost(grid_.at(goal.x, goal.y)) == infinity) 
+    return infinity;
+
+  // Every step costs at least one.
+  expand(start, bounds, false, 
+    [goal](int x, int y) { return float(std::abs(goal.x - x) + std::abs(goal.y - y)); },
+    [goal](int x, int y) { return x == goal.x && y == goal.y; });
+
+  const auto goal_node = index(goal.x, goal.y);
+  const auto cost = costAt(goal_node);
+  if (path && cost < infinity)
+  {
+    const auto first = path->size();
+    for (auto node = goal_node; node >= 0; node = parents_[node])
+      path->push_back(Point{ bounds.x + node % bounds.width, bounds.y + node / bounds.width });
+    std::reverse(path->begin() + first, path->end());
+  }
+
+  return cost;
+}
+
+void GridSearch::findCosts(Point origin, GridRect const& bounds, Point const* targets, std::size_t count, 
+  float* costs, bool reverse)
+{
+  bounds_ = bounds;
+  if (!contains(origin.x, origin.y) || path_cost(grid_.at(origin.x, origin.y)) == infinity)
+  {
+    std::fill(costs, costs + count, infinity);
+    return;
+  }
+
+  // Clusters are small, so everything reachable is expanded.
+  expand(origin, bounds, reverse, [](int, int) { return 0.f; }, [](int, int) { return false; });
+
+  for (std::size_t i = 0; i < count; ++i)
+    costs[i] = contains(targets[i].x, targets[i].y) ? costAt(index(targets[i].x, targets[i].y)) : infinity;
+}
+
+std::size_t GridSearch::bytes() const
+{
+  return costs_.capacity() * sizeof(float) + parents_.capacity() * sizeof(int) + 
+    stamps_.capacity() * sizeof(std::uint32_t) + open_.capacity() * sizeof(SearchEntry);
+}
+
+// Hierarchical A* (HPA*). The grid is partitioned into square clusters. Runs
+// of passable cells on both sides of a border between two clusters form 
+// entrances, each with one or two transitions. The abstract graph connects 
+// the transition cells across the borders and, with the costs of the paths 
+// within the cluster, to the other transition cells of the same cluster. A 
+// query searches the small abstract graph and refines only the segments of 
+// the result, with searches confined to single clusters.
+//
+// Changed cells invalidate their cluster. The next update rebuilds its 
+// borders and the clusters sharing them, the rest of the graph is kept.
+class HierarchicalPathfinder
+{
+public:
+  HierarchicalPathfinder(TileGrid const& grid, int cluster_size);
+
+  // The cell has been changed in the grid.
+  void invalidate(int x, int y);
+
+  // Rebuilds the invalidated clusters. Must not run concurrently with queries.
+  void update();
+
+  // State of the queries of a single thread.
+  struct Workspace
+  {
+    explicit Workspace(TileGrid const& grid) : search(grid) {}
+
+    std::size_t bytes() const;
+
+    GridSearch search;
+    std::vector<float> costs;
+    std::vector<int> parents;
+    std::vector<std::uint32_t> stamps;
+    std::uint32_t stamp = 0;
+    std::vector<SearchEntry> open;
+    std::vector<Point> targets;
+    std::vector<float> start_costs;
+    std::vector<float> goal_costs;
+    std::vector<int> nodes;
+  };
+
+  // Appends the path and returns its cost, infinity if there is none. The 
+  // graph must be up to date.
+  float findPath(Point start, Point goal, Path& path, Workspace& workspace) const;
+
+  struct Query
+  {
+    Point start, goal;
+  };
+
+  // Updates the graph, then answers the queries on the thread pool. Paths,
+  // which do not exist, are empty.
+  void findPaths(std::vector<Query> const& queries, std::vector<Path>& paths, ThreadPool& pool);
+
+  std::size_t clusterCount() const { return clusters_.size(); }
+  std::size_t nodeCount() const { return cluster_of_node_.size(); }
+  std::size_t bytes() const;
+  std::uint64_t rebuiltClusters() const { return rebuilt_clusters_; }
+
+private:
+  static constexpr float infinity = std::numeric_limits<float>::infinity();
+
+  // Entrances up to this length have a single transition in their middle,
+  // longer ones one at each end.
+  static constexpr int max_single_transition = 6;
+
+  enum Side { Left, Right, Top, Bottom, SideCount };
+
+  struct Transition
+  {
+    Point cell;
+    Side side;
+
+    // Index of the transition along its border.
+    int index;
+  };
+
+  struct Cluster
+  {
+    GridRect bounds;
+    std::vector<Transition> transitions;
+
+    // Index of the first transition of each side.
+    std::array<int, SideCount> side_offsets{};
+
+    // Costs between the transitions within the cluster, row major.
+    std::vector<float> costs;
+  };
+
+  int clusterAt(int x, int y) const { return (y / cluster_size_) * clusters_x_ + x / cluster_size_; }
+
+  // Neighbour across the side, -1 at the edge of the grid.
+  int neighbour(int cluster, Side side) const;
+
+  // Positions of the transitions on the border between the cluster and its 
+  // neighbour to the right or below.
+  void buildBorder(int cluster, bool vertical);
+  void buildCluster(int cluster);
+
+  // Node of the abstract graph behind the transition.
+  int across(int cluster, Transition const& transition) const;
+
+  TileGrid const& grid_;
+  int cluster_size_ = 0;
+  int clusters_x_ = 0;
+  int clusters_y_ = 0;
+
+  std::vector<Cluster> clusters_;
+  std::vector<std::vector<int>> vertical_borders_;
+  std::vector<std::vector<int>> horizontal_borders_;
+
+  // The abstract nodes are the transitions numbered cluster by cluster.
+  std::vector<int> first_node_;
+  std::vector<int> cluster_of_node_;
+
+  std::vector<char> dirty_;
+  std::vector<int> dirty_clusters_;
+  std::vector<char> affected_;
+  GridSearch build_search_;
+
+  std::uint64_t rebuilt_clusters_ = 0;
+};
+
+HierarchicalPathfinder::HierarchicalPathfinder(TileGrid const& grid, int cluster_size) : 
+  grid_(grid), cluster_size_(cluster_size), 
+  clusters_x_((grid.width() + cluster_size - 1) / cluster_size), 
+  clusters_y_((grid.height() + cluster_size - 1) / cluster_size),
+  build_search_(grid)
+{
+  const auto count = std::size_t(clusters_x_) * clusters_y_;
+  clusters_.resize(count);
+  vertical_borders_.resize(count);
+  horizontal_borders_.resize(count);
+  first_node_.resize(count + 1, 0);
+  dirty_.resize(count, 1);
+  affected_.resize(count, 0);
+
+  for (int cy = 0; cy < clusters_y_; ++cy)
+  {
+    for (int cx = 0; cx < clusters_x_; ++cx)
+    {
+      const auto x = cx * cluster_size_;
+      const auto y = cy * cluster_size_;
+      clusters_[cy * clusters_x_ + cx].bounds = GridRect{ x, y, 
+        std::min(cluster_size_, grid.width() - x), std::min(cluster_size_, grid.height() - y) };
+      dirty_clusters_.push_back(cy * clusters_x_ + cx);
+    }
+  }
+
+  update();
+}
+
+void HierarchicalPathfinder::invalidate(int x, int y)
+{
+  if (!grid_.contains(x, y)) return;
+
+  const auto cluster = clusterAt(x, y);
+  if (dirty_[cluster]) return;
+
+  dirty_[cluster] = 1;
+  dirty_clusters_.push_back(cluster);
+}
+
+int HierarchicalPathfinder::neighbour(int cluster, Side side) const
+{
+  const auto cx = cluster % clusters_x_;
+  const auto cy = cluster / clusters_x_;
+  switch (side)
+  {
+  case Left: return cx > 0 ? cluster - 1 : -1;
+  case Right: return cx + 1 < clusters_x_ ? cluster + 1 : -1;
+  case Top: return cy > 0 ? cluster - clusters_x_ : -1;
+  case Bottom: return cy + 1 < clusters_y_ ? cluster + clusters_x_ : -1;
+  default: return -1;
+  }
+}
+
+void HierarchicalPathfinder::update()
+{
+  if (dirty_clusters_.empty()) return;
+
+  // Borders of the invalidated clusters, then all clusters sharing them.
+  for (const auto cluster : dirty_clusters_)
+  {
+    for (const auto side : { Left, Right, Top, Bottom })
+    {
+      const auto other = neighbour(cluster, side);
+      if (other < 0) continue;
+
+      if (side == Right || side == Bottom) buildBorder(cluster, side == Right);
+      else buildBorder(other, side == Left);
+      affected_[other] = 1;
+    }
+    affected_[cluster] = 1;
+    dirty_[cluster] = 0;
+  }
+  dirty_clusters_.clear();
+
+  for (std::size_t cluster = 0; cluster < clusters_.size(); ++cluster)
+  {
+    if (!affected_[cluster]) continue;
+
+    buildCluster(int(cluster));
+    affected_[cluster] = 0;
+    ++rebuilt_clusters_;
+  }
+
+  // Renumber the abstract nodes.
+  cluster_of_node_.clear();
+  for (std::size_t cluster = 0; cluster < clusters_.size(); ++cluster)
+  {
+    first_node_[cluster] = int(cluster_of_node_.size());
+    cluster_of_node_.insert(cluster_of_node_.end(), clusters_[cluster].transitions.size(), int(cluster));
+  }
+  first_node_.back() = int(cluster_of_node_.size());
+}
+
+void HierarchicalPathfinder::buildBorder(int cluster, bool vertical)
+{
+  const auto& bounds = clusters_[cluster].bounds;
+  auto& positions = vertical ? vertical_borders_[cluster] : horizontal_borders_[cluster];
+  positions.clear();
+
+  // Cells on both sides of the border at the position along it.
+  const auto passable = [&](int position)
+    {
+      const auto x = vertical ? bounds.x + bounds.width - 1 : position;
+      const auto y = vertical ? position : bounds.y + bounds.height - 1;
+      return path_cost(grid_.at(x, y)) != infinity && 
+        path_cost(grid_.at(x + int(vertical), y + int(!vertical))) != infinity;
+    };
+
+  const auto begin = vertical ? bounds.y : bounds.x;
+  const auto end = begin + (vertical ? bounds.height : bounds.width);
+  for (int position = begin; position < end;)
+  {
+    if (!passable(position))
+    {
+      ++position;
+      continue;
+    }
+
+    const auto first = position;
+    while (position < end && passable(position)) ++position;
+    const auto last = position - 1;
+
+    if (last - first + 1 <= max_single_transition)
+    {
+      positions.push_back((first + last) / 2);
+    }
+    else
+    {
+      positions.push_back(first);
+      positions.push_back(last);
+    }
+  }
+}
+
+void HierarchicalPathfinder::buildCluster(int cluster)
+{
+  auto& data = clusters_[cluster];
+  const auto& bounds = data.bounds;
+  data.transitions.clear();
+
+  const auto add_side = [&](Side side, std::vector<int> const& positions)
+    {
+      data.side_offsets[side] = int(data.transitions.size());
+      for (std::size_t i = 0; i < positions.size(); ++i)
+      {
+        Point cell;
+        switch (side)
+        {
+        case Left: cell = Point{ bounds.x, positions[i] }; break;
+        case Right: cell = Point{ bounds.x + bounds.width - 1, positions[i] }; break;
+        case Top: cell = Point{ positions[i], bounds.y }; break;
+        default: cell = Point{ positions[i], bounds.y + bounds.height - 1 }; break;
+        }
+        data.transitions.push_back(Transition{ cell, side, int(i) });
+      }
+    };
+
+  static const std::vector<int> none;
+  const auto left = neighbour(cluster, Left);
+  const auto top = neighbour(cluster, Top);
+  add_side(Left, left >= 0 ? vertical_borders_[left] : none);
+  add_side(Right, neighbour(cluster, Right) >= 0 ? vertical_borders_[cluster] : none);
+  add_side(Top, top >= 0 ? horizontal_borders_[top] : none);
+  add_side(Bottom, neighbour(cluster, Bottom) >= 0 ? horizontal_borders_[cluster] : none);
+
+  const auto count = data.transitions.size();
+  std::vector<Point> cells(count);
+  for (std::size_t i = 0; i < count; ++i)
+    cells[i] = data.transitions[i].cell;
+
+  data.costs.resize(count * count);
+  for (std::size_t i = 0; i < count; ++i)
+    build_search_.findCosts(cells[i], bounds, cells.data(), count, data.costs.data() + i * count, false);
+}
+
+int HierarchicalPathfinder::across(int cluster, Transition const& transition) const
+{
+  static constexpr Side opposite[] = { Right, Left, Bottom, Top };
+
+  const auto other = neighbour(cluster, transition.side);
+  return first_node_[other] + clusters_[other].side_offsets[opposite[transition.side]] + transition.index;
+}
+
+float HierarchicalPathfinder::findPath(Point start, Point goal, Path& path, Workspace& workspace) const
+{
+  if (!grid_.contains(start.x, start.y) || !grid_.contains(goal.x, goal.y)) return infinity;
+
+  const auto start_cluster = clusterAt(start.x, start.y);
+  const auto goal_cluster = clusterAt(goal.x, goal.y);
+  auto& search = workspace.search;
+
+  // Within a single cluster, the direct path is good enough.
+  if (start_cluster == goal_cluster)
+  {
+    const auto cost = search.findPath(start, goal, clusters_[start_cluster].bounds, &path);
+    if (cost < infinity) return cost;
+  }
+
+  // Connect the start and the goal to the transitions of their clusters.
+  const auto& starts = clusters_[start_cluster];
+  const auto& goals = clusters_[goal_cluster];
+  auto& targets = workspace.targets;
+
+  targets.clear();
+  for (const auto& transition : starts.transitions)
+    targets.push_back(transition.cell);
+  workspace.start_costs.resize(targets.size());
+  search.findCosts(start, starts.bounds, targets.data(), targets.size(), workspace.start_costs.data(), false);
+
+  targets.clear();
+  for (const auto& transition : goals.transitions)
+    targets.push_back(transition.cell);
+  workspace.goal_costs.resize(targets.size());
+  search.findCosts(goal, goals.bounds, targets.data(), targets.size(), workspace.goal_costs.data(), true);
+
+  // A* over the abstract graph. The start and the goal are the two nodes 
+  // after the transitions.
+  const auto node_count = int(cluster_of_node_.size());
+  const auto start_node = node_count;
+  const auto goal_node = node_count + 1;
+
+  auto& costs = workspace.costs;
+  auto& parents = workspace.parents;
+  auto& stamps = workspace.stamps;
+  if (stamps.size() < std::size_t(node_count + 2))
+  {
+    costs.resize(node_count + 2);
+    parents.resize(node_count + 2);
+    stamps.resize(node_count + 2, 0);
+  }
+  if (++workspace.stamp == 0)
+  {
+    std::fill(stamps.begin(), stamps.end(), 0);
+    workspace.stamp = 1;
+  }
+  const auto stamp = workspace.stamp;
+
+  const auto cell_of = [&](int node) 
+    {
+      if (node == start_node) return start;
+      if (node == goal_node) return goal;
+
+      const auto cluster = cluster_of_node_[node];
+      return clusters_[cluster].transitions[node - first_node_[cluster]].cell;
+    };
+
+  auto& open = workspace.open;
+  open.clear();
+  const auto relax = [&](int node, float cost, int parent)
+    {
+      if (cost == infinity || (stamps[node] == stamp && cost >= costs[node])) return;
+
+      stamps[node] = stamp;
+      costs[node] = cost;
+      parents[node] = parent;
+      const auto cell = cell_of(node);
+      open.push_back(SearchEntry{ cost + std::abs(goal.x - cell.x) + std::abs(goal.y - cell.y), cost, node });
+      std::push_heap(open.begin(), open.end(), std::greater<>());
+    };
+
+  relax(start_node, 0.f, -1);
+  while (!open.empty())
+  {
+    std::pop_heap(open.begin(), open.end(), std::greater<>());
+    const auto entry = open.back();
+    open.pop_back();
+    if (entry.cost > costs[entry.node]) continue;
+    if (entry.node == goal_node) break;
+
+    if (entry.node == start_node)
+    {
+      for (std::size_t i = 0; i < starts.transitions.size(); ++i)
+        relax(first_node_[start_cluster] + int(i), workspace.start_costs[i], start_node);
+      continue;
+    }
+
+    const auto cluster = cluster_of_node_[entry.node];
+    const auto& data = clusters_[cluster];
+    const auto local = entry.node - first_node_[cluster];
+    const auto count = data.transitions.size();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      if (int(i) != local)
+        relax(first_node_[cluster] + int(i), entry.cost + data.costs[local * count + i], entry.node);
+    }
+
+    const auto& transition = data.transitions[local];
+    const auto other = across(cluster, transition);
+    const auto other_cell = cell_of(other);
+    relax(other, entry.cost + path_cost(grid_.at(other_cell.x, other_cell.y)), entry.node);
+
+    if (cluster == goal_cluster)
+      relax(goal_node, entry.cost + workspace.goal_costs[local], entry.node);
+  }
+
+  if (stamps[goal_node] != stamp) return infinity;
+
+  // Refine the abstract path segment by segment.
+  auto& nodes = workspace.nodes;
+  nodes.clear();
+  for (auto node = goal_node; node >= 0; node = parents[node])
+    nodes.push_back(node);
+  std::reverse(nodes.begin(), nodes.end());
+
+  path.push_back(start);
+  for (std::size_t i = 1; i < nodes.size(); ++i)
+  {
+    const auto from = nodes[i - 1];
+    const auto to = nodes[i];
+    const auto to_cell = cell_of(to);
+
+    // Transitions into the neighbouring cluster are a single step.
+    const auto cluster = from == start_node ? start_cluster : cluster_of_node_[from];
+    if (to != goal_node && cluster_of_node_[to] != cluster)
+    {
+      path.push_back(to_cell);
+      continue;
+    }
+
+    // The segment starts with the last cell of the path.
+    path.pop_back();
+    search.findPath(cell_of(from), to_cell, clusters_[cluster].bounds, &path);
+  }
+
+  return costs[goal_node];
+}
+
+void HierarchicalPathfinder::findPaths(std::vector<Query> const& queries, std::vector<Path>& paths, ThreadPool& pool)
+{
+  update();
+  paths.resize(queries.size());
+
+  // A few chunks per thread balance queries of different lengths.
+  const auto chunk_count = std::min(queries.size(), pool.size() * 4);
+  std::vector<std::future<void>> chunks;
+  for (std::size_t chunk = 0; chunk < chunk_count; ++chunk)
+  {
+    chunks.push_back(pool.submit([this, &queries, &paths, chunk, chunk_count]()
+      {
+        Workspace workspace(grid_);
+        for (auto i = chunk; i < queries.size(); i += chunk_count)
+        {
+          paths[i].clear();
+          if (findPath(queries[i].start, queries[i].goal, paths[i], workspace) == infinity)
+            paths[i].clear();
+        }
+      }));
+  }
+
+  for (auto& chunk : chunks)
+    chunk.get();
+}
+
+std::size_t HierarchicalPathfinder::bytes() const
+{
+  auto bytes = sizeof(*this) + clusters_.capacity() * sizeof(Cluster) + 
+    (vertical_borders_.capacity() + horizontal_borders_.capacity()) * sizeof(std::vector<int>) + 
+    (first_node_.capacity() + cluster_of_node_.capacity() + dirty_clusters_.capacity()) * sizeof(int) + 
+    dirty_.capacity() + affected_.capacity() + build_search_.bytes();
+
+  for (const auto& cluster : clusters_)
+    bytes += cluster.transitions.capacity() * sizeof(Transition) + cluster.costs.capacity() * sizeof(float);
+  for (const auto& border : vertical_borders_)
+    bytes += border.capacity() * sizeof(int);
+  for (const auto& border : horizontal_borders_)
+    bytes += border.capacity() * sizeof(int);
+
+  return bytes;
+}
+
+std::size_t HierarchicalPathfinder::Workspace::bytes() const
+{
+  return search.bytes() + costs.capacity() * sizeof(float) + parents.capacity() * sizeof(int) + 
+    stamps.capacity() * sizeof(std::uint32_t) + open.capacity() * sizeof(SearchEntry) + 
+    targets.capacity() * sizeof(Point) + (start_costs.capacity() + goal_costs.capacity()) * sizeof(float) + 
+    nodes.capacity() * sizeof(int);
+}
+
+// Index of the lowest set bit, which must exist.
+inline int trailing_zeros(std::uint64_t bits)
+{
+#ifdef _MSC_VER
+  unsigned long index = 0;
+  _BitScanForward64(&index, bits);
+  return int(index);
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+
+// Falling and spreading water as a cellular automaton on the tile grid. The 
+// cells are stored as bit-planes, one bit per cell, so that a 64 bit word 
+// updates 64 cells at once. In each step water falls into the empty cell 
+// below. Water, which cannot fall, moves sideways into an empty cell, if it 
+// is pushed by water above or the cell is a ledge. The sideways direction 
+// alternates between the steps, so no two cells move into the same one.
+//
+// The planes are double buffered. Only chunks of 64 x 16 cells, which have 
+// changed in one of the previous two steps or border such a chunk, are 
+// simulated, so water at rest costs nothing. Two steps give water blocked in
+// one direction the chance to move in the other. Rows of chunks are 
+// simulated in parallel.
+class WaterSimulation
+{
+public:
+  static constexpr int chunk_rows = 16;
+  static constexpr std::uint8_t active_steps = 2;
+
+  explicit WaterSimulation(TileGrid& grid);
+
+  // Reads the cell again, after it has been changed in the grid.
+  void resetCell(int x, int y);
+
+  // Simulates all chunks in the next step, not only the changed ones.
+  void activateAll();
+
+  // Runs the rows on the pool, or on the calling thread without one.
+  void step(ThreadPool* pool);
+
+  // Cells, which have become wet or dry in the last step.
+  std::vector<Point> const& changedCells() const { return changed_cells_; }
+
+  // Adds the water as rectangles covering horizontal runs of cells.
+  void publish(RenderState& state) const;
+
+  std::size_t chunkCount() const { return active_.size(); }
+  void writeReport(Logger& log) const;
+
+private:
+  using Word = std::uint64_t;
+
+  // Planes have a border of one row and one word, which is solid and dry.
+  std::size_t index(int y, int w) const { return std::size_t(y + 1) * stride_ + w + 1; }
+
+  void activateAround(int chunk_row, int w);
+  void simulateRow(int chunk_row);
+  Word nextWord(std::vector<Word> const& water, int y, int w) const;
+
+  TileGrid& grid_;
+  int words_ = 0;
+  int stride_ = 0;
+  int chunks_y_ = 0;
+
+  std::vector<Word> solid_;
+  std::array<std::vector<Word>, 2> water_;
+  int current_ = 0;
+  bool move_left_ = true;
+
+  // Per chunk. Written by the task simulating the row of the chunk only. 
+  // Active holds the number of steps left, in which the chunk is simulated.
+  std::vector<std::uint8_t> active_;
+  std::vector<std::uint8_t> changed_;
+
+  // Per row of chunks, merged after the tasks have joined.
+  std::vector<std::vector<Point>> row_changed_cells_;
+  std::vector<Point> changed_cells_;
+
+  std::vector<int> active_rows_;
+  std::vector<std::future<void>> tasks_;
+
+  std::uint64_t steps_ = 0;
+  std::uint64_t simulated_chunks_ = 0;
+  double step_us_sum_ = 0.0;
+  double step_us_max_ = 0.0;
+};
+
+WaterSimulation::WaterSimulation(TileGrid& grid) : 
+  grid_(grid), words_((grid.width() + 63) / 64), stride_(words_ + 2), 
+  chunks_y_((grid.height() + chunk_rows - 1) / chunk_rows)
+{
+  const auto size = std::size_t(stride_) * (grid.height() + 2);
+  solid_.resize(size, ~Word(0));
+  water_[0].resize(size, 0);
+  for (int y = 0; y < grid.height(); ++y)
+  {
+    for (int x = 0; x < grid.width(); ++x)
+    {
+      const auto type = grid.at(x, y);
+      const auto bit = Word(1) << (x % 64);
+      if (!is_solid(type)) solid_[index(y, x / 64)] &= ~bit;
+      if (type == TileType::Water) water_[0][index(y, x / 64)] |= bit;
+    }
+  }
+  water_[1] = water_[0];
+
+  active_.resize(std::size_t(chunks_y_) * words_, active_steps);
+  changed_.resize(active_.size(), 0);
+  row_changed_cells_.resize(chunks_y_);
+  active_rows_.reserve(chunks_y_);
+  tasks_.reserve(chunks_y_);
+}
+
+void WaterSimulation::resetCell(int x, int y)
+{
+  if (!grid_.contains(x, y)) return;
+
+  const auto type = grid_.at(x, y);
+  const auto bit = Word(1) << (x % 64);
+  const auto at = index(y, x / 64);
+  solid_[at] = is_solid(type) ? solid_[at] | bit : solid_[at] & ~bit;
+  for (auto& water : water_)
+    water[at] = type == TileType::Water ? water[at] | bit : water[at] & ~bit;
+
+  activateAround(y / chunk_rows, x / 64);
+}
+
+void WaterSimulation::activateAll()
+{
+  std::fill(active_.begin(), active_.end(), active_steps);
+}
+
+void WaterSimulation::activateAround(int chunk_row, int w)
+{
+  for (int row = std::max(0, chunk_row - 1); row <= std::min(chunks_y_ - 1, chunk_row + 1); ++row)
+    for (int i = std::max(0, w - 1); i <= std::min(words_ - 1, w + 1); ++i)
+      active_[row * words_ + i] = active_steps;
+}
+
+void WaterSimulation::step(ThreadPool* pool)
+{
+  ++steps_;
+
+  changed_cells_.clear();
+  active_rows_.clear();
+  for (int row = 0; row < chunks_y_; ++row)
+  {
+    const auto first = active_.begin() + row * words_;
+    if (std::any_of(first, first + words_, [](std::uint8_t steps) { return steps > 0; }))
+      active_rows_.push_back(row);
+  }
+  if (active_rows_.empty()) return;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // Rows only write their own chunks and cells, so they need no locking.
+  const auto task_count = pool ? std::min(active_rows_.size(), pool->size() * 2) : 1;
+  if (task_count <= 1)
+  {
+    for (const auto row : active_rows_)
+      simulateRow(row);
+  }
+  else
+  {
+    tasks_.clear();
+    for (std::size_t task = 0; task < task_count; ++task)
+    {
+      tasks_.push_back(pool->submit([this, task, task_count]()
+        {
+          for (auto i = task; i < active_rows_.size(); i += task_count)
+            simulateRow(active_rows_[i]);
+        }));
+    }
+
+    for (auto& task : tasks_)
+      task.get();
+  }
+
+  current_ ^= 1;
+  move_left_ = !move_left_;
+
+  for (const auto row : active_rows_)
+  {
+    auto& cells = row_changed_cells_[row];
+    changed_cells_.insert(changed_cells_.end(), cells.begin(), cells.end());
+    cells.clear();
+  }
+
+  // The changed chunks and their neighbours are simulated in the next two 
+  // steps, one in each direction.
+  for (auto& steps : active_)
+  {
+    if (steps == 0) continue;
+
+    ++simulated_chunks_;
+    --steps;
+  }
+  for (int row = 0; row < chunks_y_; ++row)
+  {
+    for (int w = 0; w < words_; ++w)
+    {
+      auto& changed = changed_[row * words_ + w];
+      if (!changed) continue;
+
+      activateAround(row, w);
+      changed = 0;
+    }
+  }
+
+  const auto step_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  step_us_sum_ += step_us;
+  step_us_max_ = std::max(step_us_max_, step_us);
+}
+
+void WaterSimulation::simulateRow(int chunk_row)
+{
+  const auto& water = water_[current_];
+  auto& next = water_[current_ ^ 1];
+  auto& changed_cells = row_changed_cells_[chunk_row];
+
+  const auto first_y = chunk_row * chunk_rows;
+  const auto last_y = std::min(grid_.height(), first_y + chunk_rows);
+  for (int w = 0; w < words_; ++w)
+  {
+    const auto chunk = chunk_row * words_ + w;
+    if (!active_[chunk]) continue;
+
+    bool changed = false;
+    for (int y = first_y; y < last_y; ++y)
+    {
+      const auto at = index(y, w);
+      const auto word = nextWord(water, y, w);
+      next[at] = word;
+
+      // Keep the grid up to date for the snapshots and the pathfinding.
+      auto flipped = word ^ water[at];
+      changed = changed || flipped != 0;
+      while (flipped)
+      {
+        const auto bit = trailing_zeros(flipped);
+        grid_.set(w * 64 + bit, y, (word >> bit) & 1 ? TileType::Water : TileType::Clear);
+        changed_cells.push_back({ w * 64 + bit, y });
+        flipped &= flipped - 1;
+      }
+    }
+
+    if (changed) changed_[chunk] = 1;
+  }
+}
+
+WaterSimulation::Word WaterSimulation::nextWord(std::vector<Word> const& water, int y, int w) const
+{
+  const auto at = index(y, w);
+  const auto above = at - stride_;
+  const auto below = at + stride_;
+
+  const auto wet = [&](std::size_t i) { return water[i]; };
+  const auto empty = [&](std::size_t i) { return ~(water[i] | solid_[i]); };
+
+  // Empty cells, into which no water falls from above.
+  const auto free = [&](std::size_t i) { return empty(i) & ~water[i - stride_]; };
+
+  // Water, which cannot fall.
+  const auto resting = [&](std::size_t i) { return water[i] & ~empty(i + stride_); };
+
+  // The plane shifted by one cell, so that the bit of a cell holds the value 
+  // of its left or right neighbour.
+  const auto left_of = [](auto plane, std::size_t i) { return (plane(i) << 1) | (plane(i - 1) >> 63); };
+  const auto right_of = [](auto plane, std::size_t i) { return (plane(i) >> 1) | (plane(i + 1) << 63); };
+
+  const auto fallen = water[above] & empty(at);
+  const auto rest = resting(at);
+
+  Word moved_out = 0;
+  Word moved_in = 0;
+  if (move_left_)
+  {
+    moved_out = rest & left_of(free, at) & (water[above] | left_of(empty, below));
+    moved_in = right_of(resting, at) & free(at) & (right_of(wet, above) | empty(below));
+  }
+  else
+  {
+    moved_out = rest & right_of(free, at) & (water[above] | right_of(empty, below));
+    moved_in = left_of(resting, at) & free(at) & (left_of(wet, above) | empty(below));
+  }
+
+  return (rest & ~moved_out) | fallen | moved_in;
+}
+
+void WaterSimulation::publish(RenderState& state) const
+{
+  const auto& water = water_[current_];
+  const auto tile_size = grid_.tileSize();
+  for (int y = 0; y < grid_.height(); ++y)
+  {
+    // Runs crossing a word boundary continue the previous rectangle.
+    int run_end = -1;
+    for (int w = 0; w < words_; ++w)
+    {
+      auto bits = water[index(y, w)];
+      while (bits)
+      {
+        const auto first = trailing_zeros(bits);
+        const auto ones = ~(bits >> first);
+        const auto length = ones ? trailing_zeros(ones) : 64 - first;
+        const auto x = w * 64 + first;
+
+        if (x == run_end)
+          state.water_rects.back().Width += length * tile_size;
+        else
+          state.water_rects.emplace_back(x * tile_size, y * tile_size, length * tile_size, tile_size);
+        run_end = x + length;
+
+        bits = first + length < 64 ? bits & (~Word(0) << (first + length)) : 0;
+      }
+    }
+  }
+}
+
+void WaterSimulation::writeReport(Logger& log) const
+{
+  if (steps_ == 0) return;
+
+  log << "Water: " << steps_ << " steps, mean " << double(simulated_chunks_) / steps_ << " of " 
+    << chunkCount() << " chunks simulated, step mean " << step_us_sum_ / steps_ << " us, max " 
+    << step_us_max_ << " us" << std::endl;
+}
+
+// Line of sight from a single cell over the tile grid, e.g. the cell of the 
+// player, as a bitmap with one bit per cell. Computed by recursive 
+// shadowcasting: each of the eight octants is scanned row by row outwards, 
+// and a solid cell narrows the range of slopes, which is still lit, or splits
+// it into two scans. So every cell within the radius is visited at most once 
+// and cells in the shadow not at all.
+//
+// The result is cached. It is only computed again, when the origin moves to 
+// another cell or a cell within the radius has changed.
+class VisibilityField
+{
+public:
+  VisibilityField(TileGrid const& grid, int radius);
+
+  // Returns true, if the field had to be computed again.
+  bool update(int origin_x, int origin_y);
+
+  // A cell of the grid has changed.
+  void invalidate(int x, int y);
+
+  bool hasOrigin() const { return has_origin_; }
+  bool isVisible(int x, int y) const;
+
+  // Adds the cells, which are not visible, as rectangles covering horizontal
+  // runs of cells. Nothing is hidden, before there is an origin.
+  void publish(RenderState& state) const;
+
+  void writeReport(Logger& log) const;
+
+private:
+  using Word = std::uint64_t;
+
+  void castLight(int row, float start_slope, float end_slope, int xx, int xy, int yx, int yy);
+  void markVisible(int x, int y);
+
+  TileGrid const& grid_;
+  int radius_ = 0;
+  int words_ = 0;
+
+  std::vector<Word> visible_;
+
+  int origin_x_ = 0;
+  int origin_y_ = 0;
+  bool has_origin_ = false;
+  bool dirty_ = false;
+
+  std::uint64_t updates_ = 0;
+  std::uint64_t recomputes_ = 0;
+  std::uint64_t visible_cells_ = 0;
+  double compute_us_sum_ = 0.0;
+  double compute_us_max_ = 0.0;
+};
+
+VisibilityField::VisibilityField(TileGrid const& grid, int radius) : 
+  grid_(grid), radius_(radius), words_((grid.width() + 63) / 64)
+{
+  visible_.resize(std::size_t(words_) * grid.height(), 0);
+}
+
+bool VisibilityField::update(int origin_x, int origin_y)
+{
+  ++updates_;
+  if (has_origin_ && !dirty_ && origin_x == origin_x_ && origin_y == origin_y_) return false;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // Only the rows around the previous origin can hold visible cells.
+  if (has_origin_)
+  {
+    const auto first_y = std::max(0, origin_y_ - radius_);
+    const auto last_y = std::min(grid_.height() - 1, origin_y_ + radius_);
+    const auto first_w = std::clamp(origin_x_ - radius_, 0, grid_.width() - 1) / 64;
+    const auto last_w = std::clamp(origin_x_ + radius_, 0, grid_.width() - 1) / 64;
+    for (int y = first_y; y <= last_y; ++y)
+      std::fill_n(visible_.begin() + y * words_ + first_w, last_w - first_w + 1, 0);
+  }
+
+  origin_x_ = origin_x;
+  origin_y_ = origin_y;
+  has_origin_ = true;
+  dirty_ = false;
+
+  // Transformations of the octant scanned by castLight into all eight.
+  static constexpr int octants[8][4] = {
+    { 1, 0, 0, 1 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { -1, 0, 0, 1 },
+    { -1, 0, 0, -1 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 }, { 1, 0, 0, -1 } };
+
+  markVisible(origin_x_, origin_y_);
+  for (const auto& octant : octants)
+    castLight(1, 1.f, 0.f, octant[0], octant[1], octant[2], octant[3]);
+
+  ++recomputes_;
+  const auto compute_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  compute_us_sum_ += compute_us;
+  compute_us_max_ = std::max(compute_us_max_, compute_us);
+  return true;
+}
+
+void VisibilityField::castLight(int row, float start_slope, float end_slope, int xx, int xy, int yx, int yy)
+{
+  if (start_slope < end_slope) return;
+
+  const auto radius_squared = radius_ * radius_;
+  float next_start_slope = start_slope;
+  for (int distance = row; distance <= radius_; ++distance)
+  {
+    bool blocked = false;
+    const int dy = -distance;
+    for (int dx = -distance; dx <= 0; ++dx)
+    {
+      // Slopes of the edges of the cell, as seen from the origin.
+      const auto left_slope = (dx - 0.5f) / (dy + 0.5f);
+      const auto right_slope = (dx + 0.5f) / (dy - 0.5f);
+      if (start_slope < right_slope) continue;
+      if (end_slope > left_slope) break;
+
+      const auto x = origin_x_ + dx * xx + dy * xy;
+      const auto y = origin_y_ + dx * yx + dy * yy;
+      if (dx * dx + dy * dy <= radius_squared) markVisible(x, y);
+
+      // Nothing is visible beyond the border of the grid.
+      const bool opaque = !grid_.contains(x, y) || grid_.isSolid(x, y);
+      if (blocked)
+      {
+        if (opaque)
+        {
+          next_start_slope = right_slope;
+          continue;
+        }
+
+        blocked = false;
+        start_slope = next_start_slope;
+      }
+      else if (opaque && distance < radius_)
+      {
+        // The lit range continues behind the cell in another scan.
+        blocked = true;
+        castLight(distance + 1, start_slope, left_slope, xx, xy, yx, yy);
+        next_start_slope = right_slope;
+      }
+    }
+
+    if (blocked) break;
+  }
+}
+
+void VisibilityField::markVisible(int x, int y)
+{
+  if (!grid_.contains(x, y)) return;
+
+  auto& word = visible_[y * words_ + x / 64];
+  const auto bit = Word(1) << (x % 64);
+  visible_cells_ += (word & bit) == 0;
+  word |= bit;
+}
+
+void VisibilityField::invalidate(int x, int y)
+{
+  if (has_origin_ && std::abs(x - origin_x_) <= radius_ && std::abs(y - origin_y_) <= radius_)
+    dirty_ = true;
+}
+
+bool VisibilityField::isVisible(int x, int y) const
+{
+  return grid_.contains(x, y) && (visible_[y * words_ + x / 64] >> (x % 64) & 1);
+}
+
+void VisibilityField::publish(RenderState& state) const
+{
+  if (!has_origin_) return;
+
+  const auto tile_size = grid_.tileSize();
+  for (int y = 0; y < grid_.height(); ++y)
+  {
+    // Runs crossing a word boundary continue the previous rectangle.
+    int run_end = -1;
+    for (int w = 0; w < words_; ++w)
+    {
+      const auto cells = std::min(64, grid_.width() - w * 64);
+      auto bits = ~visible_[y * words_ + w];
+      if (cells < 64) bits &= (Word(1) << cells) - 1;
+
+      while (bits)
+      {
+        const auto first = trailing_zeros(bits);
+        const auto ones = ~(bits >> first);
+        const auto length = ones ? trailing_zeros(ones) : 64 - first;
+        const auto x = w * 64 + first;
+
+        if (x == run_end)
+          state.fog_rects.back().Width += length * tile_size;
+        else
+          state.fog_rects.emplace_back(x * tile_size, y * tile_size, length * tile_size, tile_size);
+        run_end = x + length;
+
+        bits = first + length < 64 ? bits & (~Word(0) << (first + length)) : 0;
+      }
+    }
+  }
+}
+
+void VisibilityField::writeReport(Logger& log) const
+{
+  if (updates_ == 0) return;
+
+  log << "Visibility: " << updates_ << " updates, " << recomputes_ << " recomputed (cache hit rate " 
+    << 100.0 * (updates_ - recomputes_) / updates_ << "%)";
+  if (recomputes_ > 0)
+  {
+    log << ", recompute mean " << compute_us_sum_ / recomputes_ << " us, max " << compute_us_max_ 
+      << " us, mean " << double(visible_cells_) / recomputes_ << " visible cells";
+  }
+  log << std::endl;
+}
+
+using BitmapHandle = std::shared_future<std::shared_ptr<Gdiplus::Bitmap>>;
+
+bool isReady(BitmapHandle const& handle)
+{
+  return handle.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+BitmapHandle make_ready_handle(std::shared_ptr<Gdiplus::Bitmap> bitmap)
+{
+  std::promise<std::shared_ptr<Gdiplus::Bitmap>> loaded;
+  loaded.set_value(std::move(bitmap));
+  return loaded.get_future().share();
+}
+
+// Premultiplied 32 bit pixels of a loaded bitmap. They are not written, 
+// once the bitmap refers to them, so they can be read while it is drawn.
+struct PixelBuffer
+{
+  std::shared_ptr<std::uint8_t> data;
+  int width = 0, height = 0;
+  std::ptrdiff_t stride = 0;
+
+  std::uint8_t const* row(int y) const { return data.get() + y * stride; }
+};
+
+// Rows start on 16 byte boundaries, so that they can be processed with SSE.
+PixelBuffer allocate_pixels(int width, int height)
+{
+  constexpr std::size_t row_alignment = 16;
+  const auto stride = (std::size_t(width) * 4 + row_alignment - 1) / row_alignment * row_alignment;
+
+  PixelBuffer pixels;
+  pixels.data.reset(
+    new (std::align_val_t(row_alignment)) std::uint8_t[std::max<std::size_t>(stride * height, 1)],
+    [](std::uint8_t* p) { ::operator delete[](p, std::align_val_t(row_alignment)); });
+  pixels.width = width;
+  pixels.height = height;
+  pixels.stride = std::ptrdiff_t(stride);
+  return pixels;
+}
+
+// Copies the bitmap into 32 bit premultiplied ARGB, which GDI+ blends onto 
+// the render target without converting the pixels first.
+PixelBuffer copy_pixels(Gdiplus::Bitmap& source)
+{
+  auto pixels = allocate_pixels(INT(source.GetWidth()), INT(source.GetHeight()));
+
+  // GDI+ converts, while it copies into the buffer. This also forces the 
+  // lazy decoding to happen here and not during the first draw.
+  Gdiplus::Rect rect(0, 0, pixels.width, pixels.height);
+  Gdiplus::BitmapData data;
+  data.Width = pixels.width;
+  data.Height = pixels.height;
+  data.Stride = INT(pixels.stride);
+  data.PixelFormat = PixelFormat32bppPARGB;
+  data.Scan0 = pixels.data.get();
+  data.Reserved = 0;
+  if (source.LockBits(&rect, Gdiplus::ImageLockModeRead | Gdiplus::ImageLockModeUserInputBuf, 
+      PixelFormat32bppPARGB, &data) != Gdiplus::Ok)
+    throw std::runtime_error("Converting bitmap failed.");
+  source.UnlockBits(&data);
+
+  return pixels;
+}
+
+// Refers to the pixels without copying them and keeps them alive.
+std::shared_ptr<Gdiplus::Bitmap> make_bitmap(PixelBuffer const& pixels)
+{
+  auto bitmap = std::shared_ptr<Gdiplus::Bitmap>(
+    new Gdiplus::Bitmap(pixels.width, pixels.height, INT(pixels.stride), PixelFormat32bppPARGB, pixels.data.get()),
+    [data = pixels.data](Gdiplus::Bitmap* bitmap) { delete bitmap; });
+  if (bitmap->GetLastStatus() != Gdiplus::Ok)
+    throw std::runtime_error("Converting bitmap failed.");
+
+  return bitmap;
+}
+
+std::shared_ptr<Gdiplus::Bitmap> make_native(Gdiplus::Bitmap& source)
+{
+  return make_bitmap(copy_pixels(source));
+}
+
+// Masks of the sprites are made once, when they have been loaded.
+std::shared_ptr<CollisionMask const> make_collision_mask(PixelBuffer const& pixels)
+{
+  return std::make_shared<CollisionMask const>(pixels.width, pixels.height, pixels.data.get(), pixels.stride);
+}
+
+// Only for bitmaps, which have not been handed to the renderer yet.
+std::shared_ptr<CollisionMask const> make_collision_mask(Gdiplus::Bitmap& bitmap)
+{
+  return make_collision_mask(copy_pixels(bitmap));
+}
+
+// Mirrored variants of a sprite. Combinations of the horizontal and vertical 
+// bits.
+enum class Flip { None = 0, Horizontal = 1, Vertical = 2, Both = 3, Count };
+
+// Mirrors the pixels into a new buffer, the source is only read.
+PixelBuffer make_flipped(PixelBuffer const& source, Flip flip)
+{
+  auto flipped = allocate_pixels(source.width, source.height);
+  const bool horizontal = (int(flip) & int(Flip::Horizontal)) != 0;
+  const bool vertical = (int(flip) & int(Flip::Vertical)) != 0;
+  for (int y = 0; y < source.height; ++y)
+  {
+    const auto src = reinterpret_cast<std::uint32_t const*>(source.row(vertical ? source.height - 1 - y : y));
+    const auto dst = reinterpret_cast<std::uint32_t*>(flipped.data.get() + y * flipped.stride);
+    if (horizontal)
+      std::reverse_copy(src, src + source.width, dst);
+    else
+      std::copy(src, src + source.width, dst);
+  }
+
+  return flipped;
+}
+
+std::size_t bitmap_bytes(Gdiplus::Bitmap& bitmap)
+{
+  return std::size_t(bitmap.GetWidth()) * bitmap.GetHeight() * Gdiplus::GetPixelFormatSize(bitmap.GetPixelFormat()) / 8;
+}
+
+std::string pixel_format_name(Gdiplus::PixelFormat format)
+{
+  switch (format)
+  {
+  case PixelFormat24bppRGB: return "24bpp RGB";
+  case PixelFormat32bppRGB: return "32bpp RGB";
+  case PixelFormat32bppARGB: return "32bpp ARGB";
+  case PixelFormat32bppPARGB: return "32bpp PARGB";
+  }
+
+  std::ostringstream name;
+  name << "format 0x" << std::hex << format;
+  return name.str();
+}
+
+// Index of an asset in the resource pack.
+using AssetId = std::uint32_t;
+constexpr AssetId invalid_asset = ~AssetId(0);
+
+struct PackHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t entry_count;
+};
+
+enum class PackFormat : std::uint32_t { Encoded = 0, Pargb };
+
+// Entry of the table of contents.
+struct PackEntry
+{
+  // File name without the directory, zero terminated.
+  char name[48];
+  PackFormat format;
+
+  // Only set for pre-decoded pixels.
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t stride;
+
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+constexpr char pack_magic[8] = "G2DPACK";
+constexpr std::uint32_t pack_version = 1;
+
+// All assets in a single file: the header, the table of contents and the 
+// payloads on 64 byte boundaries. A payload is either the image file as it 
+// is, or its pixels pre-decoded to the native format of the renderer (see 
+// make_native). The file is opened and mapped once, the assets are 
+// referenced by their index and their bytes are used in place.
+class ResourcePack
+{
+public:
+  // Throws, if the file cannot be mapped or is not a pack.
+  explicit ResourcePack(std::filesystem::path const& file);
+  ~ResourcePack();
+
+  ResourcePack(ResourcePack const&) = delete;
+  ResourcePack& operator=(ResourcePack const&) = delete;
+
+  // Asset of the file name (without the directory), invalid_asset if the 
+  // file is not packed.
+  AssetId find(std::string const& name) const;
+
+  std::size_t assetCount() const { return entries_.size(); }
+  PackEntry const& entry(AssetId id) const { return entries_[id]; }
+
+  // The mapping is copy on write, so GDI+ may use pre-decoded pixels as the 
+  // buffer of a bitmap.
+  std::uint8_t* data(AssetId id) const { return view_ + entries_[id].offset; }
+
+  std::size_t bytes() const { return size_; }
+
+private:
+  void close();
+
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = NULL;
+  std::uint8_t* view_ = nullptr;
+  std::size_t size_ = 0;
+
+  std::vector<PackEntry> entries_;
+  std::unordered_map<std::string, AssetId> ids_;
+};
+
+ResourcePack::ResourcePack(std::filesystem::path const& file)
+{
+  try
+  {
+    file_ = CreateFile(file.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("Opening resource pack failed.");
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || std::size_t(size.QuadPart) < sizeof(PackHeader))
+      throw std::runtime_error("Resource pack is truncated.");
+    size_ = std::size_t(size.QuadPart);
+
+    mapping_ = CreateFileMapping(file_, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (mapping_)
+      view_ = static_cast<std::uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0));
+    if (!view_)
+      throw std::runtime_error("Mapping resource pack failed.");
+
+    PackHeader header;
+    std::memcpy(&header, view_, sizeof(header));
+    if (std::memcmp(header.magic, pack_magic, sizeof(pack_magic)) != 0 || header.version != pack_version)
+      throw std::runtime_error("Not a resource pack of this version.");
+    if (sizeof(PackHeader) + std::size_t(header.entry_count) * sizeof(PackEntry) > size_)
+      throw std::runtime_error("Resource pack is truncated.");
+
+    // The table of contents is small, copying it spares aligned access.
+    entries_.resize(header.entry_count);
+    std::memcpy(entries_.data(), view_ + sizeof(PackHeader), entries_.size() * sizeof(PackEntry));
+    for (AssetId id = 0; id < entries_.size(); ++id)
+    {
+      auto& entry = entries_[id];
+      entry.name[sizeof(entry.name) - 1] = '\0';
+      if (entry.offset > size_ || entry.size > size_ - entry.offset)
+        throw std::runtime_error("Resource pack is truncated.");
+
+      // Pre-decoded pixels are used in place, so the rows have to fit.
+      if (entry.format == PackFormat::Pargb && 
+        (entry.stride % 4 != 0 || std::uint64_t(entry.width) * 4 > entry.stride || 
+          std::uint64_t(entry.stride) * entry.height > entry.size))
+        throw std::runtime_error(std::string("Resource pack entry has invalid pixels: ") + entry.name);
+
+      ids_.emplace(entry.name, id);
+    }
+  }
+  catch (...)
+  {
+    close();
+    throw;
+  }
+}
+
+ResourcePack::~ResourcePack()
+{
+  close();
+}
+
+void ResourcePack::close()
+{
+  if (view_) UnmapViewOfFile(view_);
+  if (mapping_) CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+
+  view_ = nullptr;
+  mapping_ = NULL;
+  file_ = INVALID_HANDLE_VALUE;
+}
+
+AssetId ResourcePack::find(std::string const& name) const
+{
+  const auto it = ids_.find(name);
+  return it != ids_.end() ? it->second : invalid_asset;
+}
+
+// Packs every file of the directory, sorted by name. Images are stored 
+// pre-decoded, unless encoded is set.
+void build_resource_pack(std::filesystem::path const& directory, std::filesystem::path const& output, bool encoded)
+{
+  std::vector<std::filesystem::path> files;
+  for (const auto& item : std::filesystem::directory_iterator(directory))
+    if (item.is_regular_file()) files.push_back(item.path());
+  std::sort(files.begin(), files.end());
+
+  constexpr std::size_t payload_alignment = 64;
+  std::vector<PackEntry> entries(files.size(), PackEntry{});
+  std::vector<std::vector<std::uint8_t>> payloads(files.size());
+  auto offset = sizeof(PackHeader) + files.size() * sizeof(PackEntry);
+  for (std::size_t i = 0; i < files.size(); ++i)
+  {
+    auto& entry = entries[i];
+    auto& payload = payloads[i];
+
+    const auto name = files[i].filename().string();
+    if (name.size() >= sizeof(entry.name))
+      throw std::runtime_error("Asset name too long for the resource pack: " + name);
+    std::memcpy(entry.name, name.c_str(), name.size());
+
+    // Only images are pre-decoded, anything else is stored as it is.
+    auto extension = files[i].extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    const bool image = extension == ".png" || extension == ".bmp" || extension == ".gif" || 
+      extension == ".jpg" || extension == ".jpeg" || extension == ".tif" || extension == ".tiff";
+
+    if (encoded || !image)
+    {
+      std::ifstream input(files[i], std::ios::binary);
+      payload.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+      entry.format = PackFormat::Encoded;
+    }
+    else
+    {
+      Gdiplus::Bitmap bitmap(files[i].wstring().c_str());
+      if (bitmap.GetLastStatus() != Gdiplus::Ok)
+        throw std::runtime_error("Loading bitmap failed: " + name);
+
+      // Pixels of the native bitmap, as they will be used when loaded.
+      const auto pixels = copy_pixels(bitmap);
+      payload.assign(pixels.data.get(), pixels.data.get() + pixels.stride * pixels.height);
+      entry.format = PackFormat::Pargb;
+      entry.width = std::uint32_t(pixels.width);
+      entry.height = std::uint32_t(pixels.height);
+      entry.stride = std::uint32_t(pixels.stride);
+    }
+
+    offset = (offset + payload_alignment - 1) / payload_alignment * payload_alignment;
+    entry.offset = offset;
+    entry.size = payload.size();
+    offset += payload.size();
+  }
+
+  PackHeader header;
+  std::memcpy(header.magic, pack_magic, sizeof(pack_magic));
+  header.version = pack_version;
+  header.entry_count = std::uint32_t(entries.size());
+
+  std::ofstream out(output, std::ios::binary);
+  out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  out.write(reinterpret_cast<char const*>(entries.data()), entries.size() * sizeof(PackEntry));
+
+  std::size_t written = sizeof(PackHeader) + entries.size() * sizeof(PackEntry);
+  for (std::size_t i = 0; i < entries.size(); ++i)
+  {
+    const std::vector<char> padding(entries[i].offset - written, 0);
+    out.write(padding.data(), padding.size());
+    out.write(reinterpret_cast<char const*>(payloads[i].data()), payloads[i].size());
+    written = entries[i].offset + payloads[i].size();
+  }
+
+  if (!out)
+    throw std::runtime_error("Writing resource pack failed.");
+
+  logger << "Resource pack: " << entries.size() << " assets from " << directory.string() << (encoded ? " (encoded)" : " (pre-decoded)") 
+    << ", " << written << " bytes written to " << output.string() << std::endl;
+}
+
+// Reads and decodes images on the thread pool. Every file is loaded only 
+// once, repeated requests share the same bitmap. Mirrored variants are 
+// created from the decoded bitmap, also only once. All bitmaps are converted 
+// to the native format of the renderer (see make_native).
+//
+// With a resource pack, files found in the pack are loaded from it instead.
+// Pre-decoded images are then used in place, without decoding or copying.
+class AssetLoader
+{
+public:
+  explicit AssetLoader(ThreadPool& pool, std::shared_ptr<ResourcePack> pack = nullptr);
+  ~AssetLoader();
+
+  BitmapHandle loadBitmap(const WCHAR* file, Flip flip = Flip::None);
+  BitmapHandle loadBitmap(AssetId id, Flip flip = Flip::None);
+
+  bool allLoaded() const { return pending_ == 0; }
+  void waitAll();
+
+  // Made along with the bitmap, which must have been loaded.
+  std::shared_ptr<CollisionMask const> collisionMask(Gdiplus::Bitmap const* bitmap) const;
+
+  // Time point at which the last requested asset has been decoded.
+  std::chrono::steady_clock::time_point lastLoadedTime() const;
+
+  // Memory of the loaded bitmaps and of their mirrored variants per asset. 
+  // Every draw of a bitmap, which was decoded in another format, is a 
+  // conversion avoided at draw time.
+  using DrawCount = std::function<std::uint64_t(Gdiplus::Bitmap const*)>;
+  void writeReport(Logger& log, DrawCount const& draws) const;
+
+private:
+  struct Decoded
+  {
+    std::shared_ptr<Gdiplus::Bitmap> bitmap;
+    Gdiplus::PixelFormat source_format = PixelFormat32bppPARGB;
+
+    // Referred to by the bitmap. The mirrored variants are made from these,
+    // never from the bitmap, which may be drawn in the meantime.
+    PixelBuffer pixels;
+  };
+
+  static Decoded decode(const WCHAR* file);
+  Decoded decode(AssetId id) const;
+
+  Gdiplus::PixelFormat sourceFormat(Gdiplus::Bitmap const* bitmap) const;
+  PixelBuffer pixels(Gdiplus::Bitmap const* bitmap) const;
+
+  BitmapHandle submit(std::function<Decoded()> load);
+  BitmapHandle submitFlipped(BitmapHandle original, Flip flip);
+
+  using Variants = std::array<BitmapHandle, int(Flip::Count)>;
+
+  ThreadPool& pool_;
+  std::unordered_map<std::wstring, Variants> bitmaps_;
+
+  std::shared_ptr<ResourcePack> pack_;
+  std::vector<Variants> packed_;
+
+  std::atomic<int> pending_ = 0;
+  mutable std::mutex mutex_;
+  std::chrono::steady_clock::time_point last_loaded_time_;
+  std::unordered_map<Gdiplus::Bitmap const*, Gdiplus::PixelFormat> source_formats_;
+  std::unordered_map<Gdiplus::Bitmap const*, PixelBuffer> pixels_;
+  std::unordered_map<Gdiplus::Bitmap const*, std::shared_ptr<CollisionMask const>> masks_;
+};
+
+AssetLoader::AssetLoader(ThreadPool& pool, std::shared_ptr<ResourcePack> pack) : 
+  pool_(pool), pack_(std::move(pack))
+{
+  if (pack_) packed_.resize(pack_->assetCount());
+}
+
+AssetLoader::~AssetLoader()
+{
+  // Tasks still in flight refer to this loader.
+  waitAll();
+}
+
+BitmapHandle AssetLoader::loadBitmap(const WCHAR* file, Flip flip)
+{
+  if (pack_)
+  {
+    const auto id = pack_->find(std::filesystem::path(file).filename().string());
+    if (id != invalid_asset) return loadBitmap(id, flip);
+  }
+
+  auto& variants = bitmaps_[file];
+  auto& handle = variants[int(flip)];
+  if (handle.valid()) return handle;
+
+  if (flip == Flip::None)
+    handle = submit([file]() { return decode(file); });
+  else
+    handle = submitFlipped(loadBitmap(file), flip);
+
+  return handle;
+}
+
+BitmapHandle AssetLoader::loadBitmap(AssetId id, Flip flip)
+{
+  auto& handle = packed_.at(id)[int(flip)];
+  if (handle.valid()) return handle;
+
+  if (flip == Flip::None)
+    handle = submit([this, id]() { return decode(id); });
+  else
+    handle = submitFlipped(loadBitmap(id), flip);
+
+  return handle;
+}
+
+BitmapHandle AssetLoader::submitFlipped(BitmapHandle original, Flip flip)
+{
+  // The original is submitted first, so it has at least been started by the
+  // time this task runs. Its pixels are recorded before it is handed out.
+  return submit([this, original, flip]() 
+    { 
+      const auto bitmap = original.get().get();
+      const auto flipped = make_flipped(pixels(bitmap), flip);
+      return Decoded{ make_bitmap(flipped), sourceFormat(bitmap), flipped }; 
+    });
+}
+
+BitmapHandle AssetLoader::submit(std::function<Decoded()> load)
+{
+  ++pending_;
+  return pool_.submit([this, load = std::move(load)]() 
+    {
+      Decoded decoded;
+      std::shared_ptr<CollisionMask const> mask;
+      try
+      {
+        decoded = load();
+        mask = make_collision_mask(decoded.pixels);
+      }
+      catch (...)
+      {
+        --pending_;
+        throw;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_loaded_time_ = std::chrono::steady_clock::now();
+        source_formats_[decoded.bitmap.get()] = decoded.source_format;
+        pixels_[decoded.bitmap.get()] = decoded.pixels;
+        masks_[decoded.bitmap.get()] = std::move(mask);
+      }
+      --pending_;
+
+      return decoded.bitmap;
+    }).share();
+}
+
+Gdiplus::PixelFormat AssetLoader::sourceFormat(Gdiplus::Bitmap const* bitmap) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = source_formats_.find(bitmap);
+  return it != source_formats_.end() ? it->second : PixelFormat32bppPARGB;
+}
+
+PixelBuffer AssetLoader::pixels(Gdiplus::Bitmap const* bitmap) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pixels_.at(bitmap);
+}
+
+std::shared_ptr<CollisionMask const> AssetLoader::collisionMask(Gdiplus::Bitmap const* bitmap) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = masks_.find(bitmap);
+  return it != masks_.end() ? it->second : nullptr;
+}
+
+void AssetLoader::waitAll()
+{
+  for (auto& [file, variants] : bitmaps_)
+  {
+    for (auto& handle : variants)
+      if (handle.valid()) handle.wait();
+  }
+
+  for (auto& variants : packed_)
+  {
+    for (auto& handle : variants)
+      if (handle.valid()) handle.wait();
+  }
+}
+
+void AssetLoader::writeReport(Logger& log, DrawCount const& draws) const
+{
+  std::size_t total_bytes = 0;
+  std::size_t total_mirrored_bytes = 0;
+  std::uint64_t total_avoided = 0;
+  const auto report = [&](std::string const& name, Variants const& variants, const char* source)
+  {
+    std::size_t bytes = 0;
+    std::size_t mirrored_bytes = 0;
+    int mirrored = 0;
+    Gdiplus::PixelFormat source_format = PixelFormat32bppPARGB;
+    std::uint64_t avoided = 0;
+    for (int flip = 0; flip < int(Flip::Count); ++flip)
+    {
+      const auto& handle = variants[flip];
+      if (!handle.valid() || !isReady(handle)) continue;
+
+      const auto& bitmap = handle.get();
+      source_format = sourceFormat(bitmap.get());
+      if (source_format != PixelFormat32bppPARGB)
+        avoided += draws(bitmap.get());
+
+      const auto size = bitmap_bytes(*bitmap);
+      if (flip == int(Flip::None))
+      {
+        bytes += size;
+      }
+      else
+      {
+        mirrored_bytes += size;
+        ++mirrored;
+      }
+    }
+
+    log << "  " << name << " (" << source << "): " << bytes << " bytes, " 
+      << mirrored << " mirrored variants " << mirrored_bytes << " bytes, decoded as " 
+      << pixel_format_name(source_format) << ", " << avoided << " conversions avoided" << std::endl;
+    total_bytes += bytes;
+    total_mirrored_bytes += mirrored_bytes;
+    total_avoided += avoided;
+  };
+
+  for (const auto& [file, variants] : bitmaps_)
+    report(std::filesystem::path(file).filename().string(), variants, "file");
+
+  for (AssetId id = 0; id < packed_.size(); ++id)
+  {
+    const auto& entry = pack_->entry(id);
+    report(entry.name, packed_[id], entry.format == PackFormat::Pargb ? "pack, pre-decoded" : "pack");
+  }
+
+  log << "Assets: " << total_bytes << " bytes, mirrored variants " << total_mirrored_bytes 
+    << " bytes, " << total_avoided << " draw time conversions avoided" << std::endl;
+}
+
+std::chrono::steady_clock::time_point AssetLoader::lastLoadedTime() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return last_loaded_time_;
+}
+
+AssetLoader::Decoded AssetLoader::decode(const WCHAR* file)
+{
+  Gdiplus::Bitmap bitmap(file);
+  if (bitmap.GetLastStatus() != Gdiplus::Ok)
+    throw std::runtime_error("Loading bitmap failed.");
+
+  const auto pixels = copy_pixels(bitmap);
+  return Decoded{ make_bitmap(pixels), bitmap.GetPixelFormat(), pixels };
+}
+
+AssetLoader::Decoded AssetLoader::decode(AssetId id) const
+{
+  const auto& entry = pack_->entry(id);
+  const auto bytes = pack_->data(id);
+
+  if (entry.format == PackFormat::Pargb)
+  {
+    // The pixels stay in the mapping, which they keep alive.
+    PixelBuffer pixels;
+    pixels.data = std::shared_ptr<std::uint8_t>(pack_, bytes);
+    pixels.width = INT(entry.width);
+    pixels.height = INT(entry.height);
+    pixels.stride = std::ptrdiff_t(entry.stride);
+    return Decoded{ make_bitmap(pixels), PixelFormat32bppPARGB, pixels };
+  }
+
+  // GDI+ decodes lazily, so the stream has to outlive the conversion.
+  const auto stream = SHCreateMemStream(bytes, UINT(entry.size));
+  if (!stream)
+    throw std::runtime_error("Loading packed bitmap failed.");
+
+  Decoded decoded;
+  try
+  {
+    Gdiplus::Bitmap bitmap(stream);
+    if (bitmap.GetLastStatus() != Gdiplus::Ok)
+      throw std::runtime_error("Loading packed bitmap failed.");
+
+    const auto pixels = copy_pixels(bitmap);
+    decoded = Decoded{ make_bitmap(pixels), bitmap.GetPixelFormat(), pixels };
+  }
+  catch (...)
+  {
+    stream->Release();
+    throw;
+  }
+
+  stream->Release();
+  return decoded;
+}
+
+// The pens are created by the renderer, one for each color.
+class RectGraphics : public GraphicsHandler
+{
+public:
+  RectGraphics(int width, int height, Gdiplus::Color color = Gdiplus::Color(255, 0, 0, 0));
+
+  void handleGraphics(Object& obj, RenderState& state) override;
+
+private:
+  int w_ = 0, h_ = 0;
+  Gdiplus::ARGB color_ = 0;
+};
+
+RectGraphics::RectGraphics(int width, int height, Gdiplus::Color color) : 
+  w_(width), h_(height), color_(color.GetValue()) {}
+
+void RectGraphics::handleGraphics(Object& obj, RenderState& state)
+{
+  state.addOutline(color_, obj.x, obj.y, w_, h_);
+}
+
+class BitmapGraphics : public GraphicsHandler, public Pooled<BitmapGraphics>
+{
+public:
+  BitmapGraphics(const WCHAR* file);
+
+  // Shares the bitmap. Nothing is drawn until it has been loaded.
+  explicit BitmapGraphics(BitmapHandle bitmap);
+
+  void handleGraphics(Object& obj, RenderState& state) override;
+
+private:
+  BitmapHandle handle_;
+  std::shared_ptr<Gdiplus::Bitmap> bitmap_;
+};
+
+BitmapGraphics::BitmapGraphics(const WCHAR* file) 
+{
+  Gdiplus::Bitmap bitmap(file);
+  handle_ = make_ready_handle(make_native(bitmap));
+}
+
+BitmapGraphics::BitmapGraphics(BitmapHandle bitmap) : handle_(std::move(bitmap)) {}
+
+void BitmapGraphics::handleGraphics(Object& obj, RenderState& state)
+{
+  if (!bitmap_)
+  {
+    if (!isReady(handle_)) return;
+    bitmap_ = handle_.get();
+  }
+
+  state.addSprite(bitmap_, obj.x, obj.y);
+}
+
+struct AnimationConfiguration
+{
+  struct SingleAnimationConfiguration
+  {
+    std::string name;
+    float fps = 1.f;
+    std::vector<const WCHAR*> frame_files;
+  };
+
+  std::vector<SingleAnimationConfiguration> single_animation_configs;
+};
+
+class AnimationGraphics : public GraphicsHandler
+{
+public:
+  AnimationGraphics(AnimationConfiguration const& config);
+
+  // Takes the frames from the loader. Blocks, unless they have been loaded.
+  AnimationGraphics(AnimationConfiguration const& config, AssetLoader& loader);
+
+  // Advances the frame and picks its variant, so the object collides with 
+  // the pixels, which are drawn.
+  void update(Object& obj, std::uint64_t tick, int animation_interval) override;
+  void handleGraphics(Object& obj, RenderState& state) override;
+
+  void play();
+  void stop();
+
+  void setAnimation(std::string const& animation);
+
+  void flipHorizontally(bool flip) override;
+  void flipVertically(bool flip);
+
+private:
+  using LoadFrame = std::function<BitmapHandle(const WCHAR*, Flip)>;
+  using FindMask = std::function<std::shared_ptr<CollisionMask const>(Gdiplus::Bitmap&)>;
+
+  AnimationGraphics(AnimationConfiguration const& config, LoadFrame load_frame, FindMask find_mask);
+
+  // The mirrored variants are requested, when the flip is first set, and 
+  // cached here once loaded. Until then the frame is drawn unflipped.
+  struct Frame
+  {
+    const WCHAR* file = nullptr;
+    std::array<BitmapHandle, int(Flip::Count)> variants;
+    std::array<std::shared_ptr<Gdiplus::Bitmap>, int(Flip::Count)> bitmaps;
+    std::array<std::shared_ptr<CollisionMask const>, int(Flip::Count)> masks;
+  };
+
+  struct SingleAnimationData
+  {
+    std::vector<Frame> frames;
+    float frame_time_ms;
+    int current_frame_idx_ = 0;
+  };
+
+  void setFlip(Flip flip);
+
+  // The flipped variant, if it has been loaded, otherwise the original.
+  int frameVariant(Frame& frame);
+
+  class FrameTimeout
+  {
+  public:
+    explicit FrameTimeout(float ms) : timeout_ms_(ms) 
+    {
+      start_ = std::chrono::high_resolution_clock::now();
+    }
+
+    void restart(float ms)
+    {
+      timeout_ms_ = ms;
+      reset();
+    }
+
+    bool is_out() const
+    {
+      const auto current = std::chrono::high_resolution_clock::now();
+      const auto diff = std::chrono::duration<float>(current - start_);
+
+      return std::chrono::duration_cast<std::chrono::milliseconds>(diff).count() > timeout_ms_;
+    }
+
+    void reset()
+    {
+      start_ = std::chrono::high_resolution_clock::now();
+    }
+
+  private:
+    float timeout_ms_;
+    std::chrono::high_resolution_clock::time_point start_;
+  };
+
+  std::unordered_map<std::string, SingleAnimationData> animation_data_;
+  SingleAnimationData* current_animation_data_ = nullptr;
+
+  LoadFrame load_frame_;
+  FindMask find_mask_;
+  Flip flip_ = Flip::None;
+
+  // Chosen by the last update.
+  std::shared_ptr<Gdiplus::Bitmap> current_bitmap_;
+
+  FrameTimeout frame_timeout_{ 0.f };
+};
+
+AnimationGraphics::AnimationGraphics(AnimationConfiguration const& config) : 
+  AnimationGraphics(config, [](const WCHAR* file, Flip flip) 
+    {
+      Gdiplus::Bitmap bitmap(file);
+      const auto pixels = copy_pixels(bitmap);
+      return make_ready_handle(make_bitmap(flip == Flip::None ? pixels : make_flipped(pixels, flip)));
+    }, [](Gdiplus::Bitmap& bitmap) { return make_collision_mask(bitmap); }) {}
+
+AnimationGraphics::AnimationGraphics(AnimationConfiguration const& config, AssetLoader& loader) : 
+  AnimationGraphics(config, [&loader](const WCHAR* file, Flip flip) { return loader.loadBitmap(file, flip); },
+    [&loader](Gdiplus::Bitmap& bitmap) { return loader.collisionMask(&bitmap); }) {}
+
+AnimationGraphics::AnimationGraphics(AnimationConfiguration const& config, LoadFrame load_frame, FindMask find_mask) : 
+  load_frame_(std::move(load_frame)), find_mask_(std::move(find_mask))
+{
+  for (const auto& single_animation_config : config.single_animation_configs)
+  {
+    SingleAnimationData single_data;
+    single_data.current_frame_idx_ = 0;
+    single_data.frame_time_ms = 1000.f / single_animation_config.fps;
+
+    for (const auto& file : single_animation_config.frame_files)
+    {
+      Frame frame;
+      frame.file = file;
+      frame.variants[0] = load_frame_(file, Flip::None);
+      frame.bitmaps[0] = frame.variants[0].get();
+      frame.masks[0] = find_mask_(*frame.bitmaps[0]);
+      single_data.frames.emplace_back(std::move(frame));
+    }
+
+    const auto animation_name = single_animation_config.name;
+    animation_data_.emplace(animation_name, std::move(single_data));
+  }
+
+  const auto& first_name = config.single_animation_configs.front().name;
+  current_animation_data_ = &(animation_data_.at(first_name));
+  frame_timeout_.restart(current_animation_data_->frame_time_ms);
+}
+
+void AnimationGraphics::update(Object& obj, std::uint64_t tick, int animation_interval)
+{
+  if (!current_animation_data_) return;
+
+  if (tick % animation_interval == 0 && frame_timeout_.is_out())
+  {
+    auto& data = current_animation_data_;
+    data->current_frame_idx_ = (data->current_frame_idx_ + 1) % data->frames.size();
+
+    frame_timeout_.reset();
+  }
+
+  auto& frame = current_animation_data_->frames.at(current_animation_data_->current_frame_idx_);
+  const auto variant = frameVariant(frame);
+  current_bitmap_ = frame.bitmaps[variant];
+  obj.collision_mask = frame.masks[variant].get();
+}
+
+void AnimationGraphics::handleGraphics(Object& obj, RenderState& state)
+{
+  if (current_bitmap_) state.addSprite(current_bitmap_, obj.x, obj.y);
+}
+
+int AnimationGraphics::frameVariant(Frame& frame)
+{
+  const auto flip = int(flip_);
+  if (!frame.bitmaps[flip] && isReady(frame.variants[flip]))
+  {
+    frame.bitmaps[flip] = frame.variants[flip].get();
+    frame.masks[flip] = find_mask_(*frame.bitmaps[flip]);
+  }
+
+  return frame.bitmaps[flip] ? flip : 0;
+}
+
+void AnimationGraphics::play()
+{
+}
+
+void AnimationGraphics::stop()
+{
+}
+
+void AnimationGraphics::setAnimation(std::string const& animation)
+{
+  auto it = animation_data_.find(animation);
+  if (it == animation_data_.end()) return;
+
+  current_animation_data_ = &(it->second);
+  frame_timeout_.restart(current_animation_data_->frame_time_ms);
+}
+
+void AnimationGraphics::flipHorizontally(bool flip)
+{
+  const auto vertical = int(flip_) & int(Flip::Vertical);
+  setFlip(Flip(vertical | (flip ? int(Flip::Horizontal) : 0)));
+}
+
+void AnimationGraphics::flipVertically(bool flip)
+{
+  const auto horizontal = int(flip_) & int(Flip::Horizontal);
+  setFlip(Flip(horizontal | (flip ? int(Flip::Vertical) : 0)));
+}
+
+void AnimationGraphics::setFlip(Flip flip)
+{
+  flip_ = flip;
+
+  // Request the variant of all frames at once, so that they are ready before
+  // the animation gets to them.
+  for (auto& [name, data] : animation_data_)
+  {
+    for (auto& frame : data.frames)
+    {
+      auto& variant = frame.variants[int(flip)];
+      if (!variant.valid()) variant = load_frame_(frame.file, flip);
+    }
+  }
+}
+
+struct Configuration
+{
+  struct
+  {
+    int window_width;
+    int window_height;
+    HINSTANCE instance;
+    int cmd_show;
+    float fps;
+  } game;
+
+  // Options of automated benchmark runs, set from the command line.
+  struct
+  {
+    // Fail the run, when a steady state frame allocates (requires a build 
+    // with GAME2D_TRACK_ALLOCATIONS).
+    bool alloc_check = false;
+
+    // Quit after the number of frames (0 runs until the window is closed).
+    int max_frames = 0;
+
+    // Run the snapshot capture benchmark instead of the game.
+    bool snapshots = false;
+
+    // Compare virtual and static dispatch of the motions instead of the game.
+    bool dispatch = false;
+
+    // Run the particle update benchmark instead of the game.
+    bool particles = false;
+
+    // Compare hierarchical and plain A* path queries instead of the game.
+    bool paths = false;
+
+    // Compare simulating the changed and all water chunks instead of the game.
+    bool water = false;
+
+    // Step this number of headless worlds for max_frames ticks instead of 
+    // the game.
+    int worlds = 0;
+
+    // Compare loading the assets from the files and from the pack instead 
+    // of the game.
+    bool assets = false;
+
+    // Compare the tiled software rasterizer with a single tile instead of 
+    // the game.
+    bool raster = false;
+  } benchmark;
+
+  struct
+  {
+    // Rasterize the frames on the CPU instead of drawing them with GDI+.
+    bool software = false;
+
+    // Side of the square screen tiles of the software rasterizer in pixels.
+    int tile_size;
+  } render;
+
+  struct
+  {
+    // Resource pack used instead of the single files, if it exists.
+    std::wstring pack;
+
+    // Build the pack from the files of the directory instead of running the
+    // game. The images are pre-decoded, unless encoded is set.
+    std::wstring build_from;
+    bool build_encoded = false;
+  } assets;
+
+  struct
+  {
+    // Length of the history kept for rewinding.
+    float history_seconds;
+    float rewind_seconds;
+    std::size_t buffer_bytes;
+    int keyframe_interval;
+  } snapshots;
+
+  struct
+  {
+    float v;
+    float g;
+    const WCHAR* bitmap;
+    Size size;
+    AnimationConfiguration anim_config;
+  } player;
+
+  struct
+  {
+    float v;
+    const WCHAR* bitmap;
+    Size size;
+  } bullet;
+
+  struct
+  {
+    std::size_t capacity;
+    float gravity;
+  } particles;
+
+  struct
+  {
+    // Side of the square clusters of the hierarchical pathfinder in cells.
+    int cluster_size;
+  } paths;
+
+  struct
+  {
+    // Distance in cells, up to which the player sees.
+    int radius;
+  } visibility;
+
+  struct
+  {
+    // Shares of the frame budget: the mean work time of a window of frames
+    // above the first degrades the quality by a step, below the second 
+    // restores a step.
+    float degrade_load;
+    float restore_load;
+    int window_frames;
+
+    // Bullets spawned per tick, once spawns are capped.
+    int spawn_limit;
+  } governor;
+
+  struct
+  {
+    // Upper limits, the solver stops as soon as the contacts are resolved.
+    int velocity_iterations;
+    int position_iterations;
+  } contacts;
+
+  TileConfiguration tile_config;
+};
+
+Configuration read_config()
+{
+  Configuration config;
+
+  config.game.window_width = 1000;
+  config.game.window_height = 800;
+
+  config.game.fps = 16;
+
+  config.player.v = .5f;
+  config.player.g = 0.1f;
+  config.player.bitmap = L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\shooter.jpg";
+  config.player.size = Size{ 50.f, 50.f };
+  auto& anim = config.player.anim_config;
+  AnimationConfiguration::SingleAnimationConfiguration walk_anim;
+  walk_anim.fps = 3.f;
+  walk_anim.name = "walk";
+  walk_anim.frame_files.push_back(L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\walking_1.png");
+  walk_anim.frame_files.push_back(L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\walking_2.png");
+  anim.single_animation_configs.push_back(walk_anim);
+
+  config.bullet.v = 3.f;
+  config.bullet.bitmap = L"C:\\Jan\\Programiranje\\\C++\\Game2d\\resources\\bullet.png";
+  config.bullet.size = Size{ 50.f, 50.f };
+
+  config.particles.capacity = 128 * 1024;
+  config.particles.gravity = 0.15f;
+
+  config.paths.cluster_size = 16;
+
+  config.assets.pack = L"resources.pack";
+
+  config.render.tile_size = 64;
+
+  config.visibility.radius = 16;
+
+  config.governor.degrade_load = 0.9f;
+  config.governor.restore_load = 0.6f;
+  config.governor.window_frames = 32;
+  config.governor.spawn_limit = 1;
+
+  config.contacts.velocity_iterations = 8;
+  config.contacts.position_iterations = 3;
+
+  config.snapshots.history_seconds = 10.f;
+  config.snapshots.rewind_seconds = 3.f;
+  config.snapshots.buffer_bytes = 16 << 20;
+  config.snapshots.keyframe_interval = 32;
+
+  float tile_sz = 20.f;
+  config.tile_config.tile_size = tile_sz;
+  config.tile_config.grid_width = config.game.window_width / tile_sz;
+  config.tile_config.grid_height = config.game.window_height / tile_sz;
+
+  // Fill bottom row of the window with tiles.
+  const auto grid_y = config.tile_config.grid_height - 5;
+  auto& tiles = config.tile_config.tiles;
+  for (int i = 3; i < config.tile_config.grid_width - 4; ++i)
+    tiles.push_back(Tile{ Point{ i, grid_y }, TileType::Ground });
+
+  // Water above the ground, which pours down and spreads.
+  for (int y = 8; y < 14; ++y)
+    for (int x = 8; x < 16; ++x)
+      tiles.push_back(Tile{ Point{ x, y }, TileType::Water });
+
+  return config;
+}
+
+// Reads the benchmark options, e.g. "--alloc-check --frames=600".
+void read_command_line(std::wstring const& cmd_line, Configuration& config)
+{
+  std::wistringstream stream(cmd_line);
+  std::wstring arg;
+  while (stream >> arg)
+  {
+    if (arg == L"--alloc-check")
+      config.benchmark.alloc_check = true;
+    else if (arg == L"--bench-snapshots")
+      config.benchmark.snapshots = true;
+    else if (arg == L"--bench-dispatch")
+      config.benchmark.dispatch = true;
+    else if (arg == L"--bench-particles")
+      config.benchmark.particles = true;
+    else if (arg == L"--bench-paths")
+      config.benchmark.paths = true;
+    else if (arg == L"--bench-water")
+      config.benchmark.water = true;
+    else if (arg == L"--bench-assets")
+      config.benchmark.assets = true;
+    else if (arg == L"--bench-raster")
+      config.benchmark.raster = true;
+    else if (arg == L"--software-render")
+      config.render.software = true;
+    else if (arg.rfind(L"--build-pack=", 0) == 0)
+      config.assets.build_from = arg.substr(13);
+    else if (arg == L"--pack-encoded")
+      config.assets.build_encoded = true;
+    else if (arg.rfind(L"--bench-worlds=", 0) == 0)
+      config.benchmark.worlds = std::stoi(arg.substr(15));
+    else if (arg.rfind(L"--frames=", 0) == 0)
+      config.benchmark.max_frames = std::stoi(arg.substr(9));
+    else
+      logger << "Unknown argument ignored." << std::endl;
+  }
+}
+
+// Everything needed to create bullets.
+struct BulletTemplate
+{
+  Size size;
+
+  // Bullets are not drawn, if not set (headless worlds).
+  BitmapHandle bitmap;
+  TileGrid const* grid = nullptr;
+  ParticleSystem* particles = nullptr;
+};
+
+std::unique_ptr<Object> makeBullet(float x, float y, float vx, BulletTemplate const& bullet);
+
+// Change of the objects of a world, which is deferred to a fixed point of the
+// tick (see World::applyCommands).
+struct Command
+{
+  enum class Type : std::uint8_t { SetMotion, SetVelocity, StopVelocity, Face, Despawn, SpawnBullet };
+
+  // Components of the velocity changed by SetVelocity and StopVelocity.
+  static constexpr std::uint8_t velocity_x = 1;
+  static constexpr std::uint8_t velocity_y = 2;
+
+  Type type = Type::SetMotion;
+  std::uint8_t components = 0;
+
+  // Set by Face, mirrors the graphics horizontally.
+  bool left = false;
+
+  // Id of the target object, or the id given to the spawned one (0 for a new
+  // id).
+  std::uint32_t id = 0;
+
+  float x = 0.f, y = 0.f;
+  float vx = 0.f, vy = 0.f;
+};
+
+// Records commands instead of changing the objects while they are iterated.
+// Each thread, which records, has a buffer of its own.
+class CommandBuffer
+{
+public:
+  void reserve(std::size_t count) { commands_.reserve(count); }
+
+  void spawnBullet(float x, float y, float vx, std::uint32_t id = 0);
+  void despawn(Object const& obj);
+
+  // Sets the position and the velocity and wakes the object.
+  void setMotion(Object const& obj, float x, float y, float vx, float vy);
+
+  // Sets the given components of the velocity and wakes the object.
+  void setVelocity(Object const& obj, std::uint8_t components, float vx, float vy);
+
+  // Stops the given components of the velocity, if they still point in the
+  // direction of vx and vy, e.g. when the key moving there is released.
+  void stopVelocity(Object const& obj, std::uint8_t components, float vx, float vy);
+
+  // Turns the graphics of the object to the left or back.
+  void face(Object const& obj, bool left);
+
+  std::vector<Command> const& commands() const { return commands_; }
+  void clear() { commands_.clear(); }
+
+private:
+  std::vector<Command> commands_;
+};
+
+void CommandBuffer::spawnBullet(float x, float y, float vx, std::uint32_t id)
+{
+  Command command;
+  command.type = Command::Type::SpawnBullet;
+  command.id = id;
+  command.x = x;
+  command.y = y;
+  command.vx = vx;
+  commands_.push_back(command);
+}
+
+void CommandBuffer::despawn(Object const& obj)
+{
+  Command command;
+  command.type = Command::Type::Despawn;
+  command.id = obj.id;
+  commands_.push_back(command);
+}
+
+void CommandBuffer::setMotion(Object const& obj, float x, float y, float vx, float vy)
+{
+  Command command;
+  command.type = Command::Type::SetMotion;
+  command.id = obj.id;
+  command.x = x;
+  command.y = y;
+  command.vx = vx;
+  command.vy = vy;
+  commands_.push_back(command);
+}
+
+void CommandBuffer::setVelocity(Object const& obj, std::uint8_t components, float vx, float vy)
+{
+  Command command;
+  command.type = Command::Type::SetVelocity;
+  command.components = components;
+  command.id = obj.id;
+  command.vx = vx;
+  command.vy = vy;
+  commands_.push_back(command);
+}
+
+void CommandBuffer::stopVelocity(Object const& obj, std::uint8_t components, float vx, float vy)
+{
+  Command command;
+  command.type = Command::Type::StopVelocity;
+  command.components = components;
+  command.id = obj.id;
+  command.vx = vx;
+  command.vy = vy;
+  commands_.push_back(command);
+}
+
+void CommandBuffer::face(Object const& obj, bool left)
+{
+  Command command;
+  command.type = Command::Type::Face;
+  command.id = obj.id;
+  command.left = left;
+  commands_.push_back(command);
+}
+
+class PlayerInput : public InputHandler
+{
+public:
+  PlayerInput(Configuration const& config, CommandBuffer& commands);
+
+  void handleInput(Object& obj, KeyState state, int vkey) override;
+
+public:
+  void createBullet(Object& obj);
+
+  float v_ = 0.f;
+  float v_bullet_ = 0.f;
+  CommandBuffer& commands_;
+
+  int last_dir_ = VK_RIGHT;
+};
+
+PlayerInput::PlayerInput(Configuration const& config, CommandBuffer& commands) :
+  v_(config.player.v), v_bullet_(config.bullet.v), commands_(commands) {}
+
+void PlayerInput::handleInput(Object& obj, KeyState state, int vkey)
+{
+  // Handle movement. The velocity and the facing are applied with the other
+  // commands at the start of the next update.
+  if (state == KeyState::Down)
+  {
+    if (vkey == VK_LEFT)
+    {
+      last_dir_ = vkey;
+      commands_.setVelocity(obj, Command::velocity_x, -v_, 0.f);
+      commands_.face(obj, true);
+    }
+    else if (vkey == VK_RIGHT)
+    {
+      last_dir_ = vkey;
+      commands_.setVelocity(obj, Command::velocity_x, v_, 0.f);
+      commands_.face(obj, false);
+    }
+    else if (vkey == VK_UP)
+    {
+      commands_.setVelocity(obj, Command::velocity_y, 0.f, -v_);
+    }
+    else if (vkey == VK_DOWN)
+    {
+      commands_.setVelocity(obj, Command::velocity_y, 0.f, v_);
+    }
+  }
+  else // KeyState::Up
+  {
+    if (vkey == VK_LEFT)
+    {
+      commands_.stopVelocity(obj, Command::velocity_x, -1.f, 0.f);
+    }
+    else if (vkey == VK_RIGHT)
+    {
+      commands_.stopVelocity(obj, Command::velocity_x, 1.f, 0.f);
+    }
+    else if (vkey == VK_UP)
+    {
+      commands_.stopVelocity(obj, Command::velocity_y, 0.f, -1.f);
+    }
+    else if (vkey == VK_DOWN)
+    {
+      commands_.stopVelocity(obj, Command::velocity_y, 0.f, 1.f);
+    }
+  }
+
+  if (vkey == VK_SPACE && state == KeyState::Down)
+  {
+    createBullet(obj);
+  }
+}
+
+std::unique_ptr<Object> makeBullet(float x, float y, float vx, BulletTemplate const& bullet_template)
+{
+  auto bullet = std::make_unique<Object>(x, y, vx, 0.f, bullet_template.size);
+  bullet->kind = EntityKind::Bullet;
+  bullet->body = BodyType::Kinematic;
+
+  // Tiles are hit by the motion, bullets take no part in the collision detection.
+  bullet->motion = BulletMotion(bullet_template.grid, bullet_template.particles);
+  if (bullet_template.bitmap.valid())
+    bullet->graphics_handler_ = std::make_unique<BitmapGraphics>(bullet_template.bitmap);
+
+  return bullet;
+}
+
+void PlayerInput::createBullet(Object& obj)
+{
+  // We only consider left and right direction.
+  const auto dir = last_dir_ == VK_LEFT ? -1.f : 1.f;
+
+  commands_.spawnBullet(obj.x, obj.y, dir * v_bullet_);
+}
+
+// Represents the solid cells of the tile grid as objects. Adjacent cells of 
+// the same type are greedily merged into maximal rectangles, each of which is
+// a single object used for collisions as well as for drawing.
+class TileLayer
+{
+public:
+  TileLayer(TileGrid& grid, std::vector<std::unique_ptr<Object>>& objects);
+
+  // Merges the whole grid.
+  void build();
+
+  // Changes a single cell and re-merges only the rectangles around it.
+  void setTile(int x, int y, TileType type);
+
+  std::size_t rectCount() const { return rects_.size() - free_rects_.size(); }
+
+private:
+  struct MergedRect
+  {
+    GridRect cells;
+    TileType type = TileType::Clear;
+    Object* object = nullptr;
+  };
+
+  // Dissolves the rectangle and marks its cells for merging.
+  void dissolve(int rect_idx);
+
+  // Greedily covers the pending cells inside the area with rectangles.
+  void merge(GridRect area);
+
+  void addObject(MergedRect& rect);
+
+  TileGrid& grid_;
+  std::vector<std::unique_ptr<Object>>& objects_;
+
+  std::vector<MergedRect> rects_;
+  std::vector<int> free_rects_;
+
+  // Rectangle index covering each cell (-1 for clear cells).
+  std::vector<int> owner_;
+
+  // Cells waiting to be merged.
+  std::vector<bool> pending_;
+};
+
+TileLayer::TileLayer(TileGrid& grid, std::vector<std::unique_ptr<Object>>& objects) :
+  grid_(grid), objects_(objects)
+{
+  owner_.resize(grid_.width() * grid_.height(), -1);
+  pending_.resize(grid_.width() * grid_.height(), false);
+}
+
+void TileLayer::build()
+{
+  for (int i = 0; i < int(rects_.size()); ++i)
+    if (rects_[i].object) dissolve(i);
+
+  for (int y = 0; y < grid_.height(); ++y)
+    for (int x = 0; x < grid_.width(); ++x)
+      pending_[y * grid_.width() + x] = grid_.isSolid(x, y);
+
+  merge(GridRect{ 0, 0, grid_.width(), grid_.height() });
+}
+
+void TileLayer::setTile(int x, int y, TileType type)
+{
+  if (!grid_.contains(x, y) || grid_.at(x, y) == type) return;
+
+  grid_.set(x, y, type);
+
+  // Dissolve the rectangle covering the cell and those of its neighbours, 
+  // which the changed cell may now join, then merge their cells anew.
+  GridRect area{ x, y, 1, 1 };
+  const Point neighbours[] = { { x, y }, { x - 1, y }, { x + 1, y }, { x, y - 1 }, { x, y + 1 } };
+  for (const auto pt : neighbours)
+  {
+    if (!grid_.contains(pt.x, pt.y)) continue;
+
+    const auto rect_idx = owner_[pt.y * grid_.width() + pt.x];
+    if (rect_idx < 0) continue;
+
+    const auto cells = rects_[rect_idx].cells;
+    const auto right = std::max(area.x + area.width, cells.x + cells.width);
+    const auto bottom = std::max(area.y + area.height, cells.y + cells.height);
+    area.x = std::min(area.x, cells.x);
+    area.y = std::min(area.y, cells.y);
+    area.width = right - area.x;
+    area.height = bottom - area.y;
+
+    dissolve(rect_idx);
+  }
+
+  pending_[y * grid_.width() + x] = grid_.isSolid(x, y);
+
+  merge(area);
+}
+
+void TileLayer::dissolve(int rect_idx)
+{
+  auto& rect = rects_[rect_idx];
+  for (int j = rect.cells.y; j < rect.cells.y + rect.cells.height; ++j)
+    for (int i = rect.cells.x; i < rect.cells.x + rect.cells.width; ++i)
+    {
+      owner_[j * grid_.width() + i] = -1;
+      pending_[j * grid_.width() + i] = true;
+    }
+
+  rect.object->remove = true;
+  rect.object = nullptr;
+  free_rects_.push_back(rect_idx);
+}
+
+void TileLayer::merge(GridRect area)
+{
+  const auto w = grid_.width();
+  for (int y = area.y; y < area.y + area.height; ++y)
+    for (int x = area.x; x < area.x + area.width; ++x)
+    {
+      if (!pending_[y * w + x]) continue;
+
+      const auto type = grid_.at(x, y);
+      const auto can_join = [&](int i, int j) { return pending_[j * w + i] && grid_.at(i, j) == type; };
+
+      // Grow to the right as far as possible, then downwards as long as the
+      // whole row below matches.
+      int width = 1;
+      while (x + width < area.x + area.width && can_join(x + width, y)) ++width;
+
+      int height = 1;
+      while (y + height < area.y + area.height)
+      {
+        bool row_matches = true;
+        for (int i = x; i < x + width && row_matches; ++i)
+          row_matches = can_join(i, y + height);
+
+        if (!row_matches) break;
+        ++height;
+      }
+
+      int rect_idx = 0;
+      if (!free_rects_.empty())
+      {
+        rect_idx = free_rects_.back();
+        free_rects_.pop_back();
+      }
+      else
+      {
+        rect_idx = int(rects_.size());
+        rects_.emplace_back();
+      }
+
+      auto& rect = rects_[rect_idx];
+      rect.cells = GridRect{ x, y, width, height };
+      rect.type = type;
+
+      for (int j = y; j < y + height; ++j)
+        for (int i = x; i < x + width; ++i)
+        {
+          owner_[j * w + i] = rect_idx;
+          pending_[j * w + i] = false;
+        }
+
+      addObject(rect);
+    }
+}
+
+void TileLayer::addObject(MergedRect& rect)
+{
+  const auto tile_size = grid_.tileSize();
+  const auto width = rect.cells.width * tile_size;
+  const auto height = rect.cells.height * tile_size;
+  const auto x = rect.cells.x * tile_size + 0.5f * width;
+  const auto y = rect.cells.y * tile_size + 0.5f * height;
+
+  auto tile = std::make_unique<Object>(x, y, 0.f, 0.f, Size{ width, height });
+  tile->kind = EntityKind::Tile;
+  tile->body = BodyType::Static;
+  tile->setCollisionHandler(std::make_unique<TileCollisionHandler>(*tile, grid_, rect.cells));
+  tile->graphics_handler_ = std::make_unique<RectGraphics>(int(width), int(height));
+
+  rect.object = tile.get();
+  objects_.emplace_back(std::move(tile));
+}
+
+class Window
+{
+public:
+  explicit Window(Configuration const& config);
+
+  HWND handle() const { return hWnd_; }
+
+  // Called for every key event.
+  void setKeyListener(std::function<void(KeyState, int)> listener);
+
+  // Called, when the content of the window needs to be drawn again.
+  void setPaintListener(std::function<void()> listener);
+private:
+  static LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+  LRESULT CALLBACK WindowProcImpl(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+
+  HWND hWnd_ = NULL;
+  std::function<void(KeyState, int)> key_listener_;
+  std::function<void()> paint_listener_;
+};
+
+Window::Window(Configuration const& config)
+{
+  const wchar_t CLASS_NAME[] = L"Game Window Class";
+  WNDCLASS window_class = {};
+  window_class.lpfnWndProc = WindowProc;
+  window_class.hInstance = config.game.instance;
+  window_class.lpszClassName = CLASS_NAME;
+
+  RegisterClass(&window_class);
+
+  HWND hWindow = CreateWindowEx(0, CLASS_NAME, L"Game", WS_OVERLAPPEDWINDOW, 
+    CW_USEDEFAULT, CW_USEDEFAULT, config.game.window_width, config.game.window_height,
+    NULL, NULL, config.game.instance, NULL);
+
+  if (hWindow == NULL)
+  {
+    throw std::runtime_error("Creating window failed.");
+  }
+
+  // Set a value at the specified offset (user data) in the extra window memory.
+  // Used to enable wrapping the member function into a static method.
+  SetWindowLongPtr(hWindow, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+
+  ShowWindow(hWindow, config.game.cmd_show);
+
+  hWnd_ = hWindow;
+}
+
+void Window::setKeyListener(std::function<void(KeyState, int)> listener)
+{
+  key_listener_ = std::move(listener);
+}
+
+void Window::setPaintListener(std::function<void()> listener)
+{
+  paint_listener_ = std::move(listener);
+}
+
+// This function is invoked internally by calling DispatchMessage(). Note that
+// it is executed in the same thread.
+LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+  // Standard pattern for wrapping the member function, so that it can be
+  // used as a callback (Windows expects a plain function, but member functions
+  // have an additional implicit this argument).
+  Window* this_ptr = nullptr;
+  if (uMsg == WM_NCCREATE)
+  {
+      this_ptr = reinterpret_cast<Window*>(reinterpret_cast<CREATESTRUCT*>(lParam)->lpCreateParams);
+      SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this_ptr));
+  }
+  else
+  {
+      this_ptr = reinterpret_cast<Window*>(GetWindowLongPtr(hWnd, GWLP_USERDATA));
+  }
+
+  if (this_ptr)
+  {
+      return this_ptr->WindowProcImpl(hWnd, uMsg, wParam, lParam);
+  }
+
+  return DefWindowProc(hWnd, uMsg, wParam, lParam);
+}
+
+LRESULT CALLBACK Window::WindowProcImpl(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+  switch (uMsg)
+  {
+  case WM_DESTROY:
+    PostQuitMessage(0);
+    return 0;
+  case WM_PAINT:
+    {
+      // Drawing happens on the render thread, only validate here.
+      PAINTSTRUCT ps;
+      BeginPaint(hWnd, &ps);
+      EndPaint(hWnd, &ps);
+
+      if (paint_listener_) paint_listener_();
+      break;
+    }
+  case WM_ERASEBKGND:
+    // The render thread fills the background.
+    return 1;
+  case WM_KEYDOWN:
+    if (key_listener_) key_listener_(KeyState::Down, int(wParam));
+    break;
+  case WM_KEYUP:
+    if (key_listener_) key_listener_(KeyState::Up, int(wParam));
+    break;
+
+    return 0;
+  }
+
+  return DefWindowProc(hWnd, uMsg, wParam, lParam);
+}
+
+// Source over blend of premultiplied ARGB, two channels at a time.
+inline std::uint32_t blend_over(std::uint32_t src, std::uint32_t dst)
+{
+  const auto alpha = src >> 24;
+  if (alpha == 255) return src;
+  if (alpha == 0) return dst;
+
+  const auto inv = 255 - alpha;
+  auto rb = (dst & 0x00ff00ffu) * inv + 0x00800080u;
+  rb = ((rb + ((rb >> 8) & 0x00ff00ffu)) >> 8) & 0x00ff00ffu;
+  auto ag = ((dst >> 8) & 0x00ff00ffu) * inv + 0x00800080u;
+  ag = (ag + ((ag >> 8) & 0x00ff00ffu)) & 0xff00ff00u;
+  return src + (rb | ag);
+}
+
+inline std::uint32_t premultiply(Gdiplus::ARGB color)
+{
+  const auto alpha = color >> 24;
+  const auto channel = [&](int shift) { return ((((color >> shift) & 0xff) * alpha + 127) / 255) << shift; };
+  return (alpha << 24) | channel(16) | channel(8) | channel(0);
+}
+
+// Draws the render states into a premultiplied 32 bit framebuffer on the 
+// CPU. The frame is split into square tiles, the draws are binned into the 
+// tiles they overlap in drawing order and the tiles are rasterized in 
+// parallel. Every pixel is blended with the same draws in the same order as
+// with a single tile, so the output does not depend on the tiling or the 
+// number of threads.
+class SoftwareRasterizer
+{
+public:
+  // Rasterizes on the calling thread, if the pool is not set.
+  SoftwareRasterizer(ThreadPool* pool, int tile_size);
+
+  // Keeps the framebuffer, if the size has not changed.
+  void resize(int width, int height);
+
+  // Must be called by a single thread, the pixels of the sprites are read
+  // from their bitmaps here.
+  void draw(RenderState const& state, Gdiplus::ARGB background);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Rows from top to bottom.
+  std::uint32_t const* pixels() const { return framebuffer_.data(); }
+
+  void writeReport(Logger& log) const;
+
+private:
+  // Copy of the premultiplied pixels of a bitmap. Holds the bitmap, so that
+  // its address is not reused by another one.
+  struct Sprite
+  {
+    std::shared_ptr<Gdiplus::Bitmap> bitmap;
+    std::vector<std::uint32_t> pixels;
+    int width = 0, height = 0;
+  };
+
+  // Bounds are in pixels, excluding right and bottom.
+  struct Draw
+  {
+    enum class Kind : std::uint8_t { Fill, Outline, Sprite };
+
+    Kind kind;
+    std::uint32_t color;
+    int left, top, right, bottom;
+    Sprite const* sprite;
+  };
+
+  Sprite const* sprite(std::shared_ptr<Gdiplus::Bitmap> const& bitmap);
+
+  void addFill(Gdiplus::RectF const& rect, std::uint32_t color);
+  void add(Draw const& draw);
+  void rasterizeTile(int tile, std::uint32_t background);
+
+  ThreadPool* pool_ = nullptr;
+  int tile_size_ = 0;
+  int width_ = 0, height_ = 0;
+  int tiles_x_ = 0, tiles_y_ = 0;
+  std::vector<std::uint32_t> framebuffer_;
+
+  std::vector<Draw> draws_;
+
+  // Indices of the draws overlapping each tile, in drawing order.
+  std::vector<std::vector<std::uint32_t>> bins_;
+
+  std::atomic<int> next_tile_{ 0 };
+  std::vector<std::future<void>> tasks_;
+
+  std::unordered_map<Gdiplus::Bitmap const*, Sprite> sprites_;
+
+  std::uint64_t frames_ = 0;
+  std::uint64_t draw_count_ = 0;
+  std::uint64_t binned_count_ = 0;
+  double bin_ms_sum_ = 0.0;
+  double raster_ms_sum_ = 0.0;
+};
+
+SoftwareRasterizer::SoftwareRasterizer(ThreadPool* pool, int tile_size) : 
+  pool_(pool), tile_size_(tile_size)
+{
+}
+
+void SoftwareRasterizer::resize(int width, int height)
+{
+  if (width == width_ && height == height_) return;
+
+  width_ = width;
+  height_ = height;
+  tiles_x_ = (width + tile_size_ - 1) / tile_size_;
+  tiles_y_ = (height + tile_size_ - 1) / tile_size_;
+  framebuffer_.assign(std::size_t(width) * height, 0);
+  bins_.resize(std::size_t(tiles_x_) * tiles_y_);
+}
+
+auto SoftwareRasterizer::sprite(std::shared_ptr<Gdiplus::Bitmap> const& bitmap) -> Sprite const*
+{
+  auto& sprite = sprites_[bitmap.get()];
+  if (sprite.bitmap) return &sprite;
+
+  sprite.bitmap = bitmap;
+  sprite.width = int(bitmap->GetWidth());
+  sprite.height = int(bitmap->GetHeight());
+  sprite.pixels.resize(std::size_t(sprite.width) * sprite.height);
+
+  Gdiplus::Rect rect(0, 0, sprite.width, sprite.height);
+  Gdiplus::BitmapData data;
+  if (sprite.pixels.empty() ||
+    bitmap->LockBits(&rect, Gdiplus::ImageLockModeRead, PixelFormat32bppPARGB, &data) != Gdiplus::Ok)
+  {
+    sprite.width = sprite.height = 0;
+    return &sprite;
+  }
+
+  for (int y = 0; y < sprite.height; ++y)
+  {
+    const auto row = static_cast<const std::uint8_t*>(data.Scan0) + std::ptrdiff_t(y) * data.Stride;
+    std::memcpy(sprite.pixels.data() + std::size_t(y) * sprite.width, row, sprite.width * sizeof(std::uint32_t));
+  }
+  bitmap->UnlockBits(&data);
+
+  return &sprite;
+}
+
+void SoftwareRasterizer::add(Draw const& draw)
+{
+  const auto left = std::max(draw.left, 0);
+  const auto top = std::max(draw.top, 0);
+  const auto right = std::min(draw.right, width_);
+  const auto bottom = std::min(draw.bottom, height_);
+  if (left >= right || top >= bottom) return;
+
+  const auto index = std::uint32_t(draws_.size());
+  draws_.push_back(draw);
+
+  for (int ty = top / tile_size_; ty <= (bottom - 1) / tile_size_; ++ty)
+  {
+    for (int tx = left / tile_size_; tx <= (right - 1) / tile_size_; ++tx)
+    {
+      bins_[ty * tiles_x_ + tx].push_back(index);
+      ++binned_count_;
+    }
+  }
+}
+
+void SoftwareRasterizer::addFill(Gdiplus::RectF const& rect, std::uint32_t color)
+{
+  // Pixels are covered, if their centers are inside the rectangle.
+  Draw draw{ Draw::Kind::Fill, color };
+  draw.left = int(std::ceil(rect.X - 0.5f));
+  draw.top = int(std::ceil(rect.Y - 0.5f));
+  draw.right = int(std::ceil(rect.X + rect.Width - 0.5f));
+  draw.bottom = int(std::ceil(rect.Y + rect.Height - 0.5f));
+  draw.sprite = nullptr;
+  add(draw);
+}
+
+void SoftwareRasterizer::draw(RenderState const& state, Gdiplus::ARGB background)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  draws_.clear();
+  for (auto& bin : bins_)
+    bin.clear();
+
+  // Drop the sprites of bitmaps, which nobody else holds anymore.
+  for (auto it = sprites_.begin(); it != sprites_.end();)
+    it = it->second.bitmap.use_count() == 1 ? sprites_.erase(it) : std::next(it);
+
+  // Same order and geometry as the GDI+ renderer.
+  for (const auto& item : state.items)
+  {
+    if (item.bitmap)
+    {
+      const auto image = sprite(item.bitmap);
+      const auto left = item.x - image->width / 2;
+      const auto top = item.y - image->height / 2;
+      add(Draw{ Draw::Kind::Sprite, 0, left, top, left + image->width, top + image->height, image });
+    }
+    else
+    {
+      // A pen of one pixel covers both the first and the last column and row.
+      const auto left = item.x - item.width / 2;
+      const auto top = item.y - item.height / 2;
+      add(Draw{ Draw::Kind::Outline, premultiply(item.color), left, top, 
+        left + item.width + 1, top + item.height + 1, nullptr });
+    }
+  }
+
+  const auto water = premultiply(Gdiplus::Color(160, 40, 110, 230).GetValue());
+  for (const auto& rect : state.water_rects)
+    addFill(rect, water);
+
+  const auto& offsets = state.particle_offsets;
+  for (int c = 0; c < int(ParticleColor::Count); ++c)
+  {
+    const auto color = premultiply(particle_color(ParticleColor(c)).GetValue());
+    for (auto i = offsets[c]; i < offsets[c + 1]; ++i)
+      addFill(state.particle_rects[i], color);
+  }
+
+  const auto fog = premultiply(Gdiplus::Color(190, 10, 10, 20).GetValue());
+  for (const auto& rect : state.fog_rects)
+    addFill(rect, fog);
+
+  const auto binned = std::chrono::steady_clock::now();
+
+  // Tiles are handed out one at a time, so that crowded tiles do not hold up
+  // a whole batch.
+  const auto tile_count = tiles_x_ * tiles_y_;
+  const auto opaque = premultiply(background | 0xff000000u);
+  const auto task_count = pool_ ? std::min<std::size_t>(tile_count, pool_->size()) : 1;
+  next_tile_ = 0;
+  const auto work = [this, tile_count, opaque]()
+  {
+    for (int tile = next_tile_++; tile < tile_count; tile = next_tile_++)
+      rasterizeTile(tile, opaque);
+  };
+
+  if (task_count <= 1)
+  {
+    work();
+  }
+  else
+  {
+    tasks_.clear();
+    for (std::size_t task = 0; task < task_count; ++task)
+      tasks_.push_back(pool_->submit(work));
+
+    for (auto& task : tasks_)
+      task.get();
+  }
+
+  const auto done = std::chrono::steady_clock::now();
+  ++frames_;
+  draw_count_ += draws_.size();
+  bin_ms_sum_ += std::chrono::duration<double, std::milli>(binned - start).count();
+  raster_ms_sum_ += std::chrono::duration<double, std::milli>(done - binned).count();
+}
+
+void SoftwareRasterizer::rasterizeTile(int tile, std::uint32_t background)
+{
+  const auto tile_left = (tile % tiles_x_) * tile_size_;
+  const auto tile_top = (tile / tiles_x_) * tile_size_;
+  const auto tile_right = std::min(tile_left + tile_size_, width_);
+  const auto tile_bottom = std::min(tile_top + tile_size_, height_);
+
+  const auto row = [&](int y) { return framebuffer_.data() + std::size_t(y) * width_; };
+  const auto fill = [&](std::uint32_t* pixel, std::uint32_t* end, std::uint32_t color)
+  {
+    if ((color >> 24) == 255)
+      std::fill(pixel, end, color);
+    else
+      for (; pixel != end; ++pixel) *pixel = blend_over(color, *pixel);
+  };
+
+  for (int y = tile_top; y < tile_bottom; ++y)
+    std::fill(row(y) + tile_left, row(y) + tile_right, background);
+
+  for (const auto index : bins_[tile])
+  {
+    const auto& draw = draws_[index];
+    const auto left = std::max(draw.left, tile_left);
+    const auto top = std::max(draw.top, tile_top);
+    const auto right = std::min(draw.right, tile_right);
+    const auto bottom = std::min(draw.bottom, tile_bottom);
+    if (left >= right || top >= bottom) continue;
+
+    switch (draw.kind)
+    {
+    case Draw::Kind::Fill:
+      for (int y = top; y < bottom; ++y)
+        fill(row(y) + left, row(y) + right, draw.color);
+      break;
+
+    case Draw::Kind::Outline:
+      for (int y = top; y < bottom; ++y)
+      {
+        if (y == draw.top || y == draw.bottom - 1)
+        {
+          fill(row(y) + left, row(y) + right, draw.color);
+          continue;
+        }
+
+        if (draw.left >= left) fill(row(y) + draw.left, row(y) + draw.left + 1, draw.color);
+        if (draw.right - 1 < right && draw.right - 1 != draw.left) 
+          fill(row(y) + draw.right - 1, row(y) + draw.right, draw.color);
+      }
+      break;
+
+    case Draw::Kind::Sprite:
+    {
+      const auto& sprite = *draw.sprite;
+      for (int y = top; y < bottom; ++y)
+      {
+        auto src = sprite.pixels.data() + std::size_t(y - draw.top) * sprite.width + (left - draw.left);
+        auto dst = row(y) + left;
+        for (int x = left; x < right; ++x, ++src, ++dst)
+          *dst = blend_over(*src, *dst);
+      }
+      break;
+    }
+    }
+  }
+}
+
+void SoftwareRasterizer::writeReport(Logger& log) const
+{
+  log << "Software rasterizer: " << width_ << "x" << height_ << " in " << tiles_x_ * tiles_y_ << " tiles of " 
+    << tile_size_ << " pixels, " << (pool_ ? pool_->size() : 1) << " threads" << std::endl;
+  if (frames_ == 0) return;
+
+  log << "  " << frames_ << " frames, " << draw_count_ / frames_ << " draws per frame, " 
+    << (draw_count_ > 0 ? double(binned_count_) / draw_count_ : 0.0) << " tiles per draw, binning " 
+    << bin_ms_sum_ / frames_ << " ms, rasterizing " << raster_ms_sum_ / frames_ << " ms" << std::endl;
+}
+
+// Draws the published render states on its own thread, so that drawing a 
+// frame overlaps with simulating the next one. The states are triple 
+// buffered: the simulation fills the back state, the render thread draws the
+// front one and the ready one in between is always the latest published.
+class Renderer
+{
+public:
+  // With a rasterizer, the frames are drawn on the CPU and only copied to the
+  // window. Otherwise GDI+ draws them.
+  Renderer(HWND window, std::size_t max_items, std::size_t max_particles, std::size_t max_cell_rects, 
+    std::unique_ptr<SoftwareRasterizer> rasterizer = nullptr);
+  ~Renderer();
+
+  // Cleared state to be filled by the simulation.
+  RenderState& beginFrame();
+
+  // Hands the filled state over to the render thread.
+  void publish();
+
+  // Draws the latest state again, e.g. after the window has been uncovered.
+  void requestRedraw();
+
+  void stop();
+
+  // Time the render thread has spent drawing since the last call.
+  std::chrono::steady_clock::duration takeDrawTime();
+
+  // Must not be called before the render thread has been stopped.
+  void writeReport(Logger& log) const;
+  std::uint64_t spriteDraws(Gdiplus::Bitmap const* bitmap) const;
+
+private:
+  void run();
+  void draw(RenderState const& state, Gdiplus::Graphics& graphics);
+  void rasterize(RenderState const& state, HDC hdc, RECT const& rect);
+
+  Gdiplus::Pen* pen(Gdiplus::ARGB color);
+
+  HWND window_ = NULL;
+
+  std::array<RenderState, 3> states_;
+  int back_ = 0;
+  int ready_ = 1;
+  int front_ = 2;
+  bool fresh_ = false;
+  bool redraw_ = false;
+  bool stopped_ = false;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+
+  // Used by the render thread only.
+  std::unordered_map<Gdiplus::ARGB, std::unique_ptr<Gdiplus::Pen>> pens_;
+  std::array<std::unique_ptr<Gdiplus::SolidBrush>, int(ParticleColor::Count)> particle_brushes_;
+  std::unique_ptr<Gdiplus::SolidBrush> water_brush_;
+  std::unique_ptr<Gdiplus::SolidBrush> fog_brush_;
+  std::unique_ptr<SoftwareRasterizer> rasterizer_;
+
+  // Statistics, the published count is written by the simulation, the rest 
+  // by the render thread.
+  std::uint64_t published_ = 0;
+  std::uint64_t presented_ = 0;
+  double draw_ms_sum_ = 0.0;
+  double draw_ms_max_ = 0.0;
+  std::uint64_t inputs_ = 0;
+  double latency_ms_sum_ = 0.0;
+  double latency_ms_max_ = 0.0;
+  std::unordered_map<Gdiplus::Bitmap const*, std::uint64_t> sprite_draws_;
+
+  // Taken by the simulation for the load governor.
+  std::atomic<std::chrono::steady_clock::rep> draw_time_{ 0 };
+
+  std::thread thread_;
+};
+
+Renderer::Renderer(HWND window, std::size_t max_items, std::size_t max_particles, std::size_t max_cell_rects, 
+  std::unique_ptr<SoftwareRasterizer> rasterizer) : 
+  window_(window), rasterizer_(std::move(rasterizer))
+{
+  for (auto& state : states_)
+    state.reserve(max_items, max_particles, max_cell_rects);
+
+  thread_ = std::thread([this]() { run(); });
+}
+
+Renderer::~Renderer()
+{
+  stop();
+}
+
+RenderState& Renderer::beginFrame()
+{
+  // Only the simulation swaps the back state, so no lock is needed.
+  auto& state = states_[back_];
+  state.clear();
+  return state;
+}
+
+void Renderer::publish()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The ready state is replaced without having been drawn. Keep its input,
+    // so that the latency is measured up to the presentation of this state.
+    const auto& ready = states_[ready_];
+    auto& back = states_[back_];
+    const auto none = std::chrono::steady_clock::time_point{};
+    if (fresh_ && ready.input_time != none && (back.input_time == none || ready.input_time < back.input_time))
+      back.input_time = ready.input_time;
+
+    std::swap(back_, ready_);
+    fresh_ = true;
+  }
+
+  wake_.notify_one();
+  ++published_;
+}
+
+void Renderer::requestRedraw()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    redraw_ = true;
+  }
+
+  wake_.notify_one();
+}
+
+void Renderer::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+
+  wake_.notify_one();
+  if (thread_.joinable()) thread_.join();
+}
+
+void Renderer::run()
+{
+  // Buffered painting and GDI+ objects belong to this thread.
+  BufferedPaintInit();
+  for (int c = 0; c < int(ParticleColor::Count); ++c)
+    particle_brushes_[c] = std::make_unique<Gdiplus::SolidBrush>(particle_color(ParticleColor(c)));
+  water_brush_ = std::make_unique<Gdiplus::SolidBrush>(Gdiplus::Color(160, 40, 110, 230));
+  fog_brush_ = std::make_unique<Gdiplus::SolidBrush>(Gdiplus::Color(190, 10, 10, 20));
+
+  while (true)
+  {
+    bool fresh = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this]() { return fresh_ || redraw_ || stopped_; });
+      if (stopped_) break;
+
+      if (fresh_)
+      {
+        std::swap(front_, ready_);
+        fresh_ = false;
+        fresh = true;
+      }
+      redraw_ = false;
+    }
+
+    const auto& state = states_[front_];
+    const auto start = std::chrono::steady_clock::now();
+
+    // The window is gone, once it has been closed.
+    HDC hdc = GetDC(window_);
+    if (!hdc) continue;
+
+    RECT rect;
+    GetClientRect(window_, &rect);
+    HDC buff_hdc;
+    if (rasterizer_)
+    {
+      // A single blit of a complete frame does not flicker, no buffering needed.
+      rasterize(state, hdc, rect);
+    }
+    else if (auto h_buff = BeginBufferedPaint(hdc, &rect, BPBF_COMPATIBLEBITMAP, NULL, &buff_hdc))
+    {
+      // Fill background.
+      FillRect(buff_hdc, &rect, (HBRUSH) (COLOR_WINDOW+1));
+
+      {
+        // The sprites are premultiplied already and drawn unscaled, so the 
+        // blits need neither a conversion nor filtering.
+        Gdiplus::Graphics graphics(buff_hdc);
+        graphics.SetCompositingMode(Gdiplus::CompositingModeSourceOver);
+        graphics.SetInterpolationMode(Gdiplus::InterpolationModeNearestNeighbor);
+        draw(state, graphics);
+      }
+
+      EndBufferedPaint(h_buff, TRUE);
+    }
+    ReleaseDC(window_, hdc);
+
+    const auto presented = std::chrono::steady_clock::now();
+    draw_time_ += (presented - start).count();
+    const auto draw_ms = std::chrono::duration<double, std::milli>(presented - start).count();
+    draw_ms_sum_ += draw_ms;
+    draw_ms_max_ = std::max(draw_ms_max_, draw_ms);
+    ++presented_;
+
+    if (fresh && state.input_time != std::chrono::steady_clock::time_point{})
+    {
+      const auto latency_ms = std::chrono::duration<double, std::milli>(presented - state.input_time).count();
+      latency_ms_sum_ += latency_ms;
+      latency_ms_max_ = std::max(latency_ms_max_, latency_ms);
+      ++inputs_;
+    }
+  }
+
+  pens_.clear();
+  for (auto& brush : particle_brushes_)
+    brush.reset();
+  water_brush_.reset();
+  fog_brush_.reset();
+  BufferedPaintUnInit();
+}
+
+void Renderer::draw(RenderState const& state, Gdiplus::Graphics& graphics)
+{
+  for (const auto& item : state.items)
+  {
+    if (item.bitmap)
+    {
+      // With an explicit size, the resolution stored in the image does not 
+      // cause a scaled draw.
+      const int w = item.bitmap->GetWidth();
+      const int h = item.bitmap->GetHeight();
+      graphics.DrawImage(item.bitmap.get(), item.x - w / 2, item.y - h / 2, w, h);
+      ++sprite_draws_[item.bitmap.get()];
+    }
+    else
+    {
+      Gdiplus::Rect rect(item.x - item.width / 2, item.y - item.height / 2, item.width, item.height);
+      graphics.DrawRectangle(pen(item.color), rect);
+    }
+  }
+
+  if (!state.water_rects.empty())
+    graphics.FillRectangles(water_brush_.get(), state.water_rects.data(), INT(state.water_rects.size()));
+
+  // Particles on top, one call per color.
+  const auto& offsets = state.particle_offsets;
+  for (int c = 0; c < int(ParticleColor::Count); ++c)
+  {
+    const auto n = offsets[c + 1] - offsets[c];
+    if (n > 0)
+      graphics.FillRectangles(particle_brushes_[c].get(), state.particle_rects.data() + offsets[c], INT(n));
+  }
+
+  // Fog last, it hides everything out of sight.
+  if (!state.fog_rects.empty())
+    graphics.FillRectangles(fog_brush_.get(), state.fog_rects.data(), INT(state.fog_rects.size()));
+}
+
+void Renderer::rasterize(RenderState const& state, HDC hdc, RECT const& rect)
+{
+  for (const auto& item : state.items)
+    if (item.bitmap) ++sprite_draws_[item.bitmap.get()];
+
+  const auto window = GetSysColor(COLOR_WINDOW);
+  rasterizer_->resize(rect.right - rect.left, rect.bottom - rect.top);
+  rasterizer_->draw(state, Gdiplus::Color::MakeARGB(255, GetRValue(window), GetGValue(window), GetBValue(window)));
+
+  // Negative height for rows from top to bottom.
+  BITMAPINFO info = {};
+  info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+  info.bmiHeader.biWidth = rasterizer_->width();
+  info.bmiHeader.biHeight = -rasterizer_->height();
+  info.bmiHeader.biPlanes = 1;
+  info.bmiHeader.biBitCount = 32;
+  info.bmiHeader.biCompression = BI_RGB;
+  SetDIBitsToDevice(hdc, 0, 0, rasterizer_->width(), rasterizer_->height(), 0, 0, 0, rasterizer_->height(), 
+    rasterizer_->pixels(), &info, DIB_RGB_COLORS);
+}
+
+Gdiplus::Pen* Renderer::pen(Gdiplus::ARGB color)
+{
+  auto& pen = pens_[color];
+  if (!pen) pen = std::make_unique<Gdiplus::Pen>(Gdiplus::Color(color));
+  return pen.get();
+}
+
+std::chrono::steady_clock::duration Renderer::takeDrawTime()
+{
+  return std::chrono::steady_clock::duration(draw_time_.exchange(0));
+}
+
+std::uint64_t Renderer::spriteDraws(Gdiplus::Bitmap const* bitmap) const
+{
+  const auto it = sprite_draws_.find(bitmap);
+  return it != sprite_draws_.end() ? it->second : 0;
+}
+
+void Renderer::writeReport(Logger& log) const
+{
+  log << "Render: " << published_ << " states published, " << presented_ << " frames presented";
+  if (presented_ > 0)
+    log << ", draw mean " << draw_ms_sum_ / presented_ << " ms, max " << draw_ms_max_ << " ms";
+  log << std::endl;
+
+  if (inputs_ > 0)
+  {
+    log << "Input to present latency: mean " << latency_ms_sum_ / inputs_ << " ms, max " 
+      << latency_ms_max_ << " ms over " << inputs_ << " inputs" << std::endl;
+  }
+
+  if (rasterizer_) rasterizer_->writeReport(log);
+}
+
+// Plain data describing a non tile object in a snapshot.
+struct EntitySnapshot
+{
+  std::uint32_t id;
+  EntityKind kind;
+  float x, y;
+  float vx, vy;
+};
+
+struct SnapshotHeader
+{
+  std::uint64_t tick;
+  std::uint32_t tile_count;
+  std::uint32_t entity_count;
+};
+
+// Layout of a decoded snapshot: the header, the tile types (padded to 4 
+// bytes) and the entities. Tiles come first, so that their offset does not 
+// change with the number of entities and consecutive snapshots line up.
+class SnapshotView
+{
+public:
+  explicit SnapshotView(std::vector<std::uint8_t> const& raw) : raw_(raw) {}
+
+  SnapshotHeader header() const
+  {
+    SnapshotHeader header;
+    std::memcpy(&header, raw_.data(), sizeof(header));
+    return header;
+  }
+
+  TileType tile(std::size_t idx) const { return TileType(raw_[sizeof(SnapshotHeader) + idx]); }
+
+  EntitySnapshot entity(std::size_t idx) const
+  {
+    EntitySnapshot entity;
+    std::memcpy(&entity, raw_.data() + entitiesOffset(header().tile_count) + idx * sizeof(EntitySnapshot), sizeof(entity));
+    return entity;
+  }
+
+  static std::size_t entitiesOffset(std::size_t tile_count)
+  {
+    return sizeof(SnapshotHeader) + ((tile_count + 3) & ~std::size_t(3));
+  }
+
+  static std::size_t size(std::size_t tile_count, std::size_t entity_count)
+  {
+    return entitiesOffset(tile_count) + entity_count * sizeof(EntitySnapshot);
+  }
+
+private:
+  std::vector<std::uint8_t> const& raw_;
+};
+
+// Preallocated ring buffer of world snapshots, one per tick. Every snapshot
+// is stored as the 32-bit XOR against the previous one, with runs of zero 
+// words collapsed, so unchanged state costs next to nothing. Every 
+// keyframe_interval-th snapshot is encoded against zero instead, which bounds 
+// the work of decoding. When the buffer is full, the oldest keyframe group 
+// is dropped, so that the memory stays bounded.
+class SnapshotBuffer
+{
+public:
+  SnapshotBuffer(std::size_t capacity_bytes, std::size_t max_snapshots, int keyframe_interval);
+
+  void capture(std::uint64_t tick, std::vector<std::unique_ptr<Object>> const& objects, TileGrid const& grid);
+
+  // Decodes the snapshot of the tick into raw (see SnapshotView).
+  bool decode(std::uint64_t tick, std::vector<std::uint8_t>& raw) const;
+
+  bool empty() const { return count_ == 0; }
+  std::uint64_t oldestTick() const { return entries_[first_].tick; }
+  std::uint64_t newestTick() const { return entries_[(first_ + count_ - 1) % entries_.size()].tick; }
+  std::size_t snapshotCount() const { return count_; }
+  std::size_t bytesUsed() const { return bytes_used_; }
+  std::size_t capacityBytes() const { return storage_.size(); }
+
+  // Capture cost measurements.
+  float meanCaptureUs() const { return captures_ ? float(capture_time_us_ / captures_) : 0.f; }
+  float maxCaptureUs() const { return max_capture_us_; }
+
+private:
+  struct Entry
+  {
+    std::uint64_t tick = 0;
+    std::size_t offset = 0;
+    std::size_t size = 0;
+    std::size_t raw_size = 0;
+    bool keyframe = false;
+  };
+
+  // Writes the XOR of both buffers (zero extended to size) as run-length 
+  // encoded words into encoded_. Returns the encoded size.
+  std::size_t encode(std::uint8_t const* current, std::uint8_t const* previous, std::size_t size);
+  static void applyDelta(std::uint8_t const* encoded, std::size_t encoded_size, std::vector<std::uint8_t>& raw);
+
+  Entry& entry(std::size_t idx) { return entries_[(first_ + idx) % entries_.size()]; }
+  Entry const& entry(std::size_t idx) const { return entries_[(first_ + idx) % entries_.size()]; }
+
+  void popOldest();
+
+  // Finds room for size bytes, dropping the oldest snapshots as necessary.
+  std::size_t reserve(std::size_t size);
+
+  std::vector<std::uint8_t> storage_;
+  std::size_t write_pos_ = 0;
+  std::size_t bytes_used_ = 0;
+
+  std::vector<Entry> entries_;
+  std::size_t first_ = 0;
+  std::size_t count_ = 0;
+
+  int keyframe_interval_ = 1;
+  int since_keyframe_ = 0;
+
+  // Scratch buffers, reused every capture.
+  std::vector<std::uint8_t> current_;
+  std::vector<std::uint8_t> previous_;
+  std::vector<std::uint8_t> encoded_;
+  std::vector<std::uint32_t> delta_;
+
+  std::uint64_t captures_ = 0;
+  double capture_time_us_ = 0.0;
+  float max_capture_us_ = 0.f;
+};
+
+SnapshotBuffer::SnapshotBuffer(std::size_t capacity_bytes, std::size_t max_snapshots, int keyframe_interval) :
+  storage_(capacity_bytes), entries_(max_snapshots), keyframe_interval_(std::max(1, keyframe_interval)) 
+{
+  // Room for thousands of entities without reallocating during the game.
+  constexpr std::size_t scratch_bytes = 256 * 1024;
+  current_.reserve(scratch_bytes);
+  previous_.reserve(scratch_bytes);
+  encoded_.reserve(2 * scratch_bytes);
+  delta_.reserve(scratch_bytes / 4);
+}
+
+void SnapshotBuffer::capture(std::uint64_t tick, std::vector<std::unique_ptr<Object>> const& objects, TileGrid const& grid)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  // Serialize. Tiles are kept by the grid, their objects are not stored.
+  const std::size_t tile_count = std::size_t(grid.width()) * grid.height();
+  std::size_t entity_count = 0;
+  for (const auto& obj : objects)
+    if (obj->kind != EntityKind::Tile && !obj->remove) ++entity_count;
+
+  const auto raw_size = SnapshotView::size(tile_count, entity_count);
+  const auto previous_size = current_.size();
+  std::swap(current_, previous_);
+  current_.resize(raw_size);
+
+  SnapshotHeader header{ tick, std::uint32_t(tile_count), std::uint32_t(entity_count) };
+  std::memcpy(current_.data(), &header, sizeof(header));
+
+  auto tiles = current_.data() + sizeof(SnapshotHeader);
+  for (int y = 0; y < grid.height(); ++y)
+    for (int x = 0; x < grid.width(); ++x)
+      *tiles++ = std::uint8_t(grid.at(x, y));
+  std::fill(tiles, current_.data() + SnapshotView::entitiesOffset(tile_count), std::uint8_t(0));
+
+  auto entities = current_.data() + SnapshotView::entitiesOffset(tile_count);
+  for (const auto& obj : objects)
+  {
+    if (obj->kind == EntityKind::Tile || obj->remove) continue;
+
+    const EntitySnapshot entity{ obj->id, obj->kind, obj->x, obj->y, obj->vx, obj->vy };
+    std::memcpy(entities, &entity, sizeof(entity));
+    entities += sizeof(entity);
+  }
+
+  // Encode against the previous snapshot or, for keyframes, against zero.
+  bool keyframe = count_ == 0 || since_keyframe_ + 1 >= keyframe_interval_;
+  const auto size = std::max(raw_size, previous_size);
+  previous_.resize(size, 0);
+  current_.resize(size, 0);
+  auto encoded_size = encode(current_.data(), keyframe ? nullptr : previous_.data(), size);
+  auto offset = reserve(encoded_size);
+  if (!keyframe && count_ == 0)
+  {
+    // Making room dropped the snapshot this delta refers to.
+    keyframe = true;
+    encoded_size = encode(current_.data(), nullptr, size);
+    offset = reserve(encoded_size);
+  }
+  current_.resize(raw_size);
+
+  since_keyframe_ = keyframe ? 0 : since_keyframe_ + 1;
+
+  std::memcpy(storage_.data() + offset, encoded_.data(), encoded_size);
+  write_pos_ = offset + encoded_size;
+  bytes_used_ += encoded_size;
+
+  auto& added = entries_[(first_ + count_) % entries_.size()];
+  added = Entry{ tick, offset, encoded_size, raw_size, keyframe };
+  ++count_;
+
+  const auto elapsed_us = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+  ++captures_;
+  capture_time_us_ += elapsed_us;
+  max_capture_us_ = std::max(max_capture_us_, elapsed_us);
+}
+
+std::size_t SnapshotBuffer::encode(std::uint8_t const* current, std::uint8_t const* previous, std::size_t size)
+{
+  // XOR all words first (a loop the compiler vectorizes), then collapse it 
+  // into a sequence of (zero words, literal words, literal XOR words...).
+  const auto words = size / 4;
+  delta_.resize(words);
+  std::memcpy(delta_.data(), current, words * 4);
+  if (previous)
+  {
+    auto prev = reinterpret_cast<std::uint32_t const*>(previous);
+    for (std::size_t w = 0; w < words; ++w)
+      delta_[w] ^= prev[w];
+  }
+
+  encoded_.resize(size + 8 * (words / 2 + 1));
+  auto out = reinterpret_cast<std::uint32_t*>(encoded_.data());
+  const auto begin = out;
+
+  std::size_t w = 0;
+  while (w < words)
+  {
+    const auto zero_begin = w;
+    while (w < words && delta_[w] == 0) ++w;
+    if (w == words) break;
+
+    const auto literal_begin = w;
+    while (w < words && delta_[w] != 0) ++w;
+
+    *out++ = std::uint32_t(literal_begin - zero_begin);
+    *out++ = std::uint32_t(w - literal_begin);
+    std::memcpy(out, delta_.data() + literal_begin, (w - literal_begin) * 4);
+    out += w - literal_begin;
+  }
+
+  return (out - begin) * 4;
+}
+
+void SnapshotBuffer::applyDelta(std::uint8_t const* encoded, std::size_t encoded_size, std::vector<std::uint8_t>& raw)
+{
+  std::size_t pos = 0;
+  std::size_t word = 0;
+  const auto read = [&]() { std::uint32_t value; std::memcpy(&value, encoded + pos, 4); pos += 4; return value; };
+  while (pos < encoded_size)
+  {
+    word += read();
+    const auto literal_count = read();
+    for (std::uint32_t k = 0; k < literal_count; ++k, ++word)
+    {
+      std::uint32_t value;
+      std::memcpy(&value, raw.data() + 4 * word, 4);
+      value ^= read();
+      std::memcpy(raw.data() + 4 * word, &value, 4);
+    }
+  }
+}
+
+bool SnapshotBuffer::decode(std::uint64_t tick, std::vector<std::uint8_t>& raw) const
+{
+  if (count_ == 0 || tick < oldestTick() || tick > newestTick()) return false;
+
+  // Snapshots are taken every tick, but search to be safe.
+  std::size_t target = 0;
+  while (target < count_ && entry(target).tick != tick) ++target;
+  if (target == count_) return false;
+
+  std::size_t key = target;
+  while (!entry(key).keyframe) --key;
+
+  for (auto idx = key; idx <= target; ++idx)
+  {
+    const auto& e = entry(idx);
+    if (e.keyframe)
+      raw.assign(e.raw_size, 0);
+    else
+      raw.resize(std::max(raw.size(), e.raw_size), 0);
+
+    applyDelta(storage_.data() + e.offset, e.size, raw);
+    raw.resize(e.raw_size);
+  }
+
+  return true;
+}
+
+void SnapshotBuffer::popOldest()
+{
+  bytes_used_ -= entries_[first_].size;
+  first_ = (first_ + 1) % entries_.size();
+  --count_;
+
+  // Deltas without their keyframe are useless.
+  while (count_ > 0 && !entries_[first_].keyframe)
+  {
+    bytes_used_ -= entries_[first_].size;
+    first_ = (first_ + 1) % entries_.size();
+    --count_;
+  }
+}
+
+std::size_t SnapshotBuffer::reserve(std::size_t size)
+{
+  if (size > storage_.size())
+    throw std::runtime_error("Snapshot does not fit into the snapshot buffer.");
+
+  if (count_ == entries_.size()) popOldest();
+  if (count_ == 0) write_pos_ = 0;
+
+  const auto overlaps = [](Entry const& e, std::size_t begin, std::size_t end)
+  {
+    return e.offset < end && begin < e.offset + e.size;
+  };
+
+  auto offset = write_pos_;
+  if (offset + size > storage_.size())
+  {
+    // Wrap around. Snapshots in the unused tail are the oldest ones.
+    while (count_ > 0 && entries_[first_].offset >= offset) popOldest();
+    offset = 0;
+  }
+
+  while (count_ > 0 && overlaps(entries_[first_], offset, offset + size)) popOldest();
+
+  return offset;
+}
+
+// Simulation state of a single game instance: the objects, the tiles and 
+// everything stepped with them, but no window, rendering or asset loading. 
+// The game drives one world, the headless runner many of them.
+class World
+{
+public:
+  // The water is simulated on the pool, if given. The seed drives the 
+  // randomness of the world.
+  World(Configuration const& config, ThreadPool* pool, std::uint32_t seed = 0x2545f491);
+
+  std::vector<std::unique_ptr<Object>>& objects() { return objects_; }
+  TileGrid const& grid() const { return *tile_grid_; }
+  TileLayer const& tileLayer() const { return *tile_layer_; }
+  // Built on first use, nothing is spent on it before something navigates.
+  // Rebuilds the clusters invalidated since the last call first. Moving water 
+  // changes cells in most ticks, so they are not rebuilt in every update.
+  HierarchicalPathfinder const& paths();
+
+  // Used by the bullets created afterwards.
+  BulletTemplate& bulletTemplate() { return bullet_; }
+
+  // Buffer of the calling thread. Buffer 0 belongs to the thread stepping the
+  // world, the others to the tasks running in parallel to it on the pool (one
+  // per thread of the pool).
+  CommandBuffer& commands() { return command_buffers_[pool_ ? pool_->workerIndex() + 1 : 0]; }
+
+  // The player is drawn with the animation, if set.
+  Object& spawnPlayer(Configuration const& config, std::unique_ptr<AnimationGraphics> animation);
+
+  void handleInput(KeyState state, int vkey);
+
+  // Limits the bullets spawned per tick (0 for no limit), the others are 
+  // dropped. Restored bullets are not limited.
+  void setSpawnLimit(std::size_t limit) { spawn_limit_ = limit; }
+  void setAnimationInterval(int interval) { animation_interval_ = interval; }
+  void setParticlesEnabled(bool enabled) { particles_->setEnabled(enabled); }
+
+  // Applies the recorded commands, moves the objects, resolves their 
+  // collisions and updates the line of sight. The objects to be removed are
+  // kept until removeObjects().
+  void update();
+  void removeObjects();
+
+  void tick()
+  {
+    update();
+    removeObjects();
+  }
+
+  void publish(RenderState& state);
+
+  void restore(SnapshotView const& view);
+
+  // Hash of the positions and velocities of the objects, e.g. to compare 
+  // runs, which should be deterministic.
+  std::uint64_t checksum() const;
+
+  std::uint64_t ticks() const { return ticks_; }
+  void writeReport(Logger& log) const;
+
+private:
+  // Tests the pairs with at least one awake dynamic body, resolves their 
+  // contacts, then puts the resting ones to sleep.
+  void handleCollisions();
+  bool areObjectsColliding(Object& obj_1, Object& obj_2);
+
+  // Tests the opaque pixels within the overlap of the boxes, at least one of
+  // the objects has to have a collision mask.
+  static bool arePixelsOverlapping(Object const& obj_1, Object const& obj_2, CollisionBox const& box_1, 
+    CollisionBox const& box_2);
+
+  // Recomputes the line of sight, if the player has entered another cell.
+  void updateVisibility();
+
+  // Applies the commands of all buffers in a single pass: changes of 
+  // existing objects first, then the spawns.
+  void applyCommands();
+
+  ThreadPool* pool_ = nullptr;
+  std::vector<CommandBuffer> command_buffers_;
+
+  std::vector<std::unique_ptr<Object>> objects_;
+  MotionSystem motions_;
+  std::unique_ptr<ParticleSystem> particles_;
+
+  // Objects have been replaced without changing their count.
+  bool objects_changed_ = false;
+
+  std::unique_ptr<TileGrid> tile_grid_;
+  std::unique_ptr<TileLayer> tile_layer_;
+
+  // Navigation of the agents over the tile grid.
+  std::unique_ptr<HierarchicalPathfinder> paths_;
+  int path_cluster_size_ = 0;
+
+  std::unique_ptr<WaterSimulation> water_;
+
+  // Line of sight of the player, for the fog and the agents.
+  std::unique_ptr<VisibilityField> visibility_;
+
+  ContactBuffer contacts_;
+  std::unique_ptr<ContactSolver> contact_solver_;
+
+  // Shared by the player and the snapshot restore.
+  BulletTemplate bullet_;
+
+  std::size_t spawn_limit_ = 0;
+  std::uint64_t dropped_spawns_ = 0;
+  int animation_interval_ = 1;
+
+  float world_width_ = 0.f;
+  float world_height_ = 0.f;
+
+  // Ticks, which a body has to rest, before it goes to sleep. The velocity 
+  // limit is above the gravity added within a tick, but below walking.
+  static constexpr int sleep_ticks = 30;
+  static constexpr float sleep_velocity = 0.2f;
+
+  std::uint64_t ticks_ = 0;
+
+  // Pairs tested, compared to testing all pairs of colliders.
+  std::uint64_t pair_tests_ = 0;
+  std::uint64_t all_pairs_ = 0;
+
+  // Overlapping boxes, which were tested pixel by pixel and found apart.
+  std::uint64_t mask_tests_ = 0;
+  std::uint64_t mask_misses_ = 0;
+};
+
+World::World(Configuration const& config, ThreadPool* pool, std::uint32_t seed) : 
+  pool_(pool), world_width_(float(config.game.window_width)), world_height_(float(config.game.window_height))
+{
+  // Allocate upfront what the ticks would otherwise allocate on demand.
+  objects_.reserve(1024);
+  motions_.reserve(1024);
+  contacts_.reserve(1024);
+  command_buffers_.resize(1 + (pool ? pool->size() : 0));
+  for (auto& buffer : command_buffers_)
+    buffer.reserve(256);
+
+  particles_ = std::make_unique<ParticleSystem>(
+    config.particles.capacity, config.particles.gravity, world_width_, world_height_, seed);
+
+  contact_solver_ = std::make_unique<ContactSolver>(
+    config.contacts.velocity_iterations, config.contacts.position_iterations);
+  contact_solver_->reserve(1024);
+
+  // Add tiles, merged into as few objects as possible.
+  tile_grid_ = std::make_unique<TileGrid>(config.tile_config);
+  tile_layer_ = std::make_unique<TileLayer>(*tile_grid_, objects_);
+  tile_layer_->build();
+  water_ = std::make_unique<WaterSimulation>(*tile_grid_);
+  visibility_ = std::make_unique<VisibilityField>(*tile_grid_, config.visibility.radius);
+  path_cluster_size_ = config.paths.cluster_size;
+
+  bullet_.size = config.bullet.size;
+  bullet_.grid = tile_grid_.get();
+  bullet_.particles = particles_.get();
+}
+
+Object& World::spawnPlayer(Configuration const& config, std::unique_ptr<AnimationGraphics> animation)
+{
+  auto player = std::make_unique<Object>(
+    config.game.window_width / 2.f, config.game.window_height / 2.f, 0.f, 0.f, config.player.size);
+  player->kind = EntityKind::Player;
+  //player->motion = LinearMotion();
+  player->motion = GravitationalMotion(config.player.g);
+  player->setCollisionHandler(std::make_unique<PlayerCollisionHandler>(*player));
+  auto input = std::make_unique<PlayerInput>(config, commands());
+  //player->graphics_handler_ = std::make_unique<BitmapGraphics>(config.player.bitmap);
+  player->input_handler_ = std::move(input);
+  player->graphics_handler_ = std::move(animation);
+
+  // Keep the player first, so that it is drawn on top.
+  auto& obj = *player;
+  objects_.insert(objects_.begin(), std::move(player));
+  return obj;
+}
+
+HierarchicalPathfinder const& World::paths()
+{
+  if (!paths_)
+    paths_ = std::make_unique<HierarchicalPathfinder>(*tile_grid_, path_cluster_size_);
+
+  paths_->update();
+  return *paths_;
+}
+
+void World::handleInput(KeyState state, int vkey)
+{
+  // Input handlers record their changes of the objects as commands, which 
+  // are applied at the start of the next update.
+  for (auto& obj : objects_)
+    obj->handleInput(state, vkey);
+}
+
+void World::update()
+{
+  ++ticks_;
+
+  AllocationTracker::setPhase(FramePhase::Dynamics);
+  applyCommands();
+
+  if (objects_changed_ || objects_.size() != motions_.objectCount())
+  {
+    motions_.rebuild(objects_);
+    objects_changed_ = false;
+  }
+  motions_.update();
+  particles_->update();
+  water_->step(pool_);
+
+  // Water costs more to cross than a clear cell.
+  if (paths_)
+  {
+    for (const auto& cell : water_->changedCells())
+      paths_->invalidate(cell.x, cell.y);
+  }
+
+  for (auto& o : objects_)
+  {
+    if (o->x < 0.f || o->x > world_width_ || o->y < 0.f || o->y > world_height_)
+      o->remove = true;
+
+    // The frames and their masks follow the simulation, not the rendering.
+    o->updateGraphics(ticks_, animation_interval_);
+  }
+
+  // Collision detection.
+  AllocationTracker::setPhase(FramePhase::Collision);
+  handleCollisions();
+  updateVisibility();
+}
+
+void World::applyCommands()
+{
+  // The commands targeting objects are sorted by the id of the target, so 
+  // that a single pass over the objects finds them. Ties keep the order of 
+  // recording, buffer by buffer, so the result does not depend on the timing
+  // of the threads.
+  struct Targeted
+  {
+    std::uint32_t id = 0;
+    std::uint32_t order = 0;
+    Command const* command = nullptr;
+  };
+
+  ScratchVector<Targeted> targeted;
+  std::size_t spawn_count = 0;
+  std::size_t command_count = 0;
+  for (const auto& buffer : command_buffers_)
+    command_count += buffer.commands().size();
+  if (command_count == 0) return;
+
+  targeted.reserve(command_count);
+  for (const auto& buffer : command_buffers_)
+  {
+    for (const auto& command : buffer.commands())
+    {
+      if (command.type == Command::Type::SpawnBullet)
+        ++spawn_count;
+      else
+        targeted.push_back(Targeted{ command.id, std::uint32_t(targeted.size()), &command });
+    }
+  }
+
+  if (!targeted.empty())
+  {
+    std::sort(targeted.begin(), targeted.end(), [](Targeted const& a, Targeted const& b)
+      { return a.id != b.id ? a.id < b.id : a.order < b.order; });
+
+    bool despawned = false;
+    for (auto& obj : objects_)
+    {
+      auto it = std::lower_bound(targeted.begin(), targeted.end(), obj->id, 
+        [](Targeted const& entry, std::uint32_t id) { return entry.id < id; });
+      for (; it != targeted.end() && it->id == obj->id; ++it)
+      {
+        const auto& command = *it->command;
+        switch (command.type)
+        {
+        case Command::Type::Despawn:
+          obj->remove = true;
+          despawned = true;
+          break;
+        case Command::Type::SetMotion:
+          obj->x = command.x;
+          obj->y = command.y;
+          obj->vx = command.vx;
+          obj->vy = command.vy;
+          obj->wake();
+          break;
+        case Command::Type::SetVelocity:
+          if (command.components & Command::velocity_x) obj->vx = command.vx;
+          if (command.components & Command::velocity_y) obj->vy = command.vy;
+          obj->wake();
+          break;
+        case Command::Type::StopVelocity:
+          if ((command.components & Command::velocity_x) && obj->vx * command.vx > 0.f) obj->vx = 0.f;
+          if ((command.components & Command::velocity_y) && obj->vy * command.vy > 0.f) obj->vy = 0.f;
+          obj->wake();
+          break;
+        case Command::Type::Face:
+          obj->faceLeft(command.left);
+          break;
+        default:
+          break;
+        }
+      }
+    }
+
+    if (despawned) removeObjects();
+  }
+
+  if (spawn_count > 0)
+  {
+    // A burst takes its pool blocks and object slots at once.
+    Pooled<Object>::reserve(spawn_count);
+    if (bullet_.bitmap.valid()) Pooled<BitmapGraphics>::reserve(spawn_count);
+    objects_.reserve(objects_.size() + spawn_count);
+
+    std::size_t spawned = 0;
+    for (const auto& buffer : command_buffers_)
+    {
+      for (const auto& command : buffer.commands())
+      {
+        if (command.type != Command::Type::SpawnBullet) continue;
+
+        if (command.id == 0 && spawn_limit_ > 0 && spawned++ >= spawn_limit_)
+        {
+          ++dropped_spawns_;
+          continue;
+        }
+
+        auto bullet = makeBullet(command.x, command.y, command.vx, bullet_);
+        if (command.id != 0) bullet->id = command.id;
+        objects_.emplace_back(std::move(bullet));
+      }
+    }
+  }
+
+  for (auto& buffer : command_buffers_)
+    buffer.clear();
+}
+
+void World::removeObjects()
+{
+  const auto removed = std::remove_if(objects_.begin(), objects_.end(),
+    [](auto const& o) { return o->remove; });
+  objects_changed_ = objects_changed_ || removed != objects_.end();
+  objects_.erase(removed, objects_.end());
+}
+
+void World::publish(RenderState& state)
+{
+  for (auto it = objects_.rbegin(); it != objects_.rend(); ++it)
+    (*it)->handleGraphics(state);
+  water_->publish(state);
+  particles_->publish(state);
+  visibility_->publish(state);
+}
+
+void World::restore(SnapshotView const& view)
+{
+  const auto header = view.header();
+
+  // Tiles, re-merged only where they differ.
+  const auto grid_width = tile_grid_->width();
+  for (std::uint32_t idx = 0; idx < header.tile_count; ++idx)
+  {
+    const auto type = view.tile(idx);
+    const int x = idx % grid_width;
+    const int y = idx / grid_width;
+    if (tile_grid_->at(x, y) != type)
+    {
+      tile_layer_->setTile(x, y, type);
+      if (paths_) paths_->invalidate(x, y);
+      water_->resetCell(x, y);
+      visibility_->invalidate(x, y);
+    }
+  }
+
+  // Objects are matched by id. Those missing in the snapshot are removed, 
+  // bullets removed since then are created again.
+  std::unordered_map<std::uint32_t, EntitySnapshot> entities;
+  for (std::uint32_t idx = 0; idx < header.entity_count; ++idx)
+  {
+    const auto entity = view.entity(idx);
+    entities.emplace(entity.id, entity);
+  }
+
+  // Applied at the start of the next update.
+  auto& commands = this->commands();
+  for (auto& obj : objects_)
+  {
+    if (obj->kind == EntityKind::Tile) continue;
+
+    auto it = entities.find(obj->id);
+    if (it == entities.end())
+    {
+      // The player is kept, even if it has not existed yet at the time.
+      if (obj->kind != EntityKind::Player) commands.despawn(*obj);
+      continue;
+    }
+
+    commands.setMotion(*obj, it->second.x, it->second.y, it->second.vx, it->second.vy);
+    entities.erase(it);
+  }
+
+  for (const auto& [id, entity] : entities)
+  {
+    if (entity.kind != EntityKind::Bullet) continue;
+
+    commands.spawnBullet(entity.x, entity.y, entity.vx, entity.id);
+  }
+
+  objects_changed_ = true;
+
+  // The ground may have changed under resting bodies.
+  for (auto& obj : objects_)
+    obj->wake();
+  contact_solver_->reset();
+}
+
+void World::handleCollisions()
+{
+  contacts_.clear();
+
+  ScratchVector<Object*> awake;
+  ScratchVector<Object*> others;
+  awake.reserve(objects_.size());
+  others.reserve(objects_.size());
+  for (auto& obj : objects_)
+  {
+    if (!obj->collision_handler_) continue;
+
+    if (obj->body == BodyType::Dynamic && !obj->sleeping)
+      awake.push_back(obj.get());
+    else
+      others.push_back(obj.get());
+  }
+
+  const auto colliders = awake.size() + others.size();
+  all_pairs_ += colliders * (colliders - (colliders > 0)) / 2;
+
+  // Static and kinematic bodies do not collide with each other. Sleeping 
+  // bodies are only tested against awake ones, which wake them up.
+  for (std::size_t i = 0; i < awake.size(); ++i)
+  {
+    auto obj_1 = awake[i];
+    for (std::size_t j = 0; j < i; ++j)
+    {
+      if (areObjectsColliding(*obj_1, *awake[j]))
+        obj_1->handleCollision(*awake[j], contacts_);
+    }
+
+    for (auto obj_2 : others)
+    {
+      if (areObjectsColliding(*obj_1, *obj_2))
+      {
+        obj_2->wake();
+        obj_1->handleCollision(*obj_2, contacts_);
+      }
+    }
+
+    pair_tests_ += i + others.size();
+  }
+
+  contact_solver_->solve(contacts_);
+
+  // A body on the ground is supported only every other tick: it sinks by the
+  // gravity of a tick and is pushed back in the next one.
+  for (auto obj : awake)
+  {
+    const bool resting = (obj->supported || obj->rest_ticks > 0) && 
+      std::abs(obj->vx) < sleep_velocity && std::abs(obj->vy) < sleep_velocity;
+    obj->rest_ticks = resting ? obj->rest_ticks + 1 : 0;
+    obj->sleeping = obj->rest_ticks >= sleep_ticks;
+    obj->supported = false;
+  }
+}
+
+void World::updateVisibility()
+{
+  // The player is kept first.
+  if (objects_.empty() || objects_.front()->kind != EntityKind::Player) return;
+
+  const auto& player = *objects_.front();
+  visibility_->update(tile_grid_->cellX(player.x), tile_grid_->cellY(player.y));
+}
+
+bool World::areObjectsColliding(Object& obj_1, Object& obj_2)
+{
+  const auto box_1 = obj_1.collisionBox();
+  const auto box_2 = obj_2.collisionBox();
+  const float dpos_x = box_1.x - box_2.x;
+  const float dpos_y = box_1.y - box_2.y;
+
+  const bool overlap_x = abs(dpos_x) < box_1.half_width + box_2.half_width;
+  const bool overlap_y = abs(dpos_y) < box_1.half_height + box_2.half_height;
+  if (overlap_x && overlap_y)
+  {
+    // Due to finite time steps in game engine the collision might have already 
+    // been handled in the previous step and the objects are moving apart from 
+    // each other, even though they are still close enough. Therefore it is 
+    // crucial to also check the relative velocity with respect to the distance 
+    // between them.
+    const auto dv_x = obj_1.vx - obj_2.vx;
+    const auto dv_y = obj_1.vy - obj_2.vy;
+    if (dpos_x * dv_x + dpos_y * dv_y >= 0.f) return false;
+
+    // The boxes only bound the sprites, which are mostly transparent.
+    if (!obj_1.collision_mask && !obj_2.collision_mask) return true;
+
+    ++mask_tests_;
+    const bool hit = arePixelsOverlapping(obj_1, obj_2, box_1, box_2);
+    mask_misses_ += !hit;
+    return hit;
+  }
+
+  return false;
+}
+
+bool World::arePixelsOverlapping(Object const& obj_1, Object const& obj_2, CollisionBox const& box_1, 
+  CollisionBox const& box_2)
+{
+  // Pixels of the first mask, the other one is placed relative to it. 
+  const auto& masked = obj_1.collision_mask ? obj_1 : obj_2;
+  const auto& other = obj_1.collision_mask ? obj_2 : obj_1;
+  const auto& mask = *masked.collision_mask;
+  const auto origin_x = masked.x - 0.5f * mask.width();
+  const auto origin_y = masked.y - 0.5f * mask.height();
+
+  // Overlap of the boxes, enlarged to whole pixels.
+  const auto left = std::max(box_1.x - box_1.half_width, box_2.x - box_2.half_width) - origin_x;
+  const auto top = std::max(box_1.y - box_1.half_height, box_2.y - box_2.half_height) - origin_y;
+  const auto right = std::min(box_1.x + box_1.half_width, box_2.x + box_2.half_width) - origin_x;
+  const auto bottom = std::min(box_1.y + box_1.half_height, box_2.y + box_2.half_height) - origin_y;
+  const auto x0 = std::max(int(std::floor(left)), 0);
+  const auto y0 = std::max(int(std::floor(top)), 0);
+  const auto x1 = std::min(int(std::ceil(right)), mask.width());
+  const auto y1 = std::min(int(std::ceil(bottom)), mask.height());
+
+  // Without a mask, the other object is solid within the overlap.
+  const auto other_mask = other.collision_mask;
+  const auto dx = other_mask ? int(std::lround(other.x - 0.5f * other_mask->width() - origin_x)) : 0;
+  const auto dy = other_mask ? int(std::lround(other.y - 0.5f * other_mask->height() - origin_y)) : 0;
+
+  for (int y = y0; y < y1; ++y)
+  {
+    for (int x = x0; x < x1; x += 64)
+    {
+      auto bits = mask.bits(x, y);
+      if (x1 - x < 64) bits &= (std::uint64_t(1) << (x1 - x)) - 1;
+      if (other_mask) bits &= other_mask->bits(x - dx, y - dy);
+      if (bits) return true;
+    }
+  }
+
+  return false;
+}
+
+std::uint64_t World::checksum() const
+{
+  // FNV-1a over the raw state of the non tile objects.
+  std::uint64_t hash = 14695981039346656037ull;
+  const auto add = [&hash](void const* data, std::size_t size)
+  {
+    for (std::size_t i = 0; i < size; ++i)
+      hash = (hash ^ static_cast<std::uint8_t const*>(data)[i]) * 1099511628211ull;
+  };
+
+  for (const auto& obj : objects_)
+  {
+    if (obj->kind == EntityKind::Tile) continue;
+
+    const float state[] = { obj->x, obj->y, obj->vx, obj->vy };
+    add(state, sizeof(state));
+  }
+
+  return hash;
+}
+
+void World::writeReport(Logger& log) const
+{
+  if (ticks_ > 0)
+  {
+    log << "Collisions: " << pair_tests_ / ticks_ << " pair tests per tick (" 
+      << all_pairs_ / ticks_ << " pairs of all colliders)" << std::endl;
+  }
+  if (mask_tests_ > 0)
+    log << "  pixel masks: " << mask_tests_ << " overlapping boxes tested, " << mask_misses_ << " apart" << std::endl;
+  contact_solver_->writeReport(log);
+  water_->writeReport(log);
+  visibility_->writeReport(log);
+
+  log << "Particles: peak " << particles_->peak() << " of " << particles_->capacity() 
+    << ", dropped " << particles_->dropped() << std::endl;
+
+  if (dropped_spawns_ > 0)
+    log << "Spawns: " << dropped_spawns_ << " bullets dropped over the limit" << std::endl;
+}
+
+// Measures the snapshot capture with many entities moving every tick.
+void benchmark_snapshots(Configuration const& config)
+{
+  constexpr int entity_count = 10000;
+  constexpr int ticks = 600;
+
+  std::vector<std::unique_ptr<Object>> objects;
+  for (int i = 0; i < entity_count; ++i)
+  {
+    auto obj = std::make_unique<Object>(float(i % 1000), float(i / 1000), 1.f, 0.5f, config.bullet.size);
+    obj->kind = EntityKind::Bullet;
+    objects.emplace_back(std::move(obj));
+  }
+
+  TileGrid grid(config.tile_config);
+  SnapshotBuffer snapshots(64 << 20, ticks, 32);
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    for (auto& obj : objects)
+    {
+      obj->x += obj->vx;
+      obj->y += obj->vy;
+    }
+
+    snapshots.capture(tick, objects, grid);
+  }
+
+  std::vector<std::uint8_t> raw;
+  const auto decode_start = std::chrono::steady_clock::now();
+  snapshots.decode(snapshots.newestTick(), raw);
+  const auto decode_us = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - decode_start).count();
+
+  logger << "Snapshot benchmark: " << entity_count << " entities, " << ticks << " ticks" << std::endl;
+  logger << "  capture: mean " << snapshots.meanCaptureUs() << " us, max " << snapshots.maxCaptureUs() << " us" << std::endl;
+  logger << "  held " << snapshots.snapshotCount() << " snapshots in " << snapshots.bytesUsed() << " bytes (raw " 
+    << SnapshotView::size(std::size_t(grid.width()) * grid.height(), entity_count) << " bytes each)" << std::endl;
+  logger << "  decode of the newest snapshot: " << decode_us << " us" << std::endl;
+}
+
+// Measures the motion update of many objects, once through the dynamics 
+// handlers and once through the archetypes of the motion system.
+void benchmark_dispatch(Configuration const& config)
+{
+  constexpr int object_count = 100000;
+  constexpr int ticks = 200;
+
+  // Same objects for both paths, with the motion types shuffled in the same 
+  // way as objects of different kinds are in the object list.
+  std::vector<std::unique_ptr<Object>> handled_objects;
+  std::vector<std::unique_ptr<Object>> static_objects;
+  std::uint32_t random = 12345;
+  for (int i = 0; i < object_count; ++i)
+  {
+    random = random * 1664525u + 1013904223u;
+    const bool linear = (random >> 31) != 0;
+    const auto x = float(i % 1000);
+    const auto y = float(i / 1000);
+
+    auto handled = std::make_unique<Object>(x, y, 1.f, 0.f, config.bullet.size);
+    auto closed = std::make_unique<Object>(x, y, 1.f, 0.f, config.bullet.size);
+    if (linear)
+    {
+      handled->dynamics_handler_ = std::make_unique<LinearMotion>();
+      closed->motion = LinearMotion();
+    }
+    else
+    {
+      handled->dynamics_handler_ = std::make_unique<GravitationalMotion>(config.player.g);
+      closed->motion = GravitationalMotion(config.player.g);
+    }
+
+    handled_objects.emplace_back(std::move(handled));
+    static_objects.emplace_back(std::move(closed));
+  }
+
+  using Clock = std::chrono::steady_clock;
+
+  auto start = Clock::now();
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    for (auto& obj : handled_objects)
+      obj->handleDynamics();
+  }
+  const auto virtual_time = Clock::now() - start;
+
+  MotionSystem motions;
+  motions.reserve(object_count);
+  Clock::duration rebuild_time{};
+  Clock::duration update_time{};
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    start = Clock::now();
+    motions.rebuild(static_objects);
+    const auto rebuilt = Clock::now();
+    motions.update();
+    rebuild_time += rebuilt - start;
+    update_time += Clock::now() - rebuilt;
+  }
+
+  bool same = true;
+  for (int i = 0; i < object_count; ++i)
+    same = same && handled_objects[i]->x == static_objects[i]->x && handled_objects[i]->y == static_objects[i]->y;
+
+  const auto per_update = [](Clock::duration time)
+  {
+    return std::chrono::duration<float, std::nano>(time).count() / (float(object_count) * ticks);
+  };
+
+  logger << "Dispatch benchmark: " << object_count << " objects, " << ticks << " ticks" << std::endl;
+  logger << "  virtual: " << per_update(virtual_time) << " ns per object" << std::endl;
+  logger << "  static: " << per_update(update_time) << " ns per object" << std::endl;
+  logger << "  regrouping (only after objects changed): " << per_update(rebuild_time) << " ns per object" << std::endl;
+  if (!same)
+    logger << "  results of both paths differ!" << std::endl;
+}
+
+// Measures the particle update with the buffer kept close to its capacity by
+// bursts emitted all over the world every tick.
+void benchmark_particles(Configuration const& config)
+{
+  constexpr int ticks = 600;
+  constexpr int bursts_per_tick = 128;
+  constexpr int burst_size = 20;
+  constexpr int lifetime = 80;
+
+  const auto width = float(config.game.window_width);
+  const auto height = float(config.game.window_height);
+  ParticleSystem particles(config.particles.capacity, 0.01f, width, height);
+
+  std::uint32_t random = 12345;
+  const auto next_random = [&random]()
+  {
+    random = random * 1664525u + 1013904223u;
+    return (random >> 8) * (1.f / 16777216.f);
+  };
+
+  using Clock = std::chrono::steady_clock;
+  Clock::duration update_time{};
+  double live_sum = 0.0;
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    for (int i = 0; i < bursts_per_tick; ++i)
+      particles.emit(next_random() * width, next_random() * height, burst_size, 
+        6.2831853f * next_random(), 1.f, 0.5f, lifetime, ParticleColor(i % 4));
+
+    live_sum += particles.size();
+
+    const auto start = Clock::now();
+    particles.update();
+    update_time += Clock::now() - start;
+  }
+
+  const auto mean_live = live_sum / ticks;
+  const auto update_ms = std::chrono::duration<double, std::milli>(update_time).count() / ticks;
+  logger << "Particle benchmark: " << ticks << " ticks, mean " << std::size_t(mean_live) << " live particles (peak " 
+    << particles.peak() << ", dropped " << particles.dropped() << ")" << std::endl;
+  logger << "  update: " << update_ms << " ms per tick, " << update_ms * 1e6 / mean_live << " ns per particle" << std::endl;
+}
+
+void benchmark_paths(Configuration const& config)
+{
+  constexpr int grid_size = 512;
+  constexpr int walls = 4000;
+  constexpr int ponds = 1000;
+  constexpr std::size_t query_count = 4096;
+  constexpr std::size_t compared_queries = 256;
+  constexpr int changed_cells = 64;
+
+  std::uint32_t random = 12345;
+  const auto next_random = [&random](int range)
+  {
+    random = random * 1664525u + 1013904223u;
+    return int((random >> 8) % std::uint32_t(range));
+  };
+
+  // Level of random wall segments and ponds.
+  TileConfiguration level;
+  level.grid_width = grid_size;
+  level.grid_height = grid_size;
+  level.tile_size = config.tile_config.tile_size;
+  for (int i = 0; i < walls; ++i)
+  {
+    const auto x = next_random(grid_size);
+    const auto y = next_random(grid_size);
+    const auto length = 4 + next_random(16);
+    const bool horizontal = next_random(2) == 0;
+    for (int k = 0; k < length; ++k)
+      level.tiles.push_back(Tile{ Point{ horizontal ? x + k : x, horizontal ? y : y + k }, TileType::Wall });
+  }
+  for (int i = 0; i < ponds; ++i)
+  {
+    const auto x = next_random(grid_size);
+    const auto y = next_random(grid_size);
+    const auto width = 2 + next_random(6);
+    const auto height = 2 + next_random(6);
+    for (int j = 0; j < height; ++j)
+      for (int k = 0; k < width; ++k)
+        level.tiles.push_back(Tile{ Point{ x + k, y + j }, TileType::Water });
+  }
+  TileGrid grid(level);
+
+  std::vector<HierarchicalPathfinder::Query> queries;
+  const auto random_cell = [&]()
+  {
+    while (true)
+    {
+      const Point cell{ next_random(grid_size), next_random(grid_size) };
+      if (path_cost(grid.at(cell.x, cell.y)) < std::numeric_limits<float>::infinity()) return cell;
+    }
+  };
+  for (std::size_t i = 0; i < query_count; ++i)
+    queries.push_back(HierarchicalPathfinder::Query{ random_cell(), random_cell() });
+
+  using Clock = std::chrono::steady_clock;
+  const auto seconds = [](Clock::duration duration) { return std::chrono::duration<double>(duration).count(); };
+
+  // Plain A* over the whole grid as the reference.
+  GridSearch astar(grid);
+  const GridRect whole{ 0, 0, grid_size, grid_size };
+  std::vector<float> astar_costs(compared_queries);
+  Path path;
+  auto start = Clock::now();
+  for (std::size_t i = 0; i < compared_queries; ++i)
+  {
+    path.clear();
+    astar_costs[i] = astar.findPath(queries[i].start, queries[i].goal, whole, &path);
+  }
+  const auto astar_qps = compared_queries / seconds(Clock::now() - start);
+
+  start = Clock::now();
+  HierarchicalPathfinder pathfinder(grid, config.paths.cluster_size);
+  const auto build_ms = seconds(Clock::now() - start) * 1e3;
+
+  // Same queries on a single thread, to compare the paths.
+  HierarchicalPathfinder::Workspace workspace(grid);
+  double cost_ratio_sum = 0.0;
+  int both_found = 0;
+  int mismatched = 0;
+  start = Clock::now();
+  for (std::size_t i = 0; i < compared_queries; ++i)
+  {
+    path.clear();
+    const auto cost = pathfinder.findPath(queries[i].start, queries[i].goal, path, workspace);
+    const bool found = cost < std::numeric_limits<float>::infinity();
+    const bool astar_found = astar_costs[i] < std::numeric_limits<float>::infinity();
+    if (found != astar_found) ++mismatched;
+    if (found && astar_found && astar_costs[i] > 0.f)
+    {
+      cost_ratio_sum += cost / astar_costs[i];
+      ++both_found;
+    }
+  }
+  const auto single_qps = compared_queries / seconds(Clock::now() - start);
+
+  ThreadPool pool;
+  std::vector<Path> paths;
+  start = Clock::now();
+  pathfinder.findPaths(queries, paths, pool);
+  const auto batch_qps = query_count / seconds(Clock::now() - start);
+
+  // Rebuild after changing a few cells.
+  const auto rebuilt = pathfinder.rebuiltClusters();
+  for (int i = 0; i < changed_cells; ++i)
+  {
+    const auto x = next_random(grid_size);
+    const auto y = next_random(grid_size);
+    grid.set(x, y, grid.at(x, y) == TileType::Clear ? TileType::Wall : TileType::Clear);
+    pathfinder.invalidate(x, y);
+  }
+  start = Clock::now();
+  pathfinder.update();
+  const auto update_ms = seconds(Clock::now() - start) * 1e3;
+
+  logger << "Path benchmark: " << grid_size << "x" << grid_size << " cells, " << pathfinder.clusterCount() 
+    << " clusters of " << config.paths.cluster_size << " cells, " << pathfinder.nodeCount() 
+    << " abstract nodes, built in " << build_ms << " ms" << std::endl;
+  logger << "  A*: " << astar_qps << " queries/s, search state " << astar.bytes() << " bytes" << std::endl;
+  logger << "  HPA*: " << single_qps << " queries/s on one thread, " << batch_qps << " queries/s batched on " 
+    << pool.size() << " threads, graph " << pathfinder.bytes() << " bytes + " << workspace.bytes() 
+    << " bytes per thread" << std::endl;
+  logger << "  HPA* paths " << (both_found > 0 ? 100.0 * (cost_ratio_sum / both_found - 1.0) : 0.0) 
+    << " % longer than A* over " << both_found << " queries, " << mismatched << " differ in reachability" << std::endl;
+  logger << "  update after " << changed_cells << " changed cells: " << update_ms << " ms, " 
+    << pathfinder.rebuiltClusters() - rebuilt << " clusters rebuilt" << std::endl;
+}
+
+void benchmark_water(Configuration const& config)
+{
+  constexpr int grid_size = 1024;
+  constexpr int blobs = 16;
+  constexpr int blob_size = 8;
+  constexpr int steps = 300;
+
+  // Lake at rest filling the lower half, with blobs of water falling into it.
+  TileConfiguration level;
+  level.grid_width = grid_size;
+  level.grid_height = grid_size;
+  level.tile_size = config.tile_config.tile_size;
+  for (int y = grid_size / 2; y < grid_size; ++y)
+    for (int x = 0; x < grid_size; ++x)
+      level.tiles.push_back(Tile{ Point{ x, y }, TileType::Water });
+
+  std::uint32_t random = 12345;
+  const auto next_random = [&random](int range)
+  {
+    random = random * 1664525u + 1013904223u;
+    return int((random >> 8) % std::uint32_t(range));
+  };
+  for (int i = 0; i < blobs; ++i)
+  {
+    const auto x = next_random(grid_size - blob_size);
+    const auto y = next_random(grid_size / 4);
+    for (int j = 0; j < blob_size; ++j)
+      for (int k = 0; k < blob_size; ++k)
+        level.tiles.push_back(Tile{ Point{ x + k, y + j }, TileType::Water });
+  }
+
+  ThreadPool pool;
+  const auto run = [&](bool everything)
+  {
+    TileGrid grid(level);
+    WaterSimulation water(grid);
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration time{};
+    for (int step = 0; step < steps; ++step)
+    {
+      if (everything) water.activateAll();
+
+      const auto start = Clock::now();
+      water.step(&pool);
+      time += Clock::now() - start;
+    }
+
+    water.writeReport(logger);
+    return std::chrono::duration<double, std::milli>(time).count() / steps;
+  };
+
+  logger << "Water benchmark: " << grid_size << "x" << grid_size << " cells, half flooded, " << blobs 
+    << " falling blobs, " << steps << " steps on " << pool.size() << " threads" << std::endl;
+  const auto dirty_ms = run(false);
+  const auto full_ms = run(true);
+  logger << "  dirty chunks only: " << dirty_ms << " ms per step, all chunks: " << full_ms << " ms per step" << std::endl;
+}
+
+// Scripted input of a headless world: keys pressed and released at random 
+// intervals, drawn from the seed of the world.
+class BotInput
+{
+public:
+  explicit BotInput(std::uint32_t seed) : random_(seed) {}
+
+  void apply(World& world);
+
+private:
+  int nextRandom(int range);
+
+  std::uint32_t random_ = 0;
+  int wait_ticks_ = 0;
+  int held_key_ = 0;
+};
+
+int BotInput::nextRandom(int range)
+{
+  random_ = random_ * 1664525u + 1013904223u;
+  return int((random_ >> 8) % std::uint32_t(range));
+}
+
+void BotInput::apply(World& world)
+{
+  if (wait_ticks_-- > 0) return;
+
+  static constexpr int keys[] = { VK_LEFT, VK_RIGHT, VK_UP, VK_SPACE };
+  if (held_key_) world.handleInput(KeyState::Up, held_key_);
+  held_key_ = keys[nextRandom(int(std::size(keys)))];
+  world.handleInput(KeyState::Down, held_key_);
+  wait_ticks_ = 4 + nextRandom(28);
+}
+
+// Steps many headless worlds, each with its own seed and input. The worlds 
+// are split into one batch per thread, whose worlds are stepped in lockstep.
+// A world is created, stepped and destroyed by the same task, since the 
+// object pools and the frame arena are per thread.
+void benchmark_worlds(Configuration const& config)
+{
+  const auto world_count = std::size_t(config.benchmark.worlds);
+  const auto ticks = config.benchmark.max_frames > 0 ? config.benchmark.max_frames : 600;
+
+  // A headless world needs a fraction of the particles drawn by the game.
+  auto world_config = config;
+  world_config.particles.capacity = 4096;
+
+  struct BatchResult
+  {
+    std::uint64_t checksum = 0;
+    double setup_ms = 0.0;
+    double step_ms = 0.0;
+  };
+
+  using Clock = std::chrono::steady_clock;
+  ThreadPool pool;
+  const auto batch_count = std::min(world_count, pool.size());
+  std::vector<std::future<BatchResult>> batches;
+  for (std::size_t batch = 0; batch < batch_count; ++batch)
+  {
+    batches.push_back(pool.submit([&world_config, world_count, batch_count, ticks, batch]()
+      {
+        BatchResult result;
+        auto start = Clock::now();
+
+        std::vector<std::unique_ptr<World>> worlds;
+        std::vector<BotInput> inputs;
+        for (auto i = batch; i < world_count; i += batch_count)
+        {
+          const auto seed = std::uint32_t(i) * 2654435761u + 1;
+          worlds.push_back(std::make_unique<World>(world_config, nullptr, seed));
+          worlds.back()->spawnPlayer(world_config, nullptr);
+          inputs.emplace_back(seed);
+        }
+
+        auto end = Clock::now();
+        result.setup_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        start = end;
+        for (int tick = 0; tick < ticks; ++tick)
+        {
+          for (std::size_t i = 0; i < worlds.size(); ++i)
+          {
+            inputs[i].apply(*worlds[i]);
+            worlds[i]->tick();
+            frame_arena().reset();
+          }
+        }
+
+        end = Clock::now();
+        result.step_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        // Independent of the order of the worlds, so of the thread count.
+        for (const auto& world : worlds)
+          result.checksum += world->checksum();
+        return result;
+      }));
+  }
+
+  std::uint64_t checksum = 0;
+  double setup_ms = 0.0;
+  double step_ms = 0.0;
+  for (auto& batch : batches)
+  {
+    const auto result = batch.get();
+    checksum += result.checksum;
+    setup_ms = std::max(setup_ms, result.setup_ms);
+    step_ms = std::max(step_ms, result.step_ms);
+  }
+
+  const auto world_ticks = double(world_count) * ticks;
+  logger << "Worlds benchmark: " << world_count << " headless worlds, " << ticks << " ticks on " 
+    << batch_count << " threads" << std::endl;
+  logger << "  setup " << setup_ms << " ms, stepping " << step_ms << " ms, " 
+    << (step_ms > 0.0 ? world_ticks / step_ms * 1000.0 : 0.0) << " world-ticks/s, checksum " 
+    << std::hex << checksum << std::dec << std::endl;
+}
+
+// Loads all assets of the game twice from the single files and twice from 
+// the pack. The first load of each is cold as far as this process goes: the 
+// files have not been opened or mapped yet, but they may still be in the 
+// file cache of the OS, which would have to be flushed for a true cold start.
+void benchmark_assets(Configuration const& config)
+{
+  std::vector<const WCHAR*> files{ config.bullet.bitmap };
+  for (const auto& anim : config.player.anim_config.single_animation_configs)
+    files.insert(files.end(), anim.frame_files.begin(), anim.frame_files.end());
+
+  ThreadPool pool;
+  const auto load = [&](bool packed)
+  {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::shared_ptr<ResourcePack> pack;
+    if (packed) pack = std::make_shared<ResourcePack>(config.assets.pack);
+
+    // The same requests as the game: the frames are also needed mirrored.
+    AssetLoader loader(pool, pack);
+    for (const auto file : files)
+      loader.loadBitmap(file);
+    for (std::size_t i = 1; i < files.size(); ++i)
+      loader.loadBitmap(files[i], Flip::Horizontal);
+    loader.waitAll();
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  logger << "Assets benchmark: " << files.size() << " images on " << pool.size() << " threads" << std::endl;
+  const auto files_cold = load(false);
+  const auto files_warm = load(false);
+  logger << "  files: cold " << files_cold << " ms, warm " << files_warm << " ms" << std::endl;
+
+  if (!std::filesystem::exists(config.assets.pack))
+  {
+    logger << "  no resource pack, build it with --build-pack=<directory>" << std::endl;
+    return;
+  }
+
+  const auto pack_cold = load(true);
+  const auto pack_warm = load(true);
+  logger << "  pack: cold " << pack_cold << " ms, warm " << pack_warm << " ms" << std::endl;
+}
+
+// Rasterizes a crowded frame with a single tile on the calling thread, which
+// is the reference, and with the configured tiles on one and on all threads.
+// The frames have to match the reference exactly.
+void benchmark_raster(Configuration const& config)
+{
+  const int frames = config.benchmark.max_frames > 0 ? config.benchmark.max_frames : 120;
+  constexpr int sprite_count = 3000;
+  constexpr int outline_count = 1000;
+  constexpr int particle_count = 4096;
+
+  std::uint32_t random = 0x2545f491;
+  const auto next_random = [&random](int range)
+  {
+    random = random * 1664525u + 1013904223u;
+    return int((random >> 8) % std::uint32_t(range));
+  };
+
+  // Translucent discs, so that most sprite pixels need a blend.
+  std::vector<std::vector<std::uint32_t>> sprite_pixels;
+  std::vector<std::shared_ptr<Gdiplus::Bitmap>> sprites;
+  for (const auto size : { 16, 32, 48 })
+  {
+    auto& pixels = sprite_pixels.emplace_back(std::size_t(size) * size);
+    for (int y = 0; y < size; ++y)
+    {
+      for (int x = 0; x < size; ++x)
+      {
+        const auto dx = x - size / 2 + 0.5f;
+        const auto dy = y - size / 2 + 0.5f;
+        const auto falloff = std::max(0.f, 1.f - std::sqrt(dx * dx + dy * dy) / (size / 2));
+        pixels[y * size + x] = premultiply(Gdiplus::Color::MakeARGB(
+          BYTE(255 * falloff), BYTE(40 + x * 4), BYTE(200 - y * 3), 90));
+      }
+    }
+    sprites.push_back(std::make_shared<Gdiplus::Bitmap>(
+      size, size, size * 4, PixelFormat32bppPARGB, reinterpret_cast<BYTE*>(pixels.data())));
+  }
 
-  auto bullet = std::make_unique<Object>(obj.x, obj.y, dir * v_bullet_, 0.f, bullet_size_);
+  ThreadPool pool;
+  logger << "Raster benchmark: " << sprite_count << " sprites, " << outline_count << " outlines, " 
+    << particle_count << " particles, " << frames << " frames, tiles of " << config.render.tile_size 
+    << " pixels" << std::endl;
 
-  bullet->dynamics_handler_ = std::make_unique<LinearMotion>();
-  bullet->graphics_handler_ = std::make_unique<BitmapGraphics>(bullet_bitmap_);
+  for (const auto [width, height] : { std::pair{ config.game.window_width, config.game.window_height }, std::pair{ 2560, 1440 } })
+  {
+    RenderState state;
+    state.reserve(sprite_count + outline_count, particle_count, 0);
+    for (int i = 0; i < sprite_count; ++i)
+      state.addSprite(sprites[next_random(int(sprites.size()))], float(next_random(width)), float(next_random(height)));
+    for (int i = 0; i < outline_count; ++i)
+    {
+      state.addOutline(Gdiplus::Color::MakeARGB(255, 255, 0, 0), float(next_random(width)), float(next_random(height)), 
+        8 + next_random(64), 8 + next_random(64));
+    }
 
-  objects_.emplace_back(std::move(bullet));
-}
+    for (int c = 0; c < int(ParticleColor::Count); ++c)
+    {
+      state.particle_offsets[c] = state.particle_rects.size();
+      for (int i = 0; i < particle_count / int(ParticleColor::Count); ++i)
+        state.particle_rects.emplace_back(next_random(width * 4) / 4.f, next_random(height * 4) / 4.f, 2.5f, 2.5f);
+    }
+    state.particle_offsets.back() = state.particle_rects.size();
 
-void addTiles(TileConfiguration const& config, std::vector<std::unique_ptr<Object>>& objects)
-{
-  const auto tile_size = config.tile_size;
-  const auto offset = 0.5f * config.tile_size;
-  for (auto pt : config.tiles)
-  {
-    // Create a tile object.
-    const auto x = pt.x * tile_size + offset;
-    const auto y = pt.y * tile_size + offset;
-    auto tile = std::make_unique<Object>(x, y, 0.f, 0.f, Size{ tile_size, tile_size });
-    tile->collision_handler_ = std::make_unique<TileCollisionHandler>(*tile);
-    tile->graphics_handler_ = std::make_unique<RectGraphics>(tile_size, tile_size);
+    // A band of fog and a pool of water, both in rows of cells.
+    for (int y = height / 2; y + 16 <= height; y += 16)
+      state.fog_rects.emplace_back(0.f, float(y), float(width / 3), 16.f);
+    for (int y = height - 160; y + 16 <= height; y += 16)
+      state.water_rects.emplace_back(float(width / 4), float(y), float(width / 2), 16.f);
 
-    // Add a tile to object collection.
-    objects.emplace_back(std::move(tile));
+    const auto run = [&](SoftwareRasterizer& rasterizer)
+    {
+      rasterizer.resize(width, height);
+      rasterizer.draw(state, 0xffffffff);
+
+      const auto start = std::chrono::steady_clock::now();
+      for (int frame = 0; frame < frames; ++frame)
+        rasterizer.draw(state, 0xffffffff);
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+    };
+
+    ThreadPool single_thread(1);
+    SoftwareRasterizer reference(nullptr, std::max(width, height));
+    SoftwareRasterizer tiled_single(&single_thread, config.render.tile_size);
+    SoftwareRasterizer tiled(&pool, config.render.tile_size);
+    const auto reference_ms = run(reference);
+    const auto tiled_single_ms = run(tiled_single);
+    const auto tiled_ms = run(tiled);
+
+    const auto bytes = std::size_t(width) * height * sizeof(std::uint32_t);
+    const bool same = std::memcmp(reference.pixels(), tiled_single.pixels(), bytes) == 0 &&
+      std::memcmp(reference.pixels(), tiled.pixels(), bytes) == 0;
+
+    logger << "  " << width << "x" << height << ": single tile " << reference_ms << " ms, tiles on 1 thread " 
+      << tiled_single_ms << " ms, tiles on " << pool.size() << " threads " << tiled_ms << " ms (" 
+      << reference_ms / tiled_ms << "x)" << (same ? "" : ", frames differ!") << std::endl;
   }
 }
 
-class Window
+// Paces the game loop to deadlines computed from absolute time points, so 
+// that errors of individual frames do not accumulate. Waiting is a coarse 
+// sleep until shortly before the deadline followed by a spin-wait, with the 
+// spin margin adapted to the observed oversleeping of the OS.
+class FramePacer
 {
 public:
-  Window(Configuration const& config, std::vector<std::unique_ptr<Object>>& obj_collection);
+  using Clock = std::chrono::steady_clock;
 
-  ~Window();
+  explicit FramePacer(Clock::duration frame_time);
+  ~FramePacer();
 
-  void render();
-private:
-  static LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
-  LRESULT CALLBACK WindowProcImpl(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+  // Blocks until the deadline of the current frame.
+  void wait();
 
-  HWND hWnd_ = NULL;
-  std::vector<std::unique_ptr<Object>>& obj_collection_;
+  struct Statistics
+  {
+    std::uint64_t frames = 0;
+    std::uint64_t missed_deadlines = 0;
+
+    // Wake up error over the recent frames in milliseconds.
+    float mean_error_ms = 0.f;
+    float p50_error_ms = 0.f;
+    float p99_error_ms = 0.f;
+    float max_error_ms = 0.f;
+  };
+
+  Statistics statistics() const;
+
+  void writeReport(Logger& log) const;
+
+private:
+  float percentile(float p) const;
+
+  Clock::duration frame_time_;
+  Clock::time_point next_deadline_;
+  Clock::duration spin_margin_ = std::chrono::milliseconds(2);
+
+  std::uint64_t frames_ = 0;
+  std::uint64_t missed_deadlines_ = 0;
+
+  // Rolling histogram of the wake up error over the last window_size frames.
+  static constexpr int window_size = 1024;
+  static constexpr int bucket_count = 200;
+  static constexpr float bucket_width_ms = 0.05f;
+  std::array<std::uint16_t, window_size> window_{};
+  std::array<int, bucket_count + 1> histogram_{};
+  int window_pos_ = 0;
+  int window_fill_ = 0;
+
+  double window_error_sum_ms_ = 0.0;
+  std::array<float, window_size> window_errors_{};
+  float max_error_ms_ = 0.f;
 };
 
-Window::Window(Configuration const& config, std::vector<std::unique_ptr<Object>>& obj_collection) : obj_collection_(obj_collection)
+FramePacer::FramePacer(Clock::duration frame_time) : frame_time_(frame_time)
 {
-  BufferedPaintInit();
+  // Request 1 ms timer resolution for the coarse sleep.
+  timeBeginPeriod(1);
 
-  const wchar_t CLASS_NAME[] = L"Game Window Class";
-  WNDCLASS window_class = {};
-  window_class.lpfnWndProc = WindowProc;
-  window_class.hInstance = config.game.instance;
-  window_class.lpszClassName = CLASS_NAME;
+  next_deadline_ = Clock::now() + frame_time_;
+}
 
-  RegisterClass(&window_class);
+FramePacer::~FramePacer()
+{
+  timeEndPeriod(1);
+}
 
-  HWND hWindow = CreateWindowEx(0, CLASS_NAME, L"Game", WS_OVERLAPPEDWINDOW, 
-    CW_USEDEFAULT, CW_USEDEFAULT, config.game.window_width, config.game.window_height,
-    NULL, NULL, config.game.instance, NULL);
+void FramePacer::wait()
+{
+  const auto deadline = next_deadline_;
+  auto now = Clock::now();
+  ++frames_;
 
-  if (hWindow == NULL)
+  if (now >= deadline)
   {
-    throw std::runtime_error("Creating window failed.");
+    // Late already. Skip the deadlines, which have passed, instead of 
+    // rushing through several frames to catch up.
+    ++missed_deadlines_;
+    const auto periods = (now - deadline) / frame_time_ + 1;
+    next_deadline_ = deadline + periods * frame_time_;
   }
+  else
+  {
+    if (deadline - now > spin_margin_)
+    {
+      const auto sleep_until = deadline - spin_margin_;
+      std::this_thread::sleep_until(sleep_until);
+
+      // Adapt the margin to the oversleeping: twice its running average.
+      const auto oversleep = std::max(Clock::now() - sleep_until, Clock::duration::zero());
+      const auto target = std::clamp<Clock::duration>(2 * oversleep, 
+        std::chrono::microseconds(200), std::chrono::milliseconds(4));
+      spin_margin_ = (7 * spin_margin_ + target) / 8;
+    }
 
-  // Set a value at the specified offset (user data) in the extra window memory.
-  // Used to enable wrapping the member function into a static method.
-  SetWindowLongPtr(hWindow, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+    while ((now = Clock::now()) < deadline)
+      YieldProcessor();
 
-  ShowWindow(hWindow, config.game.cmd_show);
+    next_deadline_ = deadline + frame_time_;
+  }
 
-  hWnd_ = hWindow;
+  // Record the error of this frame.
+  const auto error_ms = std::chrono::duration<float, std::milli>(now - deadline).count();
+  const auto bucket = std::uint16_t(std::min(int(error_ms / bucket_width_ms), bucket_count));
+
+  if (window_fill_ == window_size)
+  {
+    --histogram_[window_[window_pos_]];
+    window_error_sum_ms_ -= window_errors_[window_pos_];
+  }
+  else
+  {
+    ++window_fill_;
+  }
+
+  window_[window_pos_] = bucket;
+  window_errors_[window_pos_] = error_ms;
+  ++histogram_[bucket];
+  window_error_sum_ms_ += error_ms;
+  window_pos_ = (window_pos_ + 1) % window_size;
+
+  max_error_ms_ = std::max(max_error_ms_, error_ms);
 }
 
-Window::~Window()
+float FramePacer::percentile(float p) const
 {
-  BufferedPaintUnInit();
+  if (window_fill_ == 0) return 0.f;
+
+  const auto rank = int(std::ceil(p * window_fill_));
+  int seen = 0;
+  for (int i = 0; i <= bucket_count; ++i)
+  {
+    seen += histogram_[i];
+    if (seen >= rank) return (i + 1) * bucket_width_ms;
+  }
+
+  return (bucket_count + 1) * bucket_width_ms;
 }
 
-void Window::render()
+FramePacer::Statistics FramePacer::statistics() const
 {
-  InvalidateRect(hWnd_, NULL, TRUE);
-  UpdateWindow(hWnd_);
+  Statistics stats;
+  stats.frames = frames_;
+  stats.missed_deadlines = missed_deadlines_;
+  stats.mean_error_ms = window_fill_ > 0 ? float(window_error_sum_ms_ / window_fill_) : 0.f;
+  stats.p50_error_ms = percentile(0.5f);
+  stats.p99_error_ms = percentile(0.99f);
+  stats.max_error_ms = max_error_ms_;
+  return stats;
 }
 
-// This function is invoked internally by calling DispatchMessage(). Note that
-// it is executed in the same thread.
-LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+void FramePacer::writeReport(Logger& log) const
 {
-  // Standard pattern for wrapping the member function, so that it can be
-  // used as a callback (Windows expects a plain function, but member functions
-  // have an additional implicit this argument).
-  Window* this_ptr = nullptr;
-  if (uMsg == WM_NCCREATE)
-  {
-      this_ptr = reinterpret_cast<Window*>(reinterpret_cast<CREATESTRUCT*>(lParam)->lpCreateParams);
-      SetWindowLongPtr(hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this_ptr));
-  }
-  else
+  const auto stats = statistics();
+  log << "Frame pacing: " << stats.frames << " frames, " << stats.missed_deadlines << " missed deadlines" << std::endl;
+  log << "  wake up error (last " << window_fill_ << " frames): mean " << stats.mean_error_ms 
+    << " ms, p50 <= " << stats.p50_error_ms << " ms, p99 <= " << stats.p99_error_ms 
+    << " ms, max (all frames) " << stats.max_error_ms << " ms" << std::endl;
+
+  // Non empty buckets of the rolling histogram.
+  for (int i = 0; i <= bucket_count; ++i)
   {
-      this_ptr = reinterpret_cast<Window*>(GetWindowLongPtr(hWnd, GWLP_USERDATA));
-  }
+    if (histogram_[i] == 0) continue;
 
-  if (this_ptr)
-  {
-      return this_ptr->WindowProcImpl(hWnd, uMsg, wParam, lParam);
+    log << "  " << i * bucket_width_ms << (i == bucket_count ? "+ ms: " : " ms: ") << histogram_[i] << std::endl;
   }
-
-  return DefWindowProc(hWnd, uMsg, wParam, lParam);
 }
 
-LRESULT CALLBACK Window::WindowProcImpl(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+// Keeps the simulation at its rate, when the frames take longer than their
+// budget. The mean work time of the recent frames is compared with the 
+// budget: above the degrade load, the next degradation step is taken, below
+// the restore load, the last one is reverted. After every decision, a full 
+// window of frames at the new level is measured before the next one.
+//
+// The simulation and the render thread run in parallel, so the work time of
+// a frame is the longer one of the simulation and the drawing done during 
+// it. Otherwise skipping render frames could not lower the measured load.
+//
+// The load saved by each step is measured in the first window after it has 
+// been taken. A step is only reverted, when the load plus its saving stays 
+// below the degrade load, otherwise the governor would swap between two 
+// levels every window.
+class LoadGovernor
 {
-  switch (uMsg)
-  {
-  case WM_DESTROY:
-    PostQuitMessage(0);
-    return 0;
-  case WM_PAINT:
-    {
-      PAINTSTRUCT ps;
-      HDC hdc = BeginPaint(hWnd, &ps);
+public:
+  using Clock = std::chrono::steady_clock;
 
-      RECT rect;
-      GetClientRect(hWnd, &rect);
-      HDC buff_hdc;
-      auto h_buff = BeginBufferedPaint(hdc, &rect, BPBF_COMPATIBLEBITMAP, NULL, &buff_hdc);
+  // Cumulative, every level includes the steps below it.
+  enum class Level { Full = 0, SkipRenderFrames, SlowAnimations, CapSpawns, DropParticles, Count };
 
-      // Fill background.
-      FillRect(buff_hdc, &ps.rcPaint, (HBRUSH) (COLOR_WINDOW+1));
+  LoadGovernor(Clock::duration budget, float degrade_load, float restore_load, int window_frames);
 
-      Gdiplus::Graphics graphics(buff_hdc);
-      for (auto it = obj_collection_.rbegin(); it != obj_collection_.rend(); ++it )
-        (*it)->handleGraphics(graphics);
+  // Returns true, if the level has changed.
+  bool record(Clock::duration work, Clock::duration draw);
 
-      EndBufferedPaint(h_buff, TRUE);
-      EndPaint(hWnd, &ps);
-      break;
-    }
-  case WM_KEYDOWN:
-  {
-    std::vector<Object*> current_objects;
-    current_objects.reserve(obj_collection_.size());
-    for (auto& obj : obj_collection_)
-      current_objects.push_back(obj.get());
+  Level level() const { return level_; }
 
-    for (auto obj : current_objects)
-      obj->handleInput(KeyState::Down, wParam);
+  // Every other frame is published for rendering only.
+  bool shouldRender(std::uint64_t frame) const { return level_ < Level::SkipRenderFrames || frame % 2 == 0; }
+  int animationInterval() const { return level_ < Level::SlowAnimations ? 1 : 4; }
+  bool spawnsCapped() const { return level_ >= Level::CapSpawns; }
+  bool particlesEnabled() const { return level_ < Level::DropParticles; }
 
-    break;
-  }
-  case WM_KEYUP:
-  {
-    std::vector<Object*> current_objects;
-    current_objects.reserve(obj_collection_.size());
-    for (auto& obj : obj_collection_)
-      current_objects.push_back(obj.get());
+  void writeReport(Logger& log) const;
+
+private:
+  static const char* levelName(Level level);
+
+  Clock::duration budget_;
+  float degrade_load_ = 0.f;
+  float restore_load_ = 0.f;
+  int window_frames_ = 0;
+
+  Level level_ = Level::Full;
+  Clock::duration window_work_sum_{};
+  Clock::duration window_draw_sum_{};
+  int window_fill_ = 0;
+
+  // Per level, the load saved by the step to it.
+  std::array<float, int(Level::Count)> savings_{};
+  float load_before_step_ = 0.f;
+  bool measure_saving_ = false;
+
+  std::uint64_t degrades_ = 0;
+  std::uint64_t restores_ = 0;
+  std::array<std::uint64_t, int(Level::Count)> level_frames_{};
+};
 
-    for (auto obj : current_objects)
-      obj->handleInput(KeyState::Up, wParam);
+LoadGovernor::LoadGovernor(Clock::duration budget, float degrade_load, float restore_load, int window_frames) : 
+  budget_(budget), degrade_load_(degrade_load), restore_load_(restore_load), window_frames_(window_frames)
+{
+}
 
-    break;
+const char* LoadGovernor::levelName(Level level)
+{
+  switch (level)
+  {
+  case Level::Full: return "full quality";
+  case Level::SkipRenderFrames: return "render every other frame";
+  case Level::SlowAnimations: return "slower animations";
+  case Level::CapSpawns: return "capped spawns";
+  case Level::DropParticles: return "no particles";
+  default: return "unknown";
+  }
+}
+
+bool LoadGovernor::record(Clock::duration work, Clock::duration draw)
+{
+  ++level_frames_[int(level_)];
+  window_work_sum_ += work;
+  window_draw_sum_ += draw;
+  if (++window_fill_ < window_frames_) return false;
+
+  const auto work_mean = window_work_sum_ / window_fill_;
+  const auto draw_mean = window_draw_sum_ / window_fill_;
+  const auto mean = std::max(work_mean, draw_mean);
+  const auto load = std::chrono::duration<float>(mean) / std::chrono::duration<float>(budget_);
+  window_work_sum_ = {};
+  window_draw_sum_ = {};
+  window_fill_ = 0;
+
+  if (measure_saving_)
+  {
+    savings_[int(level_)] = std::max(0.f, load_before_step_ - load);
+    measure_saving_ = false;
   }
 
-    return 0;
+  const auto previous = level_;
+  if (load > degrade_load_ && level_ < Level::DropParticles)
+  {
+    level_ = Level(int(level_) + 1);
+    ++degrades_;
+    load_before_step_ = load;
+    measure_saving_ = true;
+  }
+  else if (load < restore_load_ && load + savings_[int(level_)] < degrade_load_ && level_ > Level::Full)
+  {
+    level_ = Level(int(level_) - 1);
+    ++restores_;
   }
+  if (level_ == previous) return false;
 
-  return DefWindowProc(hWnd, uMsg, wParam, lParam);
+  logger << "Load governor: frame work mean " << std::chrono::duration<float, std::milli>(work_mean).count() 
+    << " ms, draw mean " << std::chrono::duration<float, std::milli>(draw_mean).count() << " ms of " 
+    << std::chrono::duration<float, std::milli>(budget_).count() << " ms, " 
+    << (level_ > previous ? "degraded to " : "restored to ") << levelName(level_) << std::endl;
+  return true;
+}
+
+void LoadGovernor::writeReport(Logger& log) const
+{
+  log << "Load governor: " << degrades_ << " degradations, " << restores_ << " restorations" << std::endl;
+  for (int level = 0; level < int(Level::Count); ++level)
+  {
+    if (level_frames_[level] > 0)
+      log << "  " << levelName(Level(level)) << ": " << level_frames_[level] << " frames" << std::endl;
+  }
 }
 
 class Game
@@ -771,48 +7209,150 @@ public:
 private:
   void triggerRender();
 
-  bool areObjectsColliding(Object& obj_1, Object& obj_2);
+  // Creates the objects, whose assets have been loaded in the meantime.
+  void spawnPending();
+
+  // Quick save (F5), quick load (F9) and rewind (Backspace).
+  void handleWorldKey(KeyState state, int vkey);
+  void applyWorldAction();
+  void restoreSnapshot(std::vector<std::uint8_t> const& raw);
+
+  std::unique_ptr<ThreadPool> thread_pool_;
+  std::unique_ptr<AssetLoader> assets_;
 
   std::unique_ptr<Window> win_;
+  std::unique_ptr<Renderer> renderer_;
+  std::unique_ptr<FramePacer> pacer_;
+  std::unique_ptr<LoadGovernor> governor_;
+  std::size_t spawn_limit_ = 0;
+
+  // Objects waiting for their assets.
+  struct PendingSpawn
+  {
+    std::vector<BitmapHandle> assets;
+    std::function<void()> spawn;
+  };
+
+  std::vector<PendingSpawn> pending_spawns_;
+
+  // Counts the heap allocations of a frame, if enabled.
+  void checkAllocations(AllocationTracker::PhaseCounts const& counts);
+  void logAllocations() const;
+
+  // First key press, which has not been published for rendering yet.
+  std::chrono::steady_clock::time_point input_time_{};
+
+  // Startup measurements.
+  std::chrono::steady_clock::time_point init_time_;
+  bool first_frame_logged_ = false;
+  bool all_assets_logged_ = false;
 
   std::chrono::duration<float, std::milli> frame_time_;
 
-  std::vector<std::unique_ptr<Object>> objects_;
+  std::unique_ptr<World> world_;
 
-  float world_width_ = 0.f;
-  float world_height_ = 0.f;
+  enum class WorldAction { None, Save, Load, Rewind };
+  WorldAction world_action_ = WorldAction::None;
+
+  std::unique_ptr<SnapshotBuffer> snapshots_;
+  std::vector<std::uint8_t> saved_snapshot_;
+  std::vector<std::uint8_t> decoded_snapshot_;
+  int rewind_ticks_ = 0;
+
+  bool alloc_check_ = false;
+  int max_frames_ = 0;
+  int frame_count_ = 0;
+
+  // Frames after the last spawn are considered steady.
+  static constexpr int warmup_frames = 60;
+  int steady_since_frame_ = -1;
+  int steady_frames_ = 0;
+  AllocationTracker::PhaseCounts steady_allocations_;
 };
 
 void Game::init(Configuration const& config)
 {
-  world_width_ = config.game.window_width;
-  world_height_ = config.game.window_height;
+  init_time_ = std::chrono::steady_clock::now();
 
-  win_ = std::make_unique<Window>(config, objects_);
-  frame_time_ = std::chrono::milliseconds(1000) / config.game.fps;
+  alloc_check_ = config.benchmark.alloc_check;
+  max_frames_ = config.benchmark.max_frames;
 
-  auto player = std::make_unique<Object>(
-    config.game.window_width / 2.f, config.game.window_height / 2.f, 0.f, 0.f, config.player.size);
-  //player->dynamics_handler_ = std::make_unique<LinearMotion>();
-  player->dynamics_handler_ = std::make_unique<GravitationalMotion>(config.player.g);
-  player->collision_handler_ = std::make_unique<PlayerCollisionHandler>(*player);
-  player->input_handler_ = std::make_unique<PlayerInput>(config, objects_);
-  //player->graphics_handler_ = std::make_unique<BitmapGraphics>(config.player.bitmap);
-  player->graphics_handler_ = std::make_unique<AnimationGraphics>(config.player.anim_config);
-  objects_.emplace_back(std::move(player));
+  // Allocate upfront what the frames would otherwise allocate on demand.
+  Pooled<Object>::reserve(256);
+  Pooled<BitmapGraphics>::reserve(256);
+
+  // Start decoding all images in the background first.
+  thread_pool_ = std::make_unique<ThreadPool>();
+
+  std::shared_ptr<ResourcePack> pack;
+  if (std::filesystem::exists(config.assets.pack))
+  {
+    const auto start = std::chrono::steady_clock::now();
+    pack = std::make_shared<ResourcePack>(config.assets.pack);
+    const auto elapsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start);
+    logger << "Resource pack: " << pack->assetCount() << " assets, " << pack->bytes() << " bytes mapped in " 
+      << elapsed.count() << " ms" << std::endl;
+  }
+  assets_ = std::make_unique<AssetLoader>(*thread_pool_, pack);
+
+  const auto bullet_bitmap = assets_->loadBitmap(config.bullet.bitmap);
+
+  std::vector<BitmapHandle> player_assets{ bullet_bitmap };
+  for (const auto& anim : config.player.anim_config.single_animation_configs)
+  {
+    // The player turns around, so the mirrored frames are needed right away.
+    for (const auto& file : anim.frame_files)
+    {
+      player_assets.push_back(assets_->loadBitmap(file));
+      player_assets.push_back(assets_->loadBitmap(file, Flip::Horizontal));
+    }
+  }
 
-  // Add tiles.
-  addTiles(config.tile_config, objects_);
+  world_ = std::make_unique<World>(config, thread_pool_.get());
+  world_->bulletTemplate().bitmap = bullet_bitmap;
+
+  logger << "Tiles: " << config.tile_config.tiles.size() << " cells merged into " 
+    << world_->tileLayer().rectCount() << " objects" << std::endl;
+
+  win_ = std::make_unique<Window>(config);
+  // At most every other cell of a row starts a run of water.
+  const auto max_cell_rects = std::size_t(config.tile_config.grid_width + 1) / 2 * config.tile_config.grid_height;
+  std::unique_ptr<SoftwareRasterizer> rasterizer;
+  if (config.render.software)
+    rasterizer = std::make_unique<SoftwareRasterizer>(thread_pool_.get(), config.render.tile_size);
+  renderer_ = std::make_unique<Renderer>(win_->handle(), 1024, config.particles.capacity, max_cell_rects, 
+    std::move(rasterizer));
+  win_->setPaintListener([this]() { renderer_->requestRedraw(); });
+  win_->setKeyListener([this](KeyState state, int vkey) 
+    { 
+      world_->handleInput(state, vkey);
+      handleWorldKey(state, vkey);
+    });
+  frame_time_ = std::chrono::milliseconds(1000) / config.game.fps;
+
+  const auto history_ticks = std::size_t(config.snapshots.history_seconds * config.game.fps);
+  snapshots_ = std::make_unique<SnapshotBuffer>(
+    config.snapshots.buffer_bytes, history_ticks, config.snapshots.keyframe_interval);
+  rewind_ticks_ = int(config.snapshots.rewind_seconds * config.game.fps);
+  pacer_ = std::make_unique<FramePacer>(
+    std::chrono::duration_cast<FramePacer::Clock::duration>(frame_time_));
+  governor_ = std::make_unique<LoadGovernor>(std::chrono::duration_cast<LoadGovernor::Clock::duration>(frame_time_), 
+    config.governor.degrade_load, config.governor.restore_load, config.governor.window_frames);
+  spawn_limit_ = std::size_t(config.governor.spawn_limit);
+
+  // The player appears as soon as its frames have been decoded.
+  pending_spawns_.push_back(PendingSpawn{ player_assets, [this, config]()
+    {
+      world_->spawnPlayer(config, std::make_unique<AnimationGraphics>(config.player.anim_config, *assets_));
+    } });
 }
 
 void Game::exec()
 {
-  auto prev_end_time = std::chrono::steady_clock::now();
-  auto prev_sleep_time = std::chrono::duration<float, std::milli>(0);
-  while (true)
+  while (max_frames_ == 0 || frame_count_ < max_frames_)
   {
-    const auto begin_time = std::chrono::steady_clock::now();
-    const auto prev_overshoot_time = begin_time - prev_end_time - prev_sleep_time;
+    const auto frame_start = std::chrono::steady_clock::now();
+    AllocationTracker::beginFrame();
 
     MSG msg;
     if (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
@@ -823,72 +7363,194 @@ void Game::exec()
       DispatchMessage(&msg);
     }
 
-    for (auto& o : objects_)
+    spawnPending();
+    applyWorldAction();
+
+    world_->update();
+
+    // The simulation keeps its rate, skipped frames are only not drawn.
+    AllocationTracker::setPhase(FramePhase::Render);
+    if (governor_->shouldRender(frame_count_)) triggerRender();
+
+    if (!first_frame_logged_)
     {
-      o->handleDynamics();
-    
-      if (o->x < 0.f || o->x > world_width_ || o->y < 0.f || o->y > world_height_)
-        o->remove = true;
+      const auto elapsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - init_time_);
+      logger << "Time to first frame: " << elapsed.count() << " ms" << std::endl;
+      first_frame_logged_ = true;
     }
 
-    // Collision detection.
-    // Loop over unique pairs of objects.
-    for (int i = 0; i < objects_.size(); ++i)
-    {
-      auto& obj_1 = objects_.at(i);
-      for (int j = 0; j < i; ++j)
-      {
-        auto& obj_2 = objects_.at(j);
+    AllocationTracker::setPhase(FramePhase::Cleanup);
+    world_->removeObjects();
 
-        if (areObjectsColliding(*obj_1, *obj_2))
-        {
-          obj_1->handleCollision(*obj_2);
-        }
-      }
-    }
+    snapshots_->capture(frame_count_, world_->objects(), world_->grid());
+
+    // Transient data of this frame is gone.
+    frame_arena().reset();
 
-    triggerRender();
+    checkAllocations(AllocationTracker::endFrame());
 
+    if (governor_->record(std::chrono::steady_clock::now() - frame_start, renderer_->takeDrawTime()))
     {
-      auto& vec = objects_;
-      vec.erase(std::remove_if(vec.begin(), vec.end(),
-        [](auto const& o) { return o->remove; }), vec.end());
+      world_->setSpawnLimit(governor_->spawnsCapped() ? spawn_limit_ : 0);
+      world_->setAnimationInterval(governor_->animationInterval());
+      world_->setParticlesEnabled(governor_->particlesEnabled());
     }
+    ++frame_count_;
+
+    pacer_->wait();
+  }
+
+  renderer_->stop();
+
+  logAllocations();
+  pacer_->writeReport(logger);
+  governor_->writeReport(logger);
+  renderer_->writeReport(logger);
+  assets_->writeReport(logger, [this](Gdiplus::Bitmap const* bitmap) { return renderer_->spriteDraws(bitmap); });
+
+  world_->writeReport(logger);
+
+  logger << "Snapshots: capture mean " << snapshots_->meanCaptureUs() << " us, max " 
+    << snapshots_->maxCaptureUs() << " us; " << snapshots_->snapshotCount() << " held in " 
+    << snapshots_->bytesUsed() << " of " << snapshots_->capacityBytes() << " bytes" << std::endl;
+}
+
+void Game::handleWorldKey(KeyState state, int vkey)
+{
+  if (state != KeyState::Down) return;
+
+  if (input_time_ == std::chrono::steady_clock::time_point{})
+    input_time_ = std::chrono::steady_clock::now();
 
-    const auto end_time = std::chrono::steady_clock::now();
-    const auto body_duration = end_time - begin_time;
+  // Only remembered here, applied at a fixed point of the tick.
+  if (vkey == VK_F5) world_action_ = WorldAction::Save;
+  else if (vkey == VK_F9) world_action_ = WorldAction::Load;
+  else if (vkey == VK_BACK) world_action_ = WorldAction::Rewind;
+}
 
-    std::this_thread::sleep_for(frame_time_ - body_duration - prev_overshoot_time);
+void Game::applyWorldAction()
+{
+  const auto action = world_action_;
+  world_action_ = WorldAction::None;
+  if (action == WorldAction::None || snapshots_->empty()) return;
 
-    prev_end_time = end_time;
+  switch (action)
+  {
+  case WorldAction::Save:
+    snapshots_->decode(snapshots_->newestTick(), saved_snapshot_);
+    break;
+  case WorldAction::Load:
+    if (!saved_snapshot_.empty()) restoreSnapshot(saved_snapshot_);
+    break;
+  case WorldAction::Rewind:
+  {
+    const auto newest = snapshots_->newestTick();
+    const auto target = std::max(snapshots_->oldestTick(), newest - std::min<std::uint64_t>(newest, rewind_ticks_));
+    if (snapshots_->decode(target, decoded_snapshot_)) restoreSnapshot(decoded_snapshot_);
+    break;
+  }
+  default:
+    break;
   }
 }
 
-void Game::triggerRender()
+void Game::restoreSnapshot(std::vector<std::uint8_t> const& raw)
 {
-  win_->render();
+  SnapshotView view(raw);
+  world_->restore(view);
+
+  logger << "Restored snapshot of tick " << view.header().tick << std::endl;
 }
 
-bool Game::areObjectsColliding(Object& obj_1, Object& obj_2)
+void Game::checkAllocations(AllocationTracker::PhaseCounts const& counts)
 {
-  const float dpos_x = obj_1.x - obj_2.x;
-  const float dpos_y = obj_1.y - obj_2.y;
+  if (!AllocationTracker::enabled()) return;
 
-  const bool overlap_x = abs(dpos_x) < 0.5f * (obj_1.size.width + obj_2.size.width);
-  const bool overlap_y = abs(dpos_y) < 0.5f * (obj_1.size.height + obj_2.size.height);
-  if (overlap_x && overlap_y)
+  // Frames are steady, once everything has been spawned and warmed up.
+  if (!pending_spawns_.empty() || !assets_->allLoaded())
   {
-    // Due to finite time steps in game engine the collision might have already 
-    // been handled in the previous step and the objects are moving apart from 
-    // each other, even though they are still close enough. Therefore it is 
-    // crucial to also check the relative velocity with respect to the distance 
-    // between them.
-    const auto dv_x = obj_1.vx - obj_2.vx;
-    const auto dv_y = obj_1.vy - obj_2.vy;
-    return (dpos_x * dv_x + dpos_y * dv_y) < 0.f;
+    steady_since_frame_ = -1;
+    return;
   }
 
-  return false;
+  if (steady_since_frame_ < 0) steady_since_frame_ = frame_count_ + warmup_frames;
+  if (frame_count_ < steady_since_frame_) return;
+
+  ++steady_frames_;
+  std::uint64_t frame_allocations = 0;
+  for (std::size_t i = 0; i < counts.size(); ++i)
+  {
+    steady_allocations_[i].allocations += counts[i].allocations;
+    steady_allocations_[i].bytes += counts[i].bytes;
+    frame_allocations += counts[i].allocations;
+  }
+
+  if (alloc_check_ && frame_allocations > 0)
+  {
+    logAllocations();
+
+    std::ostringstream message;
+    message << "Steady state frame " << frame_count_ << " allocated " << frame_allocations << " times.";
+    throw std::runtime_error(message.str());
+  }
+}
+
+void Game::logAllocations() const
+{
+  logger << "Frame arena: " << frame_arena().capacity() << " bytes, high water mark " 
+    << frame_arena().highWaterMark() << " bytes" << std::endl;
+
+  if (!AllocationTracker::enabled() || steady_frames_ == 0) return;
+
+  logger << "Heap allocations per steady state frame (" << steady_frames_ << " frames):" << std::endl;
+  for (std::size_t i = 0; i < steady_allocations_.size(); ++i)
+  {
+    const auto& counts = steady_allocations_[i];
+    logger << "  " << phase_name(FramePhase(i)) << ": " 
+      << double(counts.allocations) / steady_frames_ << " allocations, " 
+      << double(counts.bytes) / steady_frames_ << " bytes" << std::endl;
+  }
+}
+
+void Game::spawnPending()
+{
+  if (!all_assets_logged_ && assets_->allLoaded())
+  {
+    const auto elapsed = std::chrono::duration<float, std::milli>(assets_->lastLoadedTime() - init_time_);
+    logger << "Time to all assets: " << elapsed.count() << " ms (" 
+      << thread_pool_->size() << " loader threads)" << std::endl;
+    all_assets_logged_ = true;
+  }
+
+  auto it = pending_spawns_.begin();
+  while (it != pending_spawns_.end())
+  {
+    const bool ready = std::all_of(it->assets.begin(), it->assets.end(), 
+      [](BitmapHandle const& handle) { return isReady(handle); });
+
+    if (ready)
+    {
+      it->spawn();
+      it = pending_spawns_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+void Game::triggerRender()
+{
+  // Only the state is captured here, it is drawn on the render thread.
+  auto& state = renderer_->beginFrame();
+  state.tick = frame_count_;
+  state.input_time = input_time_;
+  input_time_ = {};
+
+  world_->publish(state);
+
+  renderer_->publish();
 }
 
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow)
@@ -898,6 +7560,7 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine
   ULONG_PTR gdiplusToken;
   GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
 
+  int exit_code = 0;
   try
   {
     auto config = read_config();
@@ -906,19 +7569,61 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine
     config.game.instance = hInstance;
     config.game.cmd_show = nCmdShow;
 
-    auto game = std::make_unique<Game>();
+    read_command_line(pCmdLine, config);
+
+    if (!config.assets.build_from.empty())
+    {
+      build_resource_pack(config.assets.build_from, config.assets.pack, config.assets.build_encoded);
+    }
+    else if (config.benchmark.snapshots)
+    {
+      benchmark_snapshots(config);
+    }
+    else if (config.benchmark.dispatch)
+    {
+      benchmark_dispatch(config);
+    }
+    else if (config.benchmark.particles)
+    {
+      benchmark_particles(config);
+    }
+    else if (config.benchmark.paths)
+    {
+      benchmark_paths(config);
+    }
+    else if (config.benchmark.water)
+    {
+      benchmark_water(config);
+    }
+    else if (config.benchmark.worlds > 0)
+    {
+      benchmark_worlds(config);
+    }
+    else if (config.benchmark.assets)
+    {
+      benchmark_assets(config);
+    }
+    else if (config.benchmark.raster)
+    {
+      benchmark_raster(config);
+    }
+    else
+    {
+      auto game = std::make_unique<Game>();
 
-    game->init(config);
+      game->init(config);
 
-    game->exec();
+      game->exec();
+    }
   }
   catch (std::exception const& e)
   {
     logger << e.what() << std::endl;
+    exit_code = 1;
   }
 
   Gdiplus::GdiplusShutdown(gdiplusToken);
 
-  return 0;
+  return exit_code;
 }
 
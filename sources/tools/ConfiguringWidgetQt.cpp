@@ -19,10 +19,19 @@ ConfiguringWidget::ConfiguringWidget(QWidget* parent) : QWidget(parent)
   auto tile_size_edit = new QLineEdit();
   auto tile_size_validator = new QIntValidator(5, 50, this);
 
+  // The map may span several windows (screens) in each direction.
+  auto screens_x_edit = new QLineEdit(QString::number(*state_.screens_x));
+  auto screens_x_validator = new QIntValidator(1, 100, this);
+
+  auto screens_y_edit = new QLineEdit(QString::number(*state_.screens_y));
+  auto screens_y_validator = new QIntValidator(1, 100, this);
+
   auto form_layout = new QFormLayout();
   form_layout->addRow("Window width:", window_width_edit);
   form_layout->addRow("Window height:", window_height_edit);
   form_layout->addRow("Tile size:", tile_size_edit);
+  form_layout->addRow("Screens across:", screens_x_edit);
+  form_layout->addRow("Screens down:", screens_y_edit);
 
   auto configure_button = new QPushButton("Configure");
   auto button_layout = new QHBoxLayout();
@@ -75,11 +84,38 @@ ConfiguringWidget::ConfiguringWidget(QWidget* parent) : QWidget(parent)
       configure_button->setEnabled(state_.valid());
     });
 
+  QObject::connect(screens_x_edit, &QLineEdit::textChanged, 
+    [this, screens_x_validator, configure_button](QString const& new_string) 
+    {
+      int pos = 0;
+      auto copy = new_string;
+      if (screens_x_validator->validate(copy, pos) == QValidator::State::Acceptable)
+        state_.screens_x = new_string.toInt();
+      else
+        state_.screens_x = std::nullopt;
+
+      configure_button->setEnabled(state_.valid());
+    });
+
+  QObject::connect(screens_y_edit, &QLineEdit::textChanged, 
+    [this, screens_y_validator, configure_button](QString const& new_string) 
+    {
+      int pos = 0;
+      auto copy = new_string;
+      if (screens_y_validator->validate(copy, pos) == QValidator::State::Acceptable)
+        state_.screens_y = new_string.toInt();
+      else
+        state_.screens_y = std::nullopt;
+
+      configure_button->setEnabled(state_.valid());
+    });
+
   QObject::connect(configure_button, &QPushButton::clicked, [this]() 
     {
       if (!state_.valid()) return;
 
-      emit this->configuringDone(*state_.window_width, *state_.window_height, *state_.tile_size);
+      emit this->configuringDone(*state_.window_width, *state_.window_height, *state_.tile_size,
+        *state_.screens_x, *state_.screens_y);
     });
 
   configure_button->setDisabled(true);
@@ -12,7 +12,7 @@ public:
   explicit ConfiguringWidget(QWidget* parent = nullptr);
 
 signals:
-  void configuringDone(int window_width, int window_height, int tile_size);
+  void configuringDone(int window_width, int window_height, int tile_size, int screens_x, int screens_y);
 
 private:
   struct
@@ -20,10 +20,13 @@ private:
     std::optional<int> window_width;
     std::optional<int> window_height;
     std::optional<int> tile_size;
+    std::optional<int> screens_x = 1;
+    std::optional<int> screens_y = 1;
 
     bool valid() const
     {
-      return window_width.has_value() && window_height.has_value() && tile_size.has_value();
+      return window_width.has_value() && window_height.has_value() && tile_size.has_value() &&
+        screens_x.has_value() && screens_y.has_value();
     }
   } state_;
 };
@@ -0,0 +1,384 @@
+#include "TileMap.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace detail
+{
+  TileRect unite(TileRect const& a, TileRect const& b)
+  {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+
+    const auto left = std::min(a.x, b.x);
+    const auto top = std::min(a.y, b.y);
+    const auto right = std::max(a.x + a.width, b.x + b.width);
+    const auto bottom = std::max(a.y + a.height, b.y + b.height);
+    return TileRect{ left, top, right - left, bottom - top };
+  }
+
+  TileRect intersect(TileRect const& a, TileRect const& b)
+  {
+    const auto left = std::max(a.x, b.x);
+    const auto top = std::max(a.y, b.y);
+    const auto right = std::min(a.x + a.width, b.x + b.width);
+    const auto bottom = std::min(a.y + a.height, b.y + b.height);
+    if (right <= left || bottom <= top) return TileRect{};
+
+    return TileRect{ left, top, right - left, bottom - top };
+  }
+
+  void pushU16(std::vector<std::uint8_t>& out, int value)
+  {
+    out.push_back(std::uint8_t(value & 0xff));
+    out.push_back(std::uint8_t(value >> 8));
+  }
+
+  int readU16(std::vector<std::uint8_t> const& in, std::size_t& pos)
+  {
+    const int value = in[pos] | (in[pos + 1] << 8);
+    pos += 2;
+    return value;
+  }
+}
+
+TileMap::TileMap(int width, int height) :
+  width_(width), height_(height),
+  chunks_x_((width + chunk_size - 1) / chunk_size),
+  chunks_y_((height + chunk_size - 1) / chunk_size)
+{
+  chunks_.resize(std::size_t(chunks_x_) * chunks_y_);
+}
+
+int TileMap::chunkIndex(int x, int y) const
+{
+  return (y / chunk_size) * chunks_x_ + x / chunk_size;
+}
+
+TileRect TileMap::chunkBounds(int chunk_index) const
+{
+  const auto left = (chunk_index % chunks_x_) * chunk_size;
+  const auto top = (chunk_index / chunks_x_) * chunk_size;
+  return detail::intersect(TileRect{ left, top, chunk_size, chunk_size }, TileRect{ 0, 0, width_, height_ });
+}
+
+TileType TileMap::at(int x, int y) const
+{
+  const auto& chunk = chunks_[chunkIndex(x, y)];
+  if (!chunk) return TileType::Clear;
+
+  return chunk->tiles[(y % chunk_size) * chunk_size + x % chunk_size];
+}
+
+void TileMap::readRow(int x, int y, int count, TileType* out) const
+{
+  while (count > 0)
+  {
+    // Part of the row within a single chunk.
+    const auto local_x = x % chunk_size;
+    const auto span = std::min(count, chunk_size - local_x);
+
+    const auto& chunk = chunks_[chunkIndex(x, y)];
+    if (chunk)
+      std::memcpy(out, &chunk->tiles[(y % chunk_size) * chunk_size + local_x], span * sizeof(TileType));
+    else
+      std::fill(out, out + span, TileType::Clear);
+
+    x += span;
+    out += span;
+    count -= span;
+  }
+}
+
+TileMap::Chunk& TileMap::touchChunk(int chunk_index)
+{
+  auto& chunk = chunks_[chunk_index];
+
+  if (edit_depth_ > 0 && edit_before_.count(chunk_index) == 0)
+  {
+    // Remember the state before the edit. Unallocated chunks are clear.
+    edit_before_.emplace(chunk_index, chunk ? std::make_unique<ChunkTiles>(chunk->tiles) : nullptr);
+  }
+
+  if (!chunk)
+  {
+    chunk = std::make_unique<Chunk>();
+    chunk->tiles.fill(TileType::Clear);
+  }
+
+  return *chunk;
+}
+
+void TileMap::releaseIfClear(int chunk_index)
+{
+  auto& chunk = chunks_[chunk_index];
+  if (chunk && chunk->non_clear == 0)
+    chunk.reset();
+}
+
+void TileMap::writeSpan(int x, int y, int count, TileType const* src, TileType fill)
+{
+  while (count > 0)
+  {
+    const auto local_x = x % chunk_size;
+    const auto span = std::min(count, chunk_size - local_x);
+    const auto chunk_index = chunkIndex(x, y);
+
+    // Clearing an unallocated chunk changes nothing.
+    const bool clears = !src && fill == TileType::Clear;
+    if (!(clears && !chunks_[chunk_index]))
+    {
+      auto& chunk = touchChunk(chunk_index);
+      auto dst = &chunk.tiles[(y % chunk_size) * chunk_size + local_x];
+      for (int i = 0; i < span; ++i)
+      {
+        const auto type = src ? src[i] : fill;
+        chunk.non_clear += int(type != TileType::Clear) - int(dst[i] != TileType::Clear);
+        dst[i] = type;
+      }
+
+      releaseIfClear(chunk_index);
+    }
+
+    x += span;
+    if (src) src += span;
+    count -= span;
+  }
+}
+
+bool TileMap::set(int x, int y, TileType type)
+{
+  if (x < 0 || y < 0 || x >= width_ || y >= height_) return false;
+  if (at(x, y) == type) return false;
+
+  beginEdit();
+  writeSpan(x, y, 1, nullptr, type);
+  endEdit();
+
+  return true;
+}
+
+TileRect TileMap::fillRect(TileRect rect, TileType type)
+{
+  rect = detail::intersect(rect, TileRect{ 0, 0, width_, height_ });
+  if (rect.empty()) return rect;
+
+  beginEdit();
+  for (int y = rect.y; y < rect.y + rect.height; ++y)
+    writeSpan(rect.x, y, rect.width, nullptr, type);
+  endEdit();
+
+  return rect;
+}
+
+TileRect TileMap::floodFill(int x, int y, TileType type)
+{
+  if (x < 0 || y < 0 || x >= width_ || y >= height_) return TileRect{};
+
+  const auto target = at(x, y);
+  if (target == type) return TileRect{};
+
+  beginEdit();
+
+  // Scanline fill: each popped seed is extended to the whole span of target
+  // tiles in its row, which is filled at once. Then a single seed is pushed
+  // for every run of target tiles directly above and below the span.
+  TileRect bounds;
+  std::vector<std::pair<int, int>> seeds{ { x, y } };
+  while (!seeds.empty())
+  {
+    const auto [seed_x, seed_y] = seeds.back();
+    seeds.pop_back();
+
+    if (at(seed_x, seed_y) != target) continue;
+
+    int left = seed_x;
+    while (left > 0 && at(left - 1, seed_y) == target) --left;
+
+    int right = seed_x;
+    while (right < width_ - 1 && at(right + 1, seed_y) == target) ++right;
+
+    writeSpan(left, seed_y, right - left + 1, nullptr, type);
+    bounds = detail::unite(bounds, TileRect{ left, seed_y, right - left + 1, 1 });
+
+    for (const auto row : { seed_y - 1, seed_y + 1 })
+    {
+      if (row < 0 || row >= height_) continue;
+
+      bool in_run = false;
+      for (int i = left; i <= right; ++i)
+      {
+        const bool matches = at(i, row) == target;
+        if (matches && !in_run) seeds.emplace_back(i, row);
+        in_run = matches;
+      }
+    }
+  }
+
+  endEdit();
+
+  return bounds;
+}
+
+TileRegion TileMap::copyRegion(TileRect rect) const
+{
+  rect = detail::intersect(rect, TileRect{ 0, 0, width_, height_ });
+
+  TileRegion region;
+  if (rect.empty()) return region;
+
+  region.width = rect.width;
+  region.height = rect.height;
+  region.tiles.resize(std::size_t(rect.width) * rect.height);
+  for (int j = 0; j < rect.height; ++j)
+    readRow(rect.x, rect.y + j, rect.width, region.tiles.data() + std::size_t(j) * rect.width);
+
+  return region;
+}
+
+TileRect TileMap::paste(TileRegion const& region, int x, int y)
+{
+  const auto rect = detail::intersect(
+    TileRect{ x, y, region.width, region.height }, TileRect{ 0, 0, width_, height_ });
+  if (rect.empty()) return rect;
+
+  beginEdit();
+  for (int j = rect.y; j < rect.y + rect.height; ++j)
+  {
+    const auto src = region.tiles.data() + std::size_t(j - y) * region.width + (rect.x - x);
+    writeSpan(rect.x, j, rect.width, src, TileType::Clear);
+  }
+  endEdit();
+
+  return rect;
+}
+
+void TileMap::beginEdit()
+{
+  ++edit_depth_;
+}
+
+void TileMap::endEdit()
+{
+  if (edit_depth_ == 0 || --edit_depth_ > 0) return;
+
+  static const ChunkTiles clear_tiles{};
+
+  Edit edit;
+  for (auto const& [chunk_index, before] : edit_before_)
+  {
+    const auto& chunk = chunks_[chunk_index];
+    const auto& before_tiles = before ? *before : clear_tiles;
+    const auto& after_tiles = chunk ? chunk->tiles : clear_tiles;
+
+    ChunkDelta delta;
+    delta.chunk_index = chunk_index;
+    encodeDelta(before_tiles, after_tiles, delta.encoded);
+    if (delta.encoded.empty()) continue;
+
+    edit.bounds = detail::unite(edit.bounds, chunkBounds(chunk_index));
+    edit.bytes += delta.encoded.size();
+    edit.deltas.emplace_back(std::move(delta));
+  }
+  edit_before_.clear();
+
+  if (edit.deltas.empty()) return;
+
+  // A new edit discards the undone ones.
+  while (history_.size() > history_pos_)
+  {
+    history_bytes_ -= history_.back().bytes;
+    history_.pop_back();
+  }
+
+  history_bytes_ += edit.bytes;
+  history_.emplace_back(std::move(edit));
+  ++history_pos_;
+
+  // Keep the memory bounded by forgetting the oldest edits.
+  while (history_bytes_ > max_history_bytes && history_.size() > 1)
+  {
+    history_bytes_ -= history_.front().bytes;
+    history_.pop_front();
+    --history_pos_;
+  }
+}
+
+TileRect TileMap::undo()
+{
+  if (edit_depth_ > 0 || !canUndo()) return TileRect{};
+
+  --history_pos_;
+  return applyEdit(history_[history_pos_]);
+}
+
+TileRect TileMap::redo()
+{
+  if (edit_depth_ > 0 || !canRedo()) return TileRect{};
+
+  return applyEdit(history_[history_pos_++]);
+}
+
+TileRect TileMap::applyEdit(Edit const& edit)
+{
+  // XOR deltas are their own inverse, so the same edit serves undo and redo.
+  for (const auto& delta : edit.deltas)
+  {
+    auto& chunk = chunks_[delta.chunk_index];
+    if (!chunk)
+    {
+      chunk = std::make_unique<Chunk>();
+      chunk->tiles.fill(TileType::Clear);
+    }
+
+    applyDelta(delta.encoded, chunk->tiles);
+
+    chunk->non_clear = int(std::count_if(chunk->tiles.begin(), chunk->tiles.end(),
+      [](TileType type) { return type != TileType::Clear; }));
+    releaseIfClear(delta.chunk_index);
+  }
+
+  return edit.bounds;
+}
+
+std::size_t TileMap::allocatedChunks() const
+{
+  return std::count_if(chunks_.begin(), chunks_.end(), [](auto const& chunk) { return chunk != nullptr; });
+}
+
+void TileMap::encodeDelta(ChunkTiles const& before, ChunkTiles const& after, std::vector<std::uint8_t>& out)
+{
+  // Sequence of (zero run length, literal length, literal bytes) of the XOR
+  // of both states. Unchanged chunks produce no output at all.
+  const int count = int(before.size());
+  int i = 0;
+  while (i < count)
+  {
+    const auto run_begin = i;
+    while (i < count && before[i] == after[i]) ++i;
+    if (i == count) break;
+
+    const auto zero_run = i - run_begin;
+
+    const auto literal_begin = i;
+    while (i < count && before[i] != after[i]) ++i;
+
+    detail::pushU16(out, zero_run);
+    detail::pushU16(out, i - literal_begin);
+    for (int k = literal_begin; k < i; ++k)
+      out.push_back(std::uint8_t(before[k]) ^ std::uint8_t(after[k]));
+  }
+}
+
+void TileMap::applyDelta(std::vector<std::uint8_t> const& encoded, ChunkTiles& tiles)
+{
+  std::size_t pos = 0;
+  int index = 0;
+  while (pos < encoded.size())
+  {
+    index += detail::readU16(encoded, pos);
+    const auto literal_count = detail::readU16(encoded, pos);
+    for (int k = 0; k < literal_count; ++k, ++index)
+      tiles[index] = TileType(std::uint8_t(tiles[index]) ^ encoded[pos++]);
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+enum class TileType : std::uint8_t { Clear = 0, Ground, Wall, Water };
+
+struct TileRect
+{
+  int x = 0, y = 0;
+  int width = 0, height = 0;
+
+  bool empty() const { return width <= 0 || height <= 0; }
+};
+
+// Dense copy of a rectangular part of the map (used for copy & paste).
+struct TileRegion
+{
+  int width = 0, height = 0;
+  std::vector<TileType> tiles;
+};
+
+// Sparse tile storage. The map is split into square chunks, which are only
+// allocated once they contain a non clear tile, so empty parts of the map
+// cost a single pointer per chunk.
+//
+// Modifications are grouped into edits (beginEdit/endEdit). Each finished
+// edit is stored in the history as run-length encoded XOR deltas of the
+// chunks it touched, which are applied for undo as well as redo.
+class TileMap
+{
+public:
+  static constexpr int chunk_size = 64;
+
+  TileMap(int width, int height);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  TileType at(int x, int y) const;
+
+  // Copies count tiles of the row y starting at x into out.
+  void readRow(int x, int y, int count, TileType* out) const;
+
+  // Returns true, if the tile has changed.
+  bool set(int x, int y, TileType type);
+
+  // Bulk operations. All of them return the area, which needs to be repainted.
+  TileRect fillRect(TileRect rect, TileType type);
+  TileRect floodFill(int x, int y, TileType type);
+  TileRegion copyRegion(TileRect rect) const;
+  TileRect paste(TileRegion const& region, int x, int y);
+
+  // Modifications between these calls form a single undo step. Modifications
+  // outside of an edit are recorded as an edit of their own.
+  void beginEdit();
+  void endEdit();
+
+  bool canUndo() const { return history_pos_ > 0; }
+  bool canRedo() const { return history_pos_ < history_.size(); }
+
+  // Return the area, which needs to be repainted.
+  TileRect undo();
+  TileRect redo();
+
+  // Number of allocated chunks and bytes held by the history.
+  std::size_t allocatedChunks() const;
+  std::size_t historyBytes() const { return history_bytes_; }
+
+private:
+  using ChunkTiles = std::array<TileType, chunk_size * chunk_size>;
+
+  struct Chunk
+  {
+    ChunkTiles tiles;
+    int non_clear = 0;
+  };
+
+  struct ChunkDelta
+  {
+    int chunk_index = 0;
+    std::vector<std::uint8_t> encoded;
+  };
+
+  struct Edit
+  {
+    std::vector<ChunkDelta> deltas;
+    TileRect bounds;
+    std::size_t bytes = 0;
+  };
+
+  int chunkIndex(int x, int y) const;
+  TileRect chunkBounds(int chunk_index) const;
+
+  // Returns the chunk for modification. Remembers its previous state, when
+  // the chunk is touched for the first time within the current edit.
+  Chunk& touchChunk(int chunk_index);
+  void releaseIfClear(int chunk_index);
+
+  // Writes count tiles of the row y starting at x, either copied from src or,
+  // when src is nullptr, set to fill.
+  void writeSpan(int x, int y, int count, TileType const* src, TileType fill);
+
+  TileRect applyEdit(Edit const& edit);
+
+  static void encodeDelta(ChunkTiles const& before, ChunkTiles const& after, std::vector<std::uint8_t>& out);
+  static void applyDelta(std::vector<std::uint8_t> const& encoded, ChunkTiles& tiles);
+
+  int width_ = 0;
+  int height_ = 0;
+  int chunks_x_ = 0;
+  int chunks_y_ = 0;
+
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+
+  // State of the current edit: previous content of every touched chunk
+  // (nullptr for chunks, which were not allocated).
+  int edit_depth_ = 0;
+  std::unordered_map<int, std::unique_ptr<ChunkTiles>> edit_before_;
+
+  std::deque<Edit> history_;
+  std::size_t history_pos_ = 0;
+  std::size_t history_bytes_ = 0;
+
+  // Oldest edits are dropped, once the history exceeds this size.
+  static constexpr std::size_t max_history_bytes = 64 * 1024 * 1024;
+};
@@ -1,92 +1,385 @@
 #include "TilingWidgetQt.hpp"
 
 #include <QHBoxLayout>
-#include <QGraphicsScene>
-#include <QGraphicsRectItem>
 #include <QComboBox>
+#include <QPainter>
+#include <QScrollBar>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
 
 namespace detail
 {
+  // Qt 6 replaced the integer position of the mouse events.
+  QPoint eventPos(QMouseEvent const* event)
+  {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    return event->position().toPoint();
+#else
+    return event->pos();
+#endif
+  }
+
   template<typename T>
   T clamp(T val, T min, T max)
   {
     return val < min ? min : (val > max ? max : val);
   }
+
+  QRgb tileColor(TileType type)
+  {
+    switch (type)
+    {
+    case TileType::Ground:
+      return QColor(Qt::green).rgb();
+    case TileType::Wall:
+      return QColor(Qt::gray).rgb();
+    case TileType::Water:
+      return QColor(Qt::blue).rgb();
+    case TileType::Clear:
+    default:
+      return QColor(Qt::white).rgb();
+    }
+  }
+
+  // Below this cell size (in screen pixels) the cells are no longer drawn one
+  // by one, but sampled per screen pixel instead.
+  constexpr double min_detailed_cell_size = 4.0;
+
+  // Below this cell size the grid lines are omitted.
+  constexpr double min_grid_line_cell_size = 8.0;
+
+  constexpr double max_zoom = 8.0;
 }
 
-TilesView::TilesView(int grid_width, int grid_height, int tile_size)
+TilesView::TilesView(TileMap const& tiles, int tile_size) :
+  tiles_(tiles), grid_width_(tiles.width()), grid_height_(tiles.height()), tile_size_(tile_size)
 {
-  auto tiles_scene = new QGraphicsScene(this);
-  this->setScene(tiles_scene);
-  this->setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
-  this->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+  this->setFrameShape(QFrame::NoFrame);
+  this->setHorizontalScrollBarPolicy(Qt::ScrollBarAsNeeded);
+  this->setVerticalScrollBarPolicy(Qt::ScrollBarAsNeeded);
 
-  for(int i = 0; i < grid_width; ++i)
-    for (int j = 0; j < grid_height; ++j)
+  // Everything is painted in paintEvent, so the background need not be erased.
+  this->viewport()->setAttribute(Qt::WA_OpaquePaintEvent);
+
+  updateScrollBars();
+}
+
+void TilesView::updateTiles(TileRect const& rect)
+{
+  if (rect.empty()) return;
+
+  this->viewport()->update(cellsRect(rect));
+}
+
+void TilesView::setHighlight(TileRect const& rect)
+{
+  // Repaint the area of the previous and of the new outline.
+  updateTiles(highlight_);
+  highlight_ = rect;
+  updateTiles(highlight_);
+}
+
+double TilesView::cellSize() const
+{
+  return tile_size_ * zoom_;
+}
+
+bool TilesView::cellAt(QPoint pos, int& grid_x, int& grid_y) const
+{
+  const auto cell_size = cellSize();
+  const auto map_x = pos.x() + this->horizontalScrollBar()->value();
+  const auto map_y = pos.y() + this->verticalScrollBar()->value();
+
+  const auto unclamped_x = static_cast<int>(std::floor(map_x / cell_size));
+  const auto unclamped_y = static_cast<int>(std::floor(map_y / cell_size));
+
+  grid_x = detail::clamp(unclamped_x, 0, grid_width_ - 1);
+  grid_y = detail::clamp(unclamped_y, 0, grid_height_ - 1);
+
+  return grid_x == unclamped_x && grid_y == unclamped_y;
+}
+
+QRect TilesView::cellsRect(TileRect const& rect) const
+{
+  const auto cell_size = cellSize();
+  const auto left = rect.x * cell_size - this->horizontalScrollBar()->value();
+  const auto top = rect.y * cell_size - this->verticalScrollBar()->value();
+  const auto right = (rect.x + rect.width) * cell_size - this->horizontalScrollBar()->value();
+  const auto bottom = (rect.y + rect.height) * cell_size - this->verticalScrollBar()->value();
+
+  // Grow by a pixel to include the grid lines on both sides.
+  const auto x = static_cast<int>(std::floor(left)) - 1;
+  const auto y = static_cast<int>(std::floor(top)) - 1;
+  const auto width = static_cast<int>(std::ceil(right)) + 2 - x;
+  const auto height = static_cast<int>(std::ceil(bottom)) + 2 - y;
+  return QRect(x, y, width, height);
+}
+
+void TilesView::setZoom(double zoom, QPoint anchor)
+{
+  // Never zoom out further than needed to see the whole grid.
+  const auto viewport_size = this->viewport()->size();
+  const auto fit_zoom = std::min(
+    double(viewport_size.width()) / (double(grid_width_) * tile_size_),
+    double(viewport_size.height()) / (double(grid_height_) * tile_size_));
+  const auto min_zoom = std::min(1.0, fit_zoom);
+
+  zoom = detail::clamp(zoom, min_zoom, detail::max_zoom);
+  if (zoom == zoom_) return;
+
+  // Keep the grid point under the anchor fixed.
+  const auto old_cell_size = cellSize();
+  const auto anchor_x = (anchor.x() + this->horizontalScrollBar()->value()) / old_cell_size;
+  const auto anchor_y = (anchor.y() + this->verticalScrollBar()->value()) / old_cell_size;
+
+  zoom_ = zoom;
+  updateScrollBars();
+
+  const auto new_cell_size = cellSize();
+  this->horizontalScrollBar()->setValue(static_cast<int>(anchor_x * new_cell_size) - anchor.x());
+  this->verticalScrollBar()->setValue(static_cast<int>(anchor_y * new_cell_size) - anchor.y());
+
+  this->viewport()->update();
+}
+
+void TilesView::updateScrollBars()
+{
+  const auto cell_size = cellSize();
+  const auto map_width = static_cast<int>(std::ceil(grid_width_ * cell_size));
+  const auto map_height = static_cast<int>(std::ceil(grid_height_ * cell_size));
+  const auto viewport_size = this->viewport()->size();
+
+  auto h_bar = this->horizontalScrollBar();
+  h_bar->setRange(0, std::max(0, map_width - viewport_size.width()));
+  h_bar->setPageStep(viewport_size.width());
+  h_bar->setSingleStep(std::max(1, static_cast<int>(cell_size)));
+
+  auto v_bar = this->verticalScrollBar();
+  v_bar->setRange(0, std::max(0, map_height - viewport_size.height()));
+  v_bar->setPageStep(viewport_size.height());
+  v_bar->setSingleStep(std::max(1, static_cast<int>(cell_size)));
+}
+
+void TilesView::paintCells(QPainter& painter, QRect const& rect)
+{
+  const auto cell_size = cellSize();
+  const auto offset_x = this->horizontalScrollBar()->value();
+  const auto offset_y = this->verticalScrollBar()->value();
+
+  // Range of cells intersecting the exposed rectangle.
+  const auto first_x = detail::clamp(int((rect.left() + offset_x) / cell_size), 0, grid_width_ - 1);
+  const auto last_x = detail::clamp(int((rect.right() + offset_x) / cell_size), 0, grid_width_ - 1);
+  const auto first_y = detail::clamp(int((rect.top() + offset_y) / cell_size), 0, grid_height_ - 1);
+  const auto last_y = detail::clamp(int((rect.bottom() + offset_y) / cell_size), 0, grid_height_ - 1);
+
+  // Fill runs of equal cells within a row with a single rectangle.
+  row_buffer_.resize(last_x - first_x + 1);
+  for (int j = first_y; j <= last_y; ++j)
+  {
+    tiles_.readRow(first_x, j, last_x - first_x + 1, row_buffer_.data());
+    const auto row = row_buffer_.data() - first_x;
+    const auto top = j * cell_size - offset_y;
+
+    int run_begin = first_x;
+    for (int i = first_x + 1; i <= last_x + 1; ++i)
     {
-      const auto left = i * tile_size;
-      const auto top = j * tile_size;
-      QRectF tile_rect(left, top, tile_size, tile_size);
-      auto tile_item = tiles_scene->addRect(tile_rect);
+      if (i <= last_x && row[i] == row[run_begin]) continue;
+
+      const auto left = run_begin * cell_size - offset_x;
+      const QRectF run_rect(left, top, (i - run_begin) * cell_size, cell_size);
+      painter.fillRect(run_rect, QColor(detail::tileColor(row[run_begin])));
+
+      run_begin = i;
     }
+  }
+
+  if (cell_size < detail::min_grid_line_cell_size) return;
+
+  painter.setPen(Qt::black);
+
+  const auto grid_left = first_x * cell_size - offset_x;
+  const auto grid_right = (last_x + 1) * cell_size - offset_x;
+  const auto grid_top = first_y * cell_size - offset_y;
+  const auto grid_bottom = (last_y + 1) * cell_size - offset_y;
+
+  for (int i = first_x; i <= last_x + 1; ++i)
+  {
+    const auto x = i * cell_size - offset_x;
+    painter.drawLine(QLineF(x, grid_top, x, grid_bottom));
+  }
+
+  for (int j = first_y; j <= last_y + 1; ++j)
+  {
+    const auto y = j * cell_size - offset_y;
+    painter.drawLine(QLineF(grid_left, y, grid_right, y));
+  }
 }
 
-void TilesView::setActiveTileType(TileType type)
+void TilesView::paintLowDetail(QPainter& painter, QRect const& rect)
 {
-  switch (type)
+  // Cells are smaller than a few pixels, so each screen pixel is sampled from
+  // the cell under its center. The cost is proportional to the exposed area
+  // regardless of the number of cells in the grid.
+  if (lod_image_.size() != rect.size())
+    lod_image_ = QImage(rect.size(), QImage::Format_RGB32);
+
+  const auto cell_size = cellSize();
+  const auto offset_x = this->horizontalScrollBar()->value();
+  const auto offset_y = this->verticalScrollBar()->value();
+  const auto background = this->palette().color(QPalette::Window).rgb();
+
+  const QRgb colors[] = {
+    detail::tileColor(TileType::Clear), detail::tileColor(TileType::Ground),
+    detail::tileColor(TileType::Wall), detail::tileColor(TileType::Water) };
+
+  // Column to cell mapping is the same for every row.
+  column_buffer_.resize(rect.width());
+  const auto columns = column_buffer_.data();
+  for (int px = 0; px < rect.width(); ++px)
   {
-  case TileType::Clear:
-    active_brush_ = QBrush(Qt::white);
-    break;
-  case TileType::Ground:
-    active_brush_ = QBrush(Qt::green);
-    break;
-  case TileType::Wall:
-    active_brush_ = QBrush(Qt::gray);
-    break;
-  case TileType::Water:
-    active_brush_ = QBrush(Qt::blue);
-    break;
+    const auto grid_x = int((rect.left() + px + offset_x + 0.5) / cell_size);
+    columns[px] = grid_x < grid_width_ ? grid_x : -1;
   }
+
+  for (int py = 0; py < rect.height(); ++py)
+  {
+    auto line = reinterpret_cast<QRgb*>(lod_image_.scanLine(py));
+    const auto grid_y = int((rect.top() + py + offset_y + 0.5) / cell_size);
+    if (grid_y >= grid_height_)
+    {
+      std::fill(line, line + rect.width(), background);
+      continue;
+    }
+
+    for (int px = 0; px < rect.width(); ++px)
+    {
+      const auto grid_x = columns[px];
+      line[px] = grid_x < 0 ? background : colors[int(tiles_.at(grid_x, grid_y))];
+    }
+  }
+
+  painter.drawImage(rect.topLeft(), lod_image_);
 }
 
-void TilesView::labelTileAt(QPoint pos)
+void TilesView::paintEvent(QPaintEvent* event)
+{
+  QPainter painter(this->viewport());
+  const auto rect = event->rect();
+
+  if (cellSize() < detail::min_detailed_cell_size)
+  {
+    paintLowDetail(painter, rect);
+  }
+  else
+  {
+    // Area outside of the grid (visible, when the grid is smaller than the view).
+    painter.fillRect(rect, this->palette().color(QPalette::Window));
+    paintCells(painter, rect);
+  }
+
+  if (!highlight_.empty())
+  {
+    const auto cell_size = cellSize();
+    const QRectF outline(
+      highlight_.x * cell_size - this->horizontalScrollBar()->value(),
+      highlight_.y * cell_size - this->verticalScrollBar()->value(),
+      highlight_.width * cell_size, highlight_.height * cell_size);
+
+    painter.setPen(Qt::red);
+    painter.setBrush(Qt::NoBrush);
+    painter.drawRect(outline);
+  }
+}
+
+void TilesView::resizeEvent(QResizeEvent* event)
+{
+  QAbstractScrollArea::resizeEvent(event);
+  updateScrollBars();
+}
+
+void TilesView::scrollContentsBy(int dx, int dy)
 {
-  if (auto item = this->itemAt(pos); item)
+  // Shift the already painted content, so that only the exposed strip is repainted.
+  this->viewport()->scroll(dx, dy);
+}
+
+void TilesView::wheelEvent(QWheelEvent* event)
+{
+  if (!(event->modifiers() & Qt::ControlModifier))
   {
-    static_cast<QGraphicsRectItem*>(item)->setBrush(active_brush_);
-    emit tileLabeledAt(pos);
+    QAbstractScrollArea::wheelEvent(event);
+    return;
   }
+
+  // One wheel notch (120 units) zooms by roughly 20 percent.
+  const auto factor = std::pow(2.0, event->angleDelta().y() / 480.0);
+  setZoom(zoom_ * factor, event->position().toPoint());
+  event->accept();
+}
+
+void TilesView::labelTileAt(QPoint pos)
+{
+  int grid_x = 0, grid_y = 0;
+  cellAt(pos, grid_x, grid_y);
+  if (grid_x == last_x_ && grid_y == last_y_) return;
+
+  last_x_ = grid_x;
+  last_y_ = grid_y;
+  emit tileLabeledAt(grid_x, grid_y);
 }
 
 void TilesView::mousePressEvent(QMouseEvent* event)
 {
-  labelTileAt(event->pos());
+  int grid_x = 0, grid_y = 0;
+  if (!cellAt(detail::eventPos(event), grid_x, grid_y)) return;
+
+  last_x_ = grid_x;
+  last_y_ = grid_y;
+  emit tilePressedAt(grid_x, grid_y);
 }
 
 void TilesView::mouseMoveEvent(QMouseEvent* event)
 {
-  labelTileAt(event->pos());
+  if (last_x_ < 0) return;
+
+  labelTileAt(detail::eventPos(event));
+}
+
+void TilesView::mouseReleaseEvent(QMouseEvent* event)
+{
+  if (last_x_ < 0) return;
+
+  int grid_x = 0, grid_y = 0;
+  cellAt(detail::eventPos(event), grid_x, grid_y);
+
+  last_x_ = -1;
+  last_y_ = -1;
+  emit tileReleasedAt(grid_x, grid_y);
 }
 
 TilingWidget::TilingWidget(QWidget* parent) : QWidget(parent)
 {
 }
 
-void TilingWidget::setConfiguration(int window_width, int window_height, int tile_size)
+void TilingWidget::setConfiguration(int window_width, int window_height, int tile_size, int screens_x, int screens_y)
 {
-  const auto grid_width = window_width / tile_size;
-  const auto grid_height = window_height / tile_size;
+  const auto screen_grid_width = window_width / tile_size;
+  const auto screen_grid_height = window_height / tile_size;
+
+  // The map spans the requested number of screens.
+  const auto grid_width = screen_grid_width * screens_x;
+  const auto grid_height = screen_grid_height * screens_y;
 
-  tiles_.resize(grid_width * grid_height);
+  tiles_ = std::make_unique<TileMap>(grid_width, grid_height);
 
-  const auto actual_window_width = grid_width * tile_size;
-  const auto actual_window_height = grid_height * tile_size;
+  const auto actual_window_width = screen_grid_width * tile_size;
+  const auto actual_window_height = screen_grid_height * tile_size;
 
-  auto tiles_view = new TilesView(grid_width, grid_height, tile_size);
-  tiles_view->setFixedSize(actual_window_width, actual_window_height);
+  tiles_view_ = new TilesView(*tiles_, tile_size);
+  tiles_view_->setFixedSize(actual_window_width, actual_window_height);
 
   auto type_combo_box = new QComboBox();
   type_combo_box->addItem(QString("Clear"), (int)TileType::Clear);
@@ -94,38 +387,167 @@ void TilingWidget::setConfiguration(int window_width, int window_height, int til
   type_combo_box->addItem(QString("Wall"), (int)TileType::Wall);
   type_combo_box->addItem(QString("Water"), (int)TileType::Water);
 
+  auto tool_combo_box = new QComboBox();
+  tool_combo_box->addItem(QString("Paint"), (int)EditTool::Paint);
+  tool_combo_box->addItem(QString("Rectangle"), (int)EditTool::Rectangle);
+  tool_combo_box->addItem(QString("Flood fill"), (int)EditTool::FloodFill);
+  tool_combo_box->addItem(QString("Select & copy"), (int)EditTool::Select);
+  tool_combo_box->addItem(QString("Paste"), (int)EditTool::Paste);
+
+  undo_button_ = new QPushButton("Undo");
+  undo_button_->setShortcut(QKeySequence::Undo);
+
+  redo_button_ = new QPushButton("Redo");
+  redo_button_->setShortcut(QKeySequence::Redo);
+
   auto toolbar_layout = new QVBoxLayout();
   toolbar_layout->addWidget(type_combo_box);
+  toolbar_layout->addWidget(tool_combo_box);
+  toolbar_layout->addWidget(undo_button_);
+  toolbar_layout->addWidget(redo_button_);
   toolbar_layout->addStretch();
 
   auto top_layout = new QHBoxLayout();
   this->setLayout(top_layout);
-  top_layout->addWidget(tiles_view);
+  top_layout->addWidget(tiles_view_);
   top_layout->addLayout(toolbar_layout);
 
-  QObject::connect(tiles_view, &TilesView::tileLabeledAt, 
-    [this, grid_width, grid_height, tile_size](QPoint pos)
-    {
-      // Compute grid 2d index.
-      const auto grid_x = detail::clamp(pos.x() / tile_size, 0, grid_width - 1);
-      const auto grid_y = detail::clamp(pos.y() / tile_size, 0, grid_height - 1);
+  QObject::connect(tiles_view_, &TilesView::tilePressedAt, 
+    [this](int grid_x, int grid_y) { tilePressedAt(grid_x, grid_y); });
 
-      // Transform into linear index.
-      const auto lin_index = grid_y * grid_width + grid_x;
+  QObject::connect(tiles_view_, &TilesView::tileLabeledAt, 
+    [this](int grid_x, int grid_y) { tileLabeledAt(grid_x, grid_y); });
 
-      // Save.
-      tiles_.at(lin_index).type = active_type_;
-    });
+  QObject::connect(tiles_view_, &TilesView::tileReleasedAt, 
+    [this](int grid_x, int grid_y) { tileReleasedAt(grid_x, grid_y); });
+
+  QObject::connect(undo_button_, &QPushButton::clicked, [this]() { undo(); });
+  QObject::connect(redo_button_, &QPushButton::clicked, [this]() { redo(); });
 
   QObject::connect(type_combo_box, &QComboBox::currentTextChanged,
-    [this, type_combo_box, tiles_view](QString const& index)
+    [this, type_combo_box](QString const& index)
     {
       const auto current_data = type_combo_box->currentData(Qt::UserRole);
       if (!current_data.isValid()) return;
 
-      const auto active_tile_type = (TileType)current_data.toInt();
+      this->active_type_ = (TileType)current_data.toInt();
+    });
+
+  QObject::connect(tool_combo_box, &QComboBox::currentTextChanged,
+    [this, tool_combo_box](QString const& index)
+    {
+      const auto current_data = tool_combo_box->currentData(Qt::UserRole);
+      if (!current_data.isValid()) return;
 
-      this->active_type_ = active_tile_type;
-      tiles_view->setActiveTileType(active_tile_type);
+      this->active_tool_ = (EditTool)current_data.toInt();
+      tiles_view_->setHighlight(TileRect{});
     });
+
+  updateHistoryButtons();
+}
+
+void TilingWidget::tilePressedAt(int grid_x, int grid_y)
+{
+  anchor_x_ = grid_x;
+  anchor_y_ = grid_y;
+
+  switch (active_tool_)
+  {
+  case EditTool::Paint:
+    // The whole stroke forms a single undo step.
+    painting_ = true;
+    tiles_->beginEdit();
+    if (tiles_->set(grid_x, grid_y, active_type_))
+      updateTiles(TileRect{ grid_x, grid_y, 1, 1 });
+    break;
+  case EditTool::Rectangle:
+  case EditTool::Select:
+    tiles_view_->setHighlight(TileRect{ grid_x, grid_y, 1, 1 });
+    break;
+  case EditTool::FloodFill:
+    updateTiles(tiles_->floodFill(grid_x, grid_y, active_type_));
+    break;
+  case EditTool::Paste:
+    updateTiles(tiles_->paste(clipboard_, grid_x, grid_y));
+    break;
+  }
+
+  updateHistoryButtons();
+}
+
+void TilingWidget::tileLabeledAt(int grid_x, int grid_y)
+{
+  switch (active_tool_)
+  {
+  case EditTool::Paint:
+    if (painting_ && tiles_->set(grid_x, grid_y, active_type_))
+      updateTiles(TileRect{ grid_x, grid_y, 1, 1 });
+    break;
+  case EditTool::Rectangle:
+  case EditTool::Select:
+  {
+    const auto left = std::min(anchor_x_, grid_x);
+    const auto top = std::min(anchor_y_, grid_y);
+    const auto width = std::abs(grid_x - anchor_x_) + 1;
+    const auto height = std::abs(grid_y - anchor_y_) + 1;
+    tiles_view_->setHighlight(TileRect{ left, top, width, height });
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void TilingWidget::tileReleasedAt(int grid_x, int grid_y)
+{
+  const auto left = std::min(anchor_x_, grid_x);
+  const auto top = std::min(anchor_y_, grid_y);
+  const TileRect rect{ left, top, std::abs(grid_x - anchor_x_) + 1, std::abs(grid_y - anchor_y_) + 1 };
+
+  switch (active_tool_)
+  {
+  case EditTool::Paint:
+    if (painting_) tiles_->endEdit();
+    painting_ = false;
+    break;
+  case EditTool::Rectangle:
+    tiles_view_->setHighlight(TileRect{});
+    updateTiles(tiles_->fillRect(rect, active_type_));
+    break;
+  case EditTool::Select:
+    // Keep the selection outlined to show what has been copied.
+    clipboard_ = tiles_->copyRegion(rect);
+    break;
+  default:
+    break;
+  }
+
+  updateHistoryButtons();
+}
+
+void TilingWidget::undo()
+{
+  if (painting_) return;
+
+  updateTiles(tiles_->undo());
+  updateHistoryButtons();
+}
+
+void TilingWidget::redo()
+{
+  if (painting_) return;
+
+  updateTiles(tiles_->redo());
+  updateHistoryButtons();
+}
+
+void TilingWidget::updateTiles(TileRect const& rect)
+{
+  tiles_view_->updateTiles(rect);
+}
+
+void TilingWidget::updateHistoryButtons()
+{
+  undo_button_->setEnabled(tiles_->canUndo());
+  redo_button_->setEnabled(tiles_->canRedo());
 }
@@ -1,15 +1,20 @@
 #pragma once
 
 #include <QWidget>
-#include <QGraphicsView>
+#include <QAbstractScrollArea>
 #include <QMouseEvent>
+#include <QWheelEvent>
+#include <QPaintEvent>
+#include <QImage>
+#include <QPushButton>
 
-enum class TileType { Clear = 0, Ground, Wall, Water };
+#include "TileMap.hpp"
 
-struct Tile
-{
-  TileType type = TileType::Clear;
-};
+#include <memory>
+
+enum class EditTool { Paint = 0, Rectangle, FloodFill, Select, Paste };
+
+class TilesView;
 
 class TilingWidget : public QWidget
 {
@@ -18,30 +23,99 @@ class TilingWidget : public QWidget
 public:
   explicit TilingWidget(QWidget* parent = nullptr);
 
-  void setConfiguration(int window_width, int window_height, int tile_size);
+  void setConfiguration(int window_width, int window_height, int tile_size, int screens_x, int screens_y);
 
 private:
+  void tilePressedAt(int grid_x, int grid_y);
+  void tileLabeledAt(int grid_x, int grid_y);
+  void tileReleasedAt(int grid_x, int grid_y);
+
+  void undo();
+  void redo();
+
+  void updateTiles(TileRect const& rect);
+  void updateHistoryButtons();
+
   TileType active_type_ = TileType::Clear;
-  std::vector<Tile> tiles_;
+  EditTool active_tool_ = EditTool::Paint;
+  std::unique_ptr<TileMap> tiles_;
+
+  // Start of the current rectangle or selection drag.
+  int anchor_x_ = -1;
+  int anchor_y_ = -1;
+  bool painting_ = false;
+
+  TileRegion clipboard_;
+
+  TilesView* tiles_view_ = nullptr;
+  QPushButton* undo_button_ = nullptr;
+  QPushButton* redo_button_ = nullptr;
 };
 
-class TilesView : public QGraphicsView
+// Canvas, which paints the tiles directly from the tile map. Cells are
+// addressed by index arithmetic (no per-cell scene items), only the touched
+// cells are repainted and zoomed out views are rendered at a reduced level of
+// detail, so that the cost of a repaint is bounded by the viewport size and
+// not by the size of the grid.
+class TilesView : public QAbstractScrollArea
 {
   Q_OBJECT
 
 public:
-  explicit TilesView(int grid_width, int grid_height, int tile_size);
+  explicit TilesView(TileMap const& tiles, int tile_size);
 
-  void setActiveTileType(TileType type);
+  // Repaints the cells after they have been modified.
+  void updateTiles(TileRect const& rect);
+
+  // Outlines the rectangle (e.g. the current selection). Empty to hide.
+  void setHighlight(TileRect const& rect);
 
 signals:
-  void tileLabeledAt(QPoint pos);
+  void tilePressedAt(int grid_x, int grid_y);
+  void tileLabeledAt(int grid_x, int grid_y);
+  void tileReleasedAt(int grid_x, int grid_y);
 
 private:
   void labelTileAt(QPoint pos);
 
+  // Size of a single cell on the screen in pixels.
+  double cellSize() const;
+
+  // Computes the cell, clamped to the grid. Returns false, if the viewport
+  // position is not inside the grid.
+  bool cellAt(QPoint pos, int& grid_x, int& grid_y) const;
+
+  QRect cellsRect(TileRect const& rect) const;
+
+  void setZoom(double zoom, QPoint anchor);
+  void updateScrollBars();
+
+  void paintCells(QPainter& painter, QRect const& rect);
+  void paintLowDetail(QPainter& painter, QRect const& rect);
+
+  void paintEvent(QPaintEvent* event) override;
+  void resizeEvent(QResizeEvent* event) override;
+  void scrollContentsBy(int dx, int dy) override;
+  void wheelEvent(QWheelEvent* event) override;
   void mousePressEvent(QMouseEvent* event) override;
   void mouseMoveEvent(QMouseEvent* event) override;
+  void mouseReleaseEvent(QMouseEvent* event) override;
+
+  TileMap const& tiles_;
+  int grid_width_ = 0;
+  int grid_height_ = 0;
+  int tile_size_ = 0;
+
+  double zoom_ = 1.0;
+
+  // Last labeled cell, so that moving within a cell does not relabel it.
+  int last_x_ = -1;
+  int last_y_ = -1;
+
+  TileRect highlight_;
 
-  QBrush active_brush_;
+  // Reused between paints.
+  QImage lod_image_;
+  std::vector<TileType> row_buffer_;
+  std::vector<int> column_buffer_;
 };
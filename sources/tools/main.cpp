@@ -17,8 +17,8 @@ int main(int argc, char* argv[])
   main_widget->addWidget(tiling_widget);
 
   QObject::connect(configuring_widget, &ConfiguringWidget::configuringDone,
-    [main_widget, tiling_widget](int window_width, int window_height, int tile_size) {
-      tiling_widget->setConfiguration(window_width, window_height, tile_size);
+    [main_widget, tiling_widget](int window_width, int window_height, int tile_size, int screens_x, int screens_y) {
+      tiling_widget->setConfiguration(window_width, window_height, tile_size, screens_x, screens_y);
       main_widget->setCurrentWidget(tiling_widget);
     });
 